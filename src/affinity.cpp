@@ -0,0 +1,189 @@
+#include "affinity.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace kvstore {
+
+namespace {
+
+#ifdef __linux__
+// From <numaif.h>, which is part of libnuma rather than the C library.
+constexpr int kMpolPreferred = 1;
+#endif
+
+bool parse_int(std::string_view text, int& value) {
+  auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+  return error == std::errc() && end == text.data() + text.size() && value >= 0;
+}
+
+CpuTopology discover() {
+  std::vector<std::pair<int, std::vector<int>>> found;
+#ifdef __linux__
+  std::error_code error;
+  for (const auto& dir : std::filesystem::directory_iterator("/sys/devices/system/node", error)) {
+    std::string name = dir.path().filename().string();
+    int id = 0;
+    if (name.rfind("node", 0) != 0 || !parse_int(std::string_view(name).substr(4), id)) {
+      continue;
+    }
+    std::ifstream file(dir.path() / "cpulist");
+    std::string line;
+    std::getline(file, line);
+    try {
+      std::vector<int> cpus = parse_cpu_list(line);
+      if (!cpus.empty()) {
+        found.emplace_back(id, std::move(cpus));
+      }
+    } catch (const std::runtime_error&) {
+    }
+  }
+#endif
+  if (found.empty()) {
+    std::vector<int> cpus(std::max(1u, std::thread::hardware_concurrency()));
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      cpus[i] = static_cast<int>(i);
+    }
+    found.emplace_back(0, std::move(cpus));
+  }
+  std::sort(found.begin(), found.end());
+  std::vector<std::vector<int>> node_cpus;
+  std::vector<int> kernel_ids;
+  for (auto& [id, cpus] : found) {
+    kernel_ids.push_back(id);
+    node_cpus.push_back(std::move(cpus));
+  }
+  return CpuTopology(std::move(node_cpus), std::move(kernel_ids));
+}
+
+} // namespace
+
+CpuTopology::CpuTopology(std::vector<std::vector<int>> node_cpus, std::vector<int> kernel_ids)
+    : node_cpus_(std::move(node_cpus)), kernel_ids_(std::move(kernel_ids)) {
+  if (kernel_ids_.size() != node_cpus_.size()) {
+    kernel_ids_.resize(node_cpus_.size());
+    for (size_t node = 0; node < kernel_ids_.size(); ++node) {
+      kernel_ids_[node] = static_cast<int>(node);
+    }
+  }
+  for (size_t node = 0; node < node_cpus_.size(); ++node) {
+    for (int cpu : node_cpus_[node]) {
+      if (static_cast<size_t>(cpu) >= cpu_nodes_.size()) {
+        cpu_nodes_.resize(static_cast<size_t>(cpu) + 1, -1);
+      }
+      cpu_nodes_[static_cast<size_t>(cpu)] = static_cast<int>(node);
+    }
+  }
+}
+
+const CpuTopology& CpuTopology::system() {
+  static const CpuTopology topology = discover();
+  return topology;
+}
+
+int CpuTopology::node_of(int cpu) const {
+  if (cpu < 0 || static_cast<size_t>(cpu) >= cpu_nodes_.size()) {
+    return -1;
+  }
+  return cpu_nodes_[static_cast<size_t>(cpu)];
+}
+
+int CpuTopology::current_node() const {
+  if (node_cpus_.size() == 1) {
+    return 0;
+  }
+#ifdef __linux__
+  return node_of(sched_getcpu());
+#else
+  return -1;
+#endif
+}
+
+void CpuTopology::bind_memory(void* addr, size_t bytes, size_t node) const {
+#if defined(__linux__) && defined(SYS_mbind)
+  if (node_cpus_.size() < 2 || node >= kernel_ids_.size()) {
+    return;
+  }
+  constexpr size_t kMaskBits = 8 * sizeof(unsigned long);
+  int id = kernel_ids_[node];
+  std::vector<unsigned long> mask(static_cast<size_t>(id) / kMaskBits + 1, 0);
+  mask[static_cast<size_t>(id) / kMaskBits] |= 1UL << (static_cast<size_t>(id) % kMaskBits);
+  // Placement is a preference: a failure leaves the default first-touch policy.
+  syscall(SYS_mbind, addr, bytes, kMpolPreferred, mask.data(), mask.size() * kMaskBits + 1, 0);
+#else
+  (void)addr;
+  (void)bytes;
+  (void)node;
+#endif
+}
+
+std::vector<int> parse_cpu_list(std::string_view text) {
+  std::vector<int> cpus;
+  while (!text.empty() && (text.back() == '\n' || text.back() == ' ')) {
+    text.remove_suffix(1);
+  }
+  while (!text.empty()) {
+    size_t comma = text.find(',');
+    std::string_view item = text.substr(0, comma);
+    text = comma == std::string_view::npos ? std::string_view() : text.substr(comma + 1);
+    size_t dash = item.find('-');
+    int first = 0;
+    int last = 0;
+    if (!parse_int(item.substr(0, dash), first) ||
+        !parse_int(dash == std::string_view::npos ? item : item.substr(dash + 1), last) || last < first) {
+      throw std::runtime_error("invalid CPU list");
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<std::vector<int>> plan_cpu_sets(const CpuTopology& topology, std::string_view cpu_list, bool by_node) {
+  std::vector<std::vector<int>> sets;
+  if (!cpu_list.empty()) {
+    for (int cpu : parse_cpu_list(cpu_list)) {
+      sets.push_back({cpu});
+    }
+  } else if (by_node) {
+    for (size_t node = 0; node < topology.nodes(); ++node) {
+      sets.push_back(topology.cpus(node));
+    }
+  }
+  return sets;
+}
+
+bool pin_current_thread(const std::vector<int>& cpus) {
+#ifdef __linux__
+  if (cpus.empty()) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+} // namespace kvstore
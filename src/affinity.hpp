@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace kvstore {
+
+// CPUs of each NUMA node. On Linux they are read from
+// /sys/devices/system/node; elsewhere, or without that directory, every CPU
+// is on node 0. Nodes are numbered densely from 0 in kernel order, and nodes
+// without CPUs are left out.
+class CpuTopology {
+ public:
+  explicit CpuTopology(std::vector<std::vector<int>> node_cpus, std::vector<int> kernel_ids = {});
+
+  // Discovered once, on first use.
+  static const CpuTopology& system();
+
+  size_t nodes() const { return node_cpus_.size(); }
+  const std::vector<int>& cpus(size_t node) const { return node_cpus_[node]; }
+  // Node of `cpu`, or -1 if it is not listed.
+  int node_of(int cpu) const;
+  // Node the calling thread is running on right now, or -1 if unknown.
+  int current_node() const;
+  // Asks the kernel to back [addr, addr + bytes) with memory of `node`, falling
+  // back to other nodes when it is full. Must run before the pages are first
+  // touched; does nothing outside Linux.
+  void bind_memory(void* addr, size_t bytes, size_t node) const;
+
+ private:
+  std::vector<std::vector<int>> node_cpus_;
+  // Kernel node id of each dense node.
+  std::vector<int> kernel_ids_;
+  // Dense node of each CPU id, -1 for gaps.
+  std::vector<int> cpu_nodes_;
+};
+
+// Parses a CPU list such as "0-3,8,10-11". Throws std::runtime_error if it is
+// malformed.
+std::vector<int> parse_cpu_list(std::string_view text);
+
+// CPU set for each of a group of threads: every CPU of `cpu_list` on its own,
+// or with an empty list and `by_node`, every node's CPUs. Thread i takes set
+// i modulo the count; an empty result leaves the threads unpinned.
+std::vector<std::vector<int>> plan_cpu_sets(const CpuTopology& topology, std::string_view cpu_list, bool by_node);
+
+// Restricts the calling thread to `cpus`. Returns false if the set is empty,
+// the kernel refused it, or the platform is not Linux.
+bool pin_current_thread(const std::vector<int>& cpus);
+
+} // namespace kvstore
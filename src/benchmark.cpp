@@ -1,63 +1,1045 @@
 #include "benchmark.hpp"
 #include "config.hpp"
+#include "core_group.hpp"
+#include "flat_hash_map.hpp"
 #include "metrics.hpp"
 #include "net.hpp"
+#include "persistence.hpp"
+#include "storage.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <shared_mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 namespace kvstore {
 
-BenchmarkRunner::BenchmarkRunner(const Config& config, Metrics& metrics)
-    : config_(config), metrics_(metrics) {}
+namespace {
 
-void BenchmarkRunner::run() {
-  using namespace std::chrono;
+// Resident set size of this process, or 0 where it is not available.
+uint64_t resident_bytes() {
+#ifdef __linux__
+  std::ifstream statm("/proc/self/statm");
+  uint64_t total_pages = 0;
+  uint64_t resident_pages = 0;
+  if (statm >> total_pages >> resident_pages) {
+    return resident_pages * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+  }
+#endif
+  return 0;
+}
 
-  net::NetContext ctx;
+bool read_line(net::Socket sock, std::string& pending) {
+  char buf[4096];
+  while (true) {
+    size_t pos = pending.find('\n');
+    if (pos != std::string::npos) {
+      pending.erase(0, pos + 1);
+      return true;
+    }
+    int n = net::recv_data(sock, buf, sizeof(buf));
+    if (n <= 0) {
+      return false;
+    }
+    pending.append(buf, buf + n);
+  }
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  return sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+}
+
+struct BenchEntry {
+  std::string value;
+  uint64_t version = 0;
+};
+
+struct StringHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view key) const { return std::hash<std::string_view>{}(key); }
+};
+
+struct StringEqual {
+  using is_transparent = void;
+  bool operator()(std::string_view lhs, std::string_view rhs) const { return lhs == rhs; }
+};
+
+struct MapTimings {
+  double put_ns = 0.0;
+  double get_ns = 0.0;
+  double miss_ns = 0.0;
+  double del_ns = 0.0;
+};
+
+template <typename Fn>
+double ns_per_op(size_t ops, Fn&& fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+  return ops == 0 ? 0.0 : static_cast<double>(elapsed.count()) / static_cast<double>(ops);
+}
+
+// PUT every key, GET them back in random order, probe as many absent keys, then
+// DEL everything, timing each phase separately.
+template <typename MapType>
+MapTimings bench_map(const std::vector<std::string>& keys, const std::vector<std::string>& misses,
+                     const std::vector<uint32_t>& order) {
+  MapTimings timings;
+  MapType map;
+  uint64_t checksum = 0;
+  timings.put_ns = ns_per_op(keys.size(), [&]() {
+    for (size_t i = 0; i < keys.size(); ++i) {
+      map.try_emplace(keys[i], BenchEntry{std::to_string(i & 0xFFFF), i});
+    }
+  });
+  timings.get_ns = ns_per_op(order.size(), [&]() {
+    for (uint32_t idx : order) {
+      auto it = map.find(std::string_view(keys[idx]));
+      checksum += it == map.end() ? 0 : it->second.version;
+    }
+  });
+  timings.miss_ns = ns_per_op(misses.size(), [&]() {
+    for (const auto& key : misses) {
+      checksum += map.find(std::string_view(key)) == map.end() ? 1 : 0;
+    }
+  });
+  timings.del_ns = ns_per_op(order.size(), [&]() {
+    for (uint32_t idx : order) {
+      map.erase(map.find(std::string_view(keys[idx])));
+    }
+  });
+  if (checksum == 0 || !map.empty()) {
+    std::cerr << "map benchmark checksum mismatch\n";
+  }
+  return timings;
+}
+
+// Runs `ops` GET/PUT operations per thread against `store` from `threads`
+// threads at once and returns the aggregate rate. With `global_lock` set every
+// operation also holds it shared, the way every store operation used to hold
+// the store-wide rebalance lock.
+// Stress values check themselves: the first byte seeds both the length and
+// every later byte, so a value stitched together from two writes, or cut to
+// another write's length, fails the check.
+size_t stress_value_size(uint8_t seed) {
+  return 1 + (static_cast<size_t>(seed) * 37) % 255;
+}
+
+char stress_byte(uint8_t seed, size_t index) {
+  return static_cast<char>(seed ^ static_cast<uint8_t>(index * 31));
+}
+
+void make_stress_value(uint8_t seed, std::string& value) {
+  value.resize(stress_value_size(seed));
+  value[0] = static_cast<char>(seed);
+  for (size_t i = 1; i < value.size(); ++i) {
+    value[i] = stress_byte(seed, i);
+  }
+}
+
+// Scans all of `store`, `count` keys per call, and returns how many of `keys`
+// (all live) were missed or repeated, plus one if the scan did not finish
+// within `max_calls` calls.
+uint64_t scan_errors(ShardedStore& store, const std::vector<std::string>& keys, size_t count, size_t max_calls) {
+  std::unordered_map<std::string, uint32_t> seen;
+  uint64_t cursor = 0;
+  size_t calls = 0;
+  do {
+    ScanPage page = store.scan(cursor, {}, count);
+    for (auto& key : page.keys) {
+      seen[std::move(key)]++;
+    }
+    cursor = page.cursor;
+  } while (cursor != 0 && ++calls < max_calls);
+  uint64_t errors = cursor == 0 ? 0 : 1;
+  for (const auto& key : keys) {
+    auto it = seen.find(key);
+    errors += it == seen.end() ? 1 : it->second - 1;
+  }
+  return errors;
+}
+
+bool stress_value_intact(std::string_view value) {
+  if (value.empty()) {
+    return false;
+  }
+  auto seed = static_cast<uint8_t>(value[0]);
+  if (value.size() != stress_value_size(seed)) {
+    return false;
+  }
+  for (size_t i = 1; i < value.size(); ++i) {
+    if (value[i] != stress_byte(seed, i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+double store_ops_per_sec(ShardedStore& store, const std::vector<std::string>& keys, uint32_t threads, uint64_t ops,
+                         double read_ratio, double hotspot_ratio, std::shared_mutex* global_lock) {
+  std::atomic<uint32_t> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      std::mt19937_64 rng(104729u * (t + 1));
+      std::uniform_real_distribution<double> coin(0.0, 1.0);
+      size_t hot_keys = std::max<size_t>(keys.size() / 100, 1);
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      for (uint64_t i = 0; i < ops; ++i) {
+        const std::string& key = keys[coin(rng) < hotspot_ratio ? rng() % hot_keys : rng() % keys.size()];
+        bool read = coin(rng) < read_ratio;
+        std::shared_lock<std::shared_mutex> lock;
+        if (global_lock != nullptr) {
+          lock = std::shared_lock<std::shared_mutex>(*global_lock);
+        }
+        if (read) {
+          store.get(key);
+        } else {
+          store.put(key, "v", std::nullopt);
+        }
+      }
+    });
+  }
+  while (ready.load() < threads) {
+    std::this_thread::yield();
+  }
+  auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+  return elapsed.count() == 0 ? 0.0 : static_cast<double>(ops * threads) * 1e9 / static_cast<double>(elapsed.count());
+}
+
+// Each of `threads` threads writes `ops` random keys. Locked, a thread writes
+// every shard itself; per core, thread t is core t of a CoreGroup and hands
+// each write to the core owning the key's shard, in windows of 64 as the
+// server does.
+double write_ops_per_sec(ShardedStore& store, const std::vector<std::string>& keys, uint32_t threads, uint64_t ops,
+                         bool per_core) {
+  constexpr uint64_t kWindow = 64;
+  CoreGroup group(threads);
+  std::atomic<uint32_t> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      std::mt19937_64 rng(104729u * (t + 1));
+      group.attach(t);
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      for (uint64_t i = 0; i < ops;) {
+        if (!per_core) {
+          store.put(keys[rng() % keys.size()], "v", std::nullopt);
+          ++i;
+          continue;
+        }
+        CoreGroup::Gather gather(group);
+        for (uint64_t end = std::min(i + kWindow, ops); i < end; ++i) {
+          const std::string& key = keys[rng() % keys.size()];
+          gather.run(group.owner(store.home_shard(key)), [&store, &key]() { store.put(key, "v", std::nullopt); });
+        }
+      }
+      group.leave();
+    });
+  }
+  while (ready.load() < threads) {
+    std::this_thread::yield();
+  }
+  auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+  return elapsed.count() == 0 ? 0.0 : static_cast<double>(ops * threads) * 1e9 / static_cast<double>(elapsed.count());
+}
+
+// The pool the server used before ThreadPool: one mutex-guarded queue of
+// std::function shared by every submitter and worker, with each submission
+// allocating a packaged_task and the shared state of its future. Kept as the
+// baseline for --bench-mode pool.
+class QueuePool {
+ public:
+  QueuePool(size_t threads, size_t max_queue_depth) : max_queue_depth_(max_queue_depth) {
+    for (size_t i = 0; i < threads; ++i) {
+      workers_.emplace_back([this]() { worker(); });
+    }
+  }
+
+  ~QueuePool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutdown_ = true;
+    }
+    not_empty_.notify_all();
+    not_full_.notify_all();
+    for (auto& worker_thread : workers_) {
+      worker_thread.join();
+    }
+  }
+
+  template <typename Fn>
+  auto submit(Fn&& fn) -> std::future<decltype(fn())> {
+    using Result = decltype(fn());
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Fn>(fn));
+    std::future<Result> future = task->get_future();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_full_.wait(lock, [this] { return shutdown_ || queue_.size() < max_queue_depth_; });
+      queue_.emplace([task]() { (*task)(); });
+    }
+    not_empty_.notify_one();
+    return future;
+  }
+
+ private:
+  void worker() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return shutdown_ || !queue_.empty(); });
+        if (shutdown_ && queue_.empty()) {
+          return;
+        }
+        task = std::move(queue_.front());
+        queue_.pop();
+      }
+      not_full_.notify_one();
+      task();
+    }
+  }
+
+  size_t max_queue_depth_;
+  std::vector<std::thread> workers_;
+  std::queue<std::function<void()>> queue_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  bool shutdown_ = false;
+};
+
+template <typename Fn>
+void post_to(QueuePool& pool, Fn&& fn) {
+  pool.submit(std::forward<Fn>(fn));
+}
+
+template <typename Fn>
+void post_to(ThreadPool& pool, Fn&& fn) {
+  pool.post(std::forward<Fn>(fn));
+}
 
+template <typename Fn>
+auto run_on(QueuePool& pool, Fn&& fn) {
+  return pool.submit(std::forward<Fn>(fn)).get();
+}
+
+template <typename Fn>
+auto run_on(ThreadPool& pool, Fn&& fn) {
+  Completion<decltype(fn())> done;
+  pool.submit(std::forward<Fn>(fn), done);
+  return done.get();
+}
+
+struct PoolTimings {
+  double tasks_per_sec = 0.0;
+  double p50_us = 0.0;
+  double p99_us = 0.0;
+};
+
+// Two phases from `submitters` threads at once: each posts `tasks` empty tasks
+// without waiting, timed until the last one has run; then each submits `tasks`
+// tasks one at a time and waits for every one, recording how long it took the
+// task to start running.
+template <typename Pool>
+PoolTimings bench_pool(Pool& pool, uint32_t submitters, uint64_t tasks) {
+  using namespace std::chrono;
+  PoolTimings timings;
+  std::atomic<uint64_t> ran{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < submitters; ++t) {
+    threads.emplace_back([&]() {
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      for (uint64_t i = 0; i < tasks; ++i) {
+        post_to(pool, [&ran]() { ran.fetch_add(1, std::memory_order_relaxed); });
+      }
+    });
+  }
   auto start = steady_clock::now();
+  go.store(true, std::memory_order_release);
+  while (ran.load(std::memory_order_relaxed) < tasks * submitters) {
+    std::this_thread::yield();
+  }
+  auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  timings.tasks_per_sec =
+      elapsed.count() == 0 ? 0.0 : static_cast<double>(tasks * submitters) * 1e9 / static_cast<double>(elapsed.count());
 
-  for (uint32_t i = 0; i < config_.bench_requests; ++i) {
+  std::vector<std::vector<double>> latencies(submitters);
+  threads.clear();
+  for (uint32_t t = 0; t < submitters; ++t) {
+    threads.emplace_back([&, t]() {
+      latencies[t].reserve(tasks);
+      for (uint64_t i = 0; i < tasks; ++i) {
+        auto submitted = steady_clock::now();
+        auto started = run_on(pool, []() { return steady_clock::now(); });
+        latencies[t].push_back(static_cast<double>(duration_cast<nanoseconds>(started - submitted).count()) / 1000.0);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::vector<double> all;
+  for (const auto& samples : latencies) {
+    all.insert(all.end(), samples.begin(), samples.end());
+  }
+  std::sort(all.begin(), all.end());
+  timings.p50_us = percentile(all, 0.50);
+  timings.p99_us = percentile(all, 0.99);
+  return timings;
+}
 
-    net::Socket sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == net::kInvalidSocket) continue;
+} // namespace
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(config_.port);
+BenchmarkRunner::BenchmarkRunner(const Config& config, Metrics& metrics)
+    : config_(config), metrics_(metrics) {}
 
+std::vector<BenchmarkRunner::ClientConnection> BenchmarkRunner::create_clients(uint32_t count) const {
+  std::vector<ClientConnection> clients;
+  clients.reserve(count);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(config_.port);
 #ifdef _WIN32
-    InetPtonA(AF_INET, config_.bind_host.c_str(), &addr.sin_addr);
+  InetPtonA(AF_INET, config_.bind_host.c_str(), &addr.sin_addr);
 #else
-    inet_pton(AF_INET, config_.bind_host.c_str(), &addr.sin_addr);
+  inet_pton(AF_INET, config_.bind_host.c_str(), &addr.sin_addr);
 #endif
-
+  for (uint32_t i = 0; i < count; ++i) {
+    net::Socket sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == net::kInvalidSocket) {
+      break;
+    }
     if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
       net::close_socket(sock);
-      continue;
+      break;
     }
+    ClientConnection client;
+    client.socket = sock;
+    clients.push_back(std::move(client));
+  }
+  return clients;
+}
 
-    const char* msg = "PING\n";
-    net::send_data(sock, msg, 5);
+void BenchmarkRunner::close_clients(std::vector<ClientConnection>& clients) const {
+  for (auto& client : clients) {
+    net::close_socket(client.socket);
+    client.socket = net::kInvalidSocket;
+  }
+  clients.clear();
+}
 
-    char buf[128];
-    net::recv_data(sock, buf, sizeof(buf));
+std::string BenchmarkRunner::next_request(std::mt19937_64& rng) const {
+  uint32_t keys = std::max<uint32_t>(config_.bench_keys, 1);
+  uint32_t hot_keys = std::max<uint32_t>(keys / 100, 1);
+  std::uniform_real_distribution<double> coin(0.0, 1.0);
+  uint32_t key = coin(rng) < config_.bench_hotspot_ratio ? static_cast<uint32_t>(rng() % hot_keys)
+                                                          : static_cast<uint32_t>(rng() % keys);
+  if (coin(rng) < config_.bench_read_ratio) {
+    return "GET key" + std::to_string(key) + "\n";
+  }
+  return "PUT key" + std::to_string(key) + " value" + std::to_string(rng() % 1000000) + "\n";
+}
 
-    net::close_socket(sock);
+BenchmarkRunner::ThreadResult BenchmarkRunner::run_clients(std::vector<ClientConnection>& clients, uint64_t requests,
+                                                           uint32_t seed) const {
+  using namespace std::chrono;
+  ThreadResult result;
+  result.latencies_us.reserve(requests);
+  std::mt19937_64 rng(seed);
+  std::vector<steady_clock::time_point> sent_at(clients.size());
+  std::vector<uint32_t> in_flight(clients.size(), 0);
+  uint32_t depth = std::max<uint32_t>(config_.bench_pipeline, 1);
+  std::string batch;
+  // Every connection keeps `depth` requests in flight, written with a single
+  // send, so a handful of threads can drive thousands of open connections.
+  while (result.completed + result.errors < requests) {
+    uint64_t issued = 0;
+    for (size_t i = 0; i < clients.size(); ++i) {
+      uint64_t remaining = requests - result.completed - result.errors - issued;
+      if (remaining == 0) {
+        break;
+      }
+      if (clients[i].socket == net::kInvalidSocket) {
+        continue;
+      }
+      uint32_t count = static_cast<uint32_t>(std::min<uint64_t>(depth, remaining));
+      batch.clear();
+      for (uint32_t r = 0; r < count; ++r) {
+        batch += next_request(rng);
+      }
+      sent_at[i] = steady_clock::now();
+      if (!net::send_all(clients[i].socket, batch.data(), batch.size())) {
+        net::close_socket(clients[i].socket);
+        clients[i].socket = net::kInvalidSocket;
+        result.errors += count;
+        continue;
+      }
+      in_flight[i] = count;
+      issued += count;
+    }
+    if (issued == 0) {
+      break;
+    }
+    for (size_t i = 0; i < clients.size(); ++i) {
+      for (; in_flight[i] > 0; --in_flight[i]) {
+        if (!read_line(clients[i].socket, clients[i].pending)) {
+          net::close_socket(clients[i].socket);
+          clients[i].socket = net::kInvalidSocket;
+          result.errors += in_flight[i];
+          in_flight[i] = 0;
+          break;
+        }
+        auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - sent_at[i]);
+        result.latencies_us.push_back(static_cast<double>(elapsed.count()) / 1000.0);
+        result.completed++;
+      }
+    }
   }
+  return result;
+}
 
+int BenchmarkRunner::run() {
+  if (config_.bench_mode == "map") {
+    run_map();
+    return 0;
+  }
+  if (config_.bench_mode == "scaling") {
+    run_scaling();
+    return 0;
+  }
+  if (config_.bench_mode == "percore") {
+    run_percore();
+    return 0;
+  }
+  if (config_.bench_mode == "memory") {
+    run_memory();
+    return 0;
+  }
+  if (config_.bench_mode == "pool") {
+    run_pool();
+    return 0;
+  }
+  if (config_.bench_mode == "snapshot") {
+    run_snapshot();
+    return 0;
+  }
+  if (config_.bench_mode == "stress") {
+    return run_stress() ? 0 : 1;
+  }
+  run_network();
+  return 0;
+}
+
+void BenchmarkRunner::run_network() {
+  using namespace std::chrono;
+
+  net::NetContext ctx;
+
+  uint32_t threads = std::max<uint32_t>(config_.bench_threads, 1);
+  uint32_t connections = std::max(config_.bench_clients, threads);
+  std::vector<std::vector<ClientConnection>> groups(threads);
+  uint32_t opened = 0;
+  for (uint32_t t = 0; t < threads; ++t) {
+    uint32_t share = connections / threads + (t < connections % threads ? 1 : 0);
+    groups[t] = create_clients(share);
+    opened += static_cast<uint32_t>(groups[t].size());
+  }
+  if (opened < connections) {
+    std::cerr << "Opened " << opened << " of " << connections << " connections\n";
+  }
+
+  std::vector<ThreadResult> results(threads);
+  std::vector<std::thread> workers;
+  auto start = steady_clock::now();
+  for (uint32_t t = 0; t < threads; ++t) {
+    uint64_t share = config_.bench_requests / threads + (t < config_.bench_requests % threads ? 1 : 0);
+    workers.emplace_back([this, &groups, &results, t, share]() {
+      results[t] = run_clients(groups[t], share, 7919u * (t + 1));
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
   auto end = steady_clock::now();
+  for (auto& group : groups) {
+    close_clients(group);
+  }
+
+  uint64_t completed = 0;
+  uint64_t errors = 0;
+  std::vector<double> latencies;
+  for (auto& result : results) {
+    completed += result.completed;
+    errors += result.errors;
+    latencies.insert(latencies.end(), result.latencies_us.begin(), result.latencies_us.end());
+  }
+  std::sort(latencies.begin(), latencies.end());
 
-  auto total_us =
-      duration_cast<microseconds>(end - start).count();
+  auto total_us = duration_cast<microseconds>(end - start).count();
+  double throughput = total_us > 0 ? static_cast<double>(completed) * 1e6 / static_cast<double>(total_us) : 0.0;
 
   std::ofstream out(config_.bench_output);
   out << "{\n";
-  out << "  \"requests\": " << config_.bench_requests << ",\n";
-  out << "  \"total_us\": " << total_us << "\n";
+  out << "  \"requests\": " << completed << ",\n";
+  out << "  \"errors\": " << errors << ",\n";
+  out << "  \"connections\": " << opened << ",\n";
+  out << "  \"threads\": " << threads << ",\n";
+  out << "  \"pipeline\": " << std::max<uint32_t>(config_.bench_pipeline, 1) << ",\n";
+  out << "  \"total_us\": " << total_us << ",\n";
+  out << "  \"throughput_rps\": " << throughput << ",\n";
+  out << "  \"p50_us\": " << percentile(latencies, 0.50) << ",\n";
+  out << "  \"p95_us\": " << percentile(latencies, 0.95) << ",\n";
+  out << "  \"p99_us\": " << percentile(latencies, 0.99) << "\n";
   out << "}\n";
 }
 
+void BenchmarkRunner::run_map() {
+  size_t count = std::max<uint32_t>(config_.bench_keys, 1);
+  std::vector<std::string> keys;
+  std::vector<std::string> misses;
+  keys.reserve(count);
+  misses.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    keys.push_back("key:" + std::to_string(i));
+    misses.push_back("absent:" + std::to_string(i));
+  }
+  std::vector<uint32_t> order(count);
+  for (size_t i = 0; i < count; ++i) {
+    order[i] = static_cast<uint32_t>(i);
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937_64(42));
+
+  auto node_map = bench_map<std::unordered_map<std::string, BenchEntry, StringHash, StringEqual>>(keys, misses, order);
+  auto flat_map = bench_map<FlatHashMap<std::string, BenchEntry, StringHash, StringEqual>>(keys, misses, order);
 
+  std::ofstream out(config_.bench_output);
+  auto write = [&](const char* name, const MapTimings& t, bool last) {
+    out << "  \"" << name << "\": {\"put_ns\": " << t.put_ns << ", \"get_ns\": " << t.get_ns
+        << ", \"miss_ns\": " << t.miss_ns << ", \"del_ns\": " << t.del_ns << "}" << (last ? "\n" : ",\n");
+  };
+  out << "{\n";
+  out << "  \"keys\": " << count << ",\n";
+  write("unordered_map", node_map, false);
+  write("flat_hash_map", flat_map, true);
+  out << "}\n";
+}
+
+void BenchmarkRunner::run_scaling() {
+  size_t count = std::max<uint32_t>(config_.bench_keys, 1);
+  std::vector<std::string> keys;
+  keys.reserve(count);
+  ShardedStore store(config_.shard_count, config_.memory_budget_bytes, metrics_,
+                     parse_eviction_policy(config_.eviction_policy), config_.huge_pages, config_.evict_high_watermark,
+                     config_.evict_low_watermark, config_.version_retention_bytes, config_.ordered_index);
+  for (size_t i = 0; i < count; ++i) {
+    keys.push_back("key:" + std::to_string(i));
+    store.put(keys.back(), "v", std::nullopt);
+  }
+  uint64_t ops = std::max<uint32_t>(config_.bench_requests, 1);
+  uint32_t max_threads = std::max<uint32_t>(config_.bench_threads, 1);
+  std::vector<uint32_t> thread_counts;
+  for (uint32_t threads = 1; threads < max_threads; threads *= 2) {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(max_threads);
 
+  std::shared_mutex global_lock;
+  std::ofstream out(config_.bench_output);
+  out << "{\n";
+  out << "  \"keys\": " << count << ",\n";
+  out << "  \"shards\": " << config_.shard_count << ",\n";
+  out << "  \"ops_per_thread\": " << ops << ",\n";
+  out << "  \"results\": [\n";
+  for (size_t i = 0; i < thread_counts.size(); ++i) {
+    uint32_t threads = thread_counts[i];
+    double epoch = store_ops_per_sec(store, keys, threads, ops, config_.bench_read_ratio, config_.bench_hotspot_ratio,
+                                     nullptr);
+    double locked = store_ops_per_sec(store, keys, threads, ops, config_.bench_read_ratio,
+                                      config_.bench_hotspot_ratio, &global_lock);
+    out << "    {\"threads\": " << threads << ", \"epoch_ops_per_sec\": " << epoch
+        << ", \"global_lock_ops_per_sec\": " << locked << "}" << (i + 1 < thread_counts.size() ? ",\n" : "\n");
+  }
+  out << "  ]\n";
+  out << "}\n";
 }
+
+// Compares write throughput of the locked execution model with percore mode
+// at 8, 16 and 32 threads. Each run gets a fresh store of --bench-keys keys
+// with at least one shard per thread, so every core owns a shard.
+void BenchmarkRunner::run_percore() {
+  size_t count = std::max<uint32_t>(config_.bench_keys, 1);
+  std::vector<std::string> keys;
+  keys.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    keys.push_back("key:" + std::to_string(i));
+  }
+  uint64_t ops = std::max<uint32_t>(config_.bench_requests, 1);
+  auto run = [&](uint32_t threads, uint32_t shards, bool per_core) {
+    ShardedStore store(shards, config_.memory_budget_bytes, metrics_, parse_eviction_policy(config_.eviction_policy),
+                       config_.huge_pages, config_.evict_high_watermark, config_.evict_low_watermark,
+                       config_.version_retention_bytes);
+    for (const auto& key : keys) {
+      store.put(key, "v", std::nullopt);
+    }
+    return write_ops_per_sec(store, keys, threads, ops, per_core);
+  };
+
+  const uint32_t thread_counts[] = {8, 16, 32};
+  std::ofstream out(config_.bench_output);
+  out << "{\n";
+  out << "  \"keys\": " << count << ",\n";
+  out << "  \"ops_per_thread\": " << ops << ",\n";
+  out << "  \"results\": [\n";
+  for (size_t i = 0; i < std::size(thread_counts); ++i) {
+    uint32_t threads = thread_counts[i];
+    uint32_t shards = std::max(config_.shard_count, threads);
+    double locked = run(threads, shards, false);
+    double per_core = run(threads, shards, true);
+    out << "    {\"threads\": " << threads << ", \"shards\": " << shards << ", \"locked_writes_per_sec\": " << locked
+        << ", \"percore_writes_per_sec\": " << per_core << "}" << (i + 1 < std::size(thread_counts) ? ",\n" : "\n");
+  }
+  out << "  ]\n";
+  out << "}\n";
+}
+
+// Fills an in-process store without an eviction budget and reports what each
+// key costs: as accounted against --memory-budget, and as growth of the
+// process's resident set. Keys are built in one reused buffer so the
+// benchmark itself adds nothing per key.
+void BenchmarkRunner::run_memory() {
+  size_t count = std::max<uint32_t>(config_.bench_keys, 1);
+  size_t key_size = config_.bench_key_size;
+  std::string value(config_.bench_value_size, 'v');
+  uint64_t rss_before = resident_bytes();
+  ShardedStore store(config_.shard_count, std::numeric_limits<uint64_t>::max(), metrics_,
+                     parse_eviction_policy(config_.eviction_policy), config_.huge_pages);
+  std::string key;
+  size_t payload = 0;
+  for (size_t i = 0; i < count; ++i) {
+    key = "key:" + std::to_string(i);
+    if (key.size() < key_size) {
+      key.resize(key_size, '.');
+    }
+    store.put(key, value, std::nullopt);
+    payload += key.size() + value.size();
+  }
+  uint64_t rss_after = resident_bytes();
+  double keys = static_cast<double>(count);
+  double accounted = static_cast<double>(store.memory_usage()) / keys;
+  double rss = rss_after > rss_before ? static_cast<double>(rss_after - rss_before) / keys : 0.0;
+
+  std::ofstream out(config_.bench_output);
+  out << "{\n";
+  out << "  \"keys\": " << count << ",\n";
+  out << "  \"key_size\": " << key_size << ",\n";
+  out << "  \"value_size\": " << value.size() << ",\n";
+  out << "  \"payload_bytes_per_key\": " << static_cast<double>(payload) / keys << ",\n";
+  out << "  \"accounted_bytes_per_key\": " << accounted << ",\n";
+  out << "  \"rss_bytes_per_key\": " << rss << "\n";
+  out << "}\n";
+}
+
+// Checks that lock-free GETs never return a torn value. Writers overwrite and
+// delete small self-checking values (some with a one-second TTL), while another
+// thread keeps resharding between --shards and twice as many, and readers check
+// every value they get. Each reader and writer runs --bench-requests
+// operations. Returns false if any read was torn.
+// Compares the work-stealing ThreadPool with the mutex-and-queue pool it
+// replaced, both with --workers threads and a --queue-depth queue, fed by
+// --bench-threads submitters of --bench-requests tasks each.
+void BenchmarkRunner::run_pool() {
+  uint32_t workers = std::max<uint32_t>(config_.worker_threads, 1);
+  uint32_t submitters = std::max<uint32_t>(config_.bench_threads, 1);
+  uint64_t tasks = std::max<uint32_t>(config_.bench_requests, 1);
+  size_t depth = std::max<uint32_t>(config_.task_queue_depth, 1);
+  PoolTimings queue;
+  {
+    QueuePool pool(workers, depth);
+    queue = bench_pool(pool, submitters, tasks);
+  }
+  PoolTimings stealing;
+  {
+    ThreadPool pool(workers, depth);
+    stealing = bench_pool(pool, submitters, tasks);
+  }
+
+  std::ofstream out(config_.bench_output);
+  auto write = [&](const char* name, const PoolTimings& t, bool last) {
+    out << "  \"" << name << "\": {\"tasks_per_sec\": " << t.tasks_per_sec << ", \"submit_to_run_p50_us\": " << t.p50_us
+        << ", \"submit_to_run_p99_us\": " << t.p99_us << "}" << (last ? "\n" : ",\n");
+  };
+  out << "{\n";
+  out << "  \"workers\": " << workers << ",\n";
+  out << "  \"submitters\": " << submitters << ",\n";
+  out << "  \"tasks_per_submitter\": " << tasks << ",\n";
+  write("queue_pool", queue, false);
+  write("work_stealing_pool", stealing, true);
+  out << "}\n";
+}
+
+// GET latency through the pool while snapshots of the store are taken back to
+// back: first with no snapshot running, then with each one copied and written
+// on a thread of its own, then as a sliced job on the pool's background lane.
+// --bench-threads clients each run --bench-requests GETs over --bench-keys keys.
+void BenchmarkRunner::run_snapshot() {
+  using namespace std::chrono;
+  size_t count = std::max<uint32_t>(config_.bench_keys, 1);
+  uint32_t clients = std::max<uint32_t>(config_.bench_threads, 1);
+  uint64_t requests = std::max<uint32_t>(config_.bench_requests, 1);
+  ShardedStore store(config_.shard_count, config_.memory_budget_bytes, metrics_,
+                     parse_eviction_policy(config_.eviction_policy), config_.huge_pages, config_.evict_high_watermark,
+                     config_.evict_low_watermark, config_.version_retention_bytes, config_.ordered_index);
+  std::vector<std::string> keys;
+  keys.reserve(count);
+  std::string value(config_.bench_value_size, 'v');
+  for (size_t i = 0; i < count; ++i) {
+    keys.push_back("key:" + std::to_string(i));
+    store.put(keys.back(), value, std::nullopt);
+  }
+  auto dir = std::filesystem::temp_directory_path() / "kvbench-snapshot";
+  std::filesystem::create_directories(dir);
+  FaultInjector fault_injector;
+  SnapshotManager snapshots(dir, fault_injector, metrics_, 0);
+  ThreadPool pool(std::max<uint32_t>(config_.worker_threads, 1), std::max<uint32_t>(config_.task_queue_depth, 1));
+
+  struct Phase {
+    double p50_us = 0.0;
+    double p99_us = 0.0;
+    uint64_t snapshots = 0;
+  };
+  enum class Snapshots { kNone, kThread, kBackgroundLane };
+  auto measure = [&](Snapshots mode) {
+    Phase phase;
+    std::atomic<bool> stop{false};
+    std::thread snapshotter([&]() {
+      while (mode != Snapshots::kNone && !stop.load()) {
+        if (mode == Snapshots::kThread) {
+          uint64_t version = store.begin_snapshot();
+          auto items = store.snapshot(version);
+          store.end_snapshot(version);
+          snapshots.write_snapshot(items);
+        } else {
+          snapshots.write_snapshot_sliced(store, pool);
+        }
+        // As the server's TTL tick does, free the old versions the snapshot
+        // kept readable.
+        store.expire_keys();
+        ++phase.snapshots;
+      }
+    });
+    std::vector<std::vector<double>> latencies(clients);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < clients; ++t) {
+      threads.emplace_back([&, t]() {
+        std::mt19937_64 rng(6151u * (t + 1));
+        latencies[t].reserve(requests);
+        for (uint64_t i = 0; i < requests; ++i) {
+          const std::string& key = keys[rng() % keys.size()];
+          auto start = steady_clock::now();
+          run_on(pool, [&]() { return store.get(key).has_value(); });
+          latencies[t].push_back(static_cast<double>(duration_cast<nanoseconds>(steady_clock::now() - start).count()) /
+                                 1000.0);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    stop.store(true);
+    snapshotter.join();
+    std::vector<double> all;
+    for (const auto& samples : latencies) {
+      all.insert(all.end(), samples.begin(), samples.end());
+    }
+    std::sort(all.begin(), all.end());
+    phase.p50_us = percentile(all, 0.50);
+    phase.p99_us = percentile(all, 0.99);
+    return phase;
+  };
+  Phase idle = measure(Snapshots::kNone);
+  Phase thread = measure(Snapshots::kThread);
+  Phase lane = measure(Snapshots::kBackgroundLane);
+  std::filesystem::remove_all(dir);
+
+  std::ofstream out(config_.bench_output);
+  auto write = [&](const char* name, const Phase& phase, bool last) {
+    out << "  \"" << name << "\": {\"get_p50_us\": " << phase.p50_us << ", \"get_p99_us\": " << phase.p99_us
+        << ", \"snapshots\": " << phase.snapshots << "}" << (last ? "\n" : ",\n");
+  };
+  out << "{\n";
+  out << "  \"keys\": " << count << ",\n";
+  out << "  \"clients\": " << clients << ",\n";
+  out << "  \"requests_per_client\": " << requests << ",\n";
+  write("no_snapshot", idle, false);
+  write("snapshot_thread", thread, false);
+  write("snapshot_background_lane", lane, true);
+  out << "}\n";
+}
+
+bool BenchmarkRunner::run_stress() {
+  size_t count = std::max<uint32_t>(config_.bench_keys, 1);
+  uint32_t threads = std::max<uint32_t>(config_.bench_threads, 2);
+  uint32_t writers = threads / 2;
+  uint32_t readers = threads - writers;
+  uint64_t ops = std::max<uint32_t>(config_.bench_requests, 1);
+  uint32_t shards = std::max<uint32_t>(config_.shard_count, 1);
+  ShardedStore store(shards, config_.memory_budget_bytes, metrics_, parse_eviction_policy(config_.eviction_policy),
+                     config_.huge_pages, config_.evict_high_watermark, config_.evict_low_watermark,
+                     config_.version_retention_bytes, config_.ordered_index);
+  std::vector<std::string> keys;
+  keys.reserve(count);
+  std::string value;
+  for (size_t i = 0; i < count; ++i) {
+    keys.push_back("key:" + std::to_string(i));
+    make_stress_value(static_cast<uint8_t>(i), value);
+    store.put(keys.back(), value, std::nullopt);
+  }
+
+  std::atomic<uint32_t> running{readers + writers};
+  std::atomic<uint64_t> reads{0};
+  std::atomic<uint64_t> torn{0};
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < writers; ++t) {
+    workers.emplace_back([&, t]() {
+      std::mt19937_64 rng(7727u * (t + 1));
+      std::string value;
+      for (uint64_t i = 0; i < ops; ++i) {
+        const std::string& key = keys[rng() % keys.size()];
+        uint64_t roll = rng();
+        if (roll % 10 == 0) {
+          store.del(key);
+          continue;
+        }
+        make_stress_value(static_cast<uint8_t>(roll >> 8), value);
+        store.put(key, value, roll % 10 == 1 ? std::optional<uint32_t>(1) : std::nullopt);
+      }
+      running.fetch_sub(1);
+    });
+  }
+  for (uint32_t t = 0; t < readers; ++t) {
+    workers.emplace_back([&, t]() {
+      std::mt19937_64 rng(7741u * (t + 1));
+      uint64_t bad = 0;
+      for (uint64_t i = 0; i < ops; ++i) {
+        if (config_.ordered_index && i % 64 == 0) {
+          // Range results must be intact too, and strictly ascending.
+          auto items = store.range(keys[rng() % keys.size()], {}, 8);
+          for (size_t j = 0; j < items.size(); ++j) {
+            if (!stress_value_intact(items[j].value.view()) || (j > 0 && items[j - 1].key >= items[j].key)) {
+              ++bad;
+            }
+          }
+          continue;
+        }
+        auto result = store.get(keys[rng() % keys.size()]);
+        if (result && !stress_value_intact(result->view())) {
+          ++bad;
+        }
+      }
+      reads.fetch_add(ops);
+      torn.fetch_add(bad);
+      running.fetch_sub(1);
+    });
+  }
+  uint64_t rebalances = 0;
+  std::thread resharder([&]() {
+    while (running.load() > 0) {
+      uint32_t target = rebalances % 2 == 0 ? shards * 2 : shards;
+      if (store.rebalance(target)) {
+        ++rebalances;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  });
+  // Expiry also frees the hash tables that concurrent inserts replaced.
+  std::thread expirer([&]() {
+    while (running.load() > 0) {
+      store.expire_keys();
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+  });
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  resharder.join();
+  expirer.join();
+
+  // SCAN must cover every live key exactly once and end with cursor 0, both
+  // page by page and in a single call asking for more keys than there are.
+  for (const auto& key : keys) {
+    make_stress_value(0, value);
+    store.put(key, value, std::nullopt);
+  }
+  uint64_t scan_bad = scan_errors(store, keys, 64, keys.size() / 16 + 64) + scan_errors(store, keys, keys.size() + 1, 1);
+
+  MetricsSnapshot snap = metrics_.snapshot();
+  std::ofstream out(config_.bench_output);
+  out << "{\n";
+  out << "  \"keys\": " << count << ",\n";
+  out << "  \"readers\": " << readers << ",\n";
+  out << "  \"writers\": " << writers << ",\n";
+  out << "  \"reads\": " << reads.load() << ",\n";
+  out << "  \"writes\": " << ops * writers << ",\n";
+  out << "  \"rebalances\": " << rebalances << ",\n";
+  out << "  \"optimistic_read_retries\": " << snap.optimistic_read_retries << ",\n";
+  out << "  \"optimistic_read_fallbacks\": " << snap.optimistic_read_fallbacks << ",\n";
+  out << "  \"torn_reads\": " << torn.load() << ",\n";
+  out << "  \"scan_errors\": " << scan_bad << "\n";
+  out << "}\n";
+  if (torn.load() != 0) {
+    std::cerr << "stress: " << torn.load() << " torn reads\n";
+    return false;
+  }
+  if (scan_bad != 0) {
+    std::cerr << "stress: " << scan_bad << " scan errors\n";
+    return false;
+  }
+  return true;
+}
+
+} // namespace kvstore
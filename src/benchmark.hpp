@@ -4,25 +4,44 @@
 #include "metrics.hpp"
 #include "net.hpp"
 
-#include <mutex>
-#include <vector>
+#include <cstdint>
+#include <random>
 #include <string>
+#include <vector>
 
 namespace kvstore {
 
 class BenchmarkRunner {
  public:
   BenchmarkRunner(const Config& config, Metrics& metrics);
-  void run();
+  // Returns the process exit code.
+  int run();
 
  private:
   struct ClientConnection {
     net::Socket socket = net::kInvalidSocket;
-    std::mutex mutex;
+    std::string pending;
   };
 
+  struct ThreadResult {
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    std::vector<double> latencies_us;
+  };
+
+  void run_network();
+  void run_map();
+  void run_scaling();
+  void run_percore();
+  void run_memory();
+  void run_pool();
+  void run_snapshot();
+  bool run_stress();
+
   std::vector<ClientConnection> create_clients(uint32_t count) const;
   void close_clients(std::vector<ClientConnection>& clients) const;
+  ThreadResult run_clients(std::vector<ClientConnection>& clients, uint64_t requests, uint32_t seed) const;
+  std::string next_request(std::mt19937_64& rng) const;
 
   Config config_;
   Metrics& metrics_;
@@ -90,21 +90,75 @@ Config parse_args(int argc, char** argv) {
     if (consume_flag(i, argc, argv, "--snapshot-interval", config.snapshot_interval_seconds)) {
       continue;
     }
-    if (consume_flag(i, argc, argv, "--ttl-scan", config.ttl_scan_interval_seconds)) {
+    if (consume_flag(i, argc, argv, "--ttl-tick-ms", config.ttl_tick_ms)) {
       continue;
     }
+    {
+      // Deprecated: the TTL tick used to be a full scan every few seconds.
+      uint32_t seconds = 0;
+      if (consume_flag(i, argc, argv, "--ttl-scan", seconds)) {
+        std::cerr << "--ttl-scan is deprecated, use --ttl-tick-ms\n";
+        config.ttl_tick_ms = seconds * 1000;
+        continue;
+      }
+    }
     if (consume_flag(i, argc, argv, "--shards", config.shard_count)) {
       continue;
     }
     if (consume_flag(i, argc, argv, "--memory-budget", config.memory_budget_bytes)) {
       continue;
     }
+    if (consume_flag(i, argc, argv, "--eviction-policy", config.eviction_policy)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--evict-high-watermark", config.evict_high_watermark)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--evict-low-watermark", config.evict_low_watermark)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--version-retention-bytes", config.version_retention_bytes)) {
+      continue;
+    }
+    if (arg == "--huge-pages") {
+      config.huge_pages = true;
+      continue;
+    }
+    if (arg == "--ordered-index") {
+      config.ordered_index = true;
+      continue;
+    }
     if (consume_flag(i, argc, argv, "--workers", config.worker_threads)) {
       continue;
     }
     if (consume_flag(i, argc, argv, "--queue-depth", config.task_queue_depth)) {
       continue;
     }
+    if (consume_flag(i, argc, argv, "--request-deadline-ms", config.request_deadline_ms)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--sojourn-target-us", config.sojourn_target_us)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--sojourn-interval-ms", config.sojourn_interval_ms)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--net-mode", config.network_mode)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--io-threads", config.io_threads)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--worker-cpus", config.worker_cpus)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--io-cpus", config.io_cpus)) {
+      continue;
+    }
+    if (arg == "--numa") {
+      config.numa_placement = true;
+      continue;
+    }
     if (consume_flag(i, argc, argv, "--wal-delay", config.wal_delay_ms)) {
       continue;
     }
@@ -117,6 +171,9 @@ Config parse_args(int argc, char** argv) {
     if (consume_flag(i, argc, argv, "--replication-delay", config.replication_delay_ms)) {
       continue;
     }
+    if (consume_flag(i, argc, argv, "--bench-mode", config.bench_mode)) {
+      continue;
+    }
     if (consume_flag(i, argc, argv, "--bench-clients", config.bench_clients)) {
       continue;
     }
@@ -126,6 +183,18 @@ Config parse_args(int argc, char** argv) {
     if (consume_flag(i, argc, argv, "--bench-requests", config.bench_requests)) {
       continue;
     }
+    if (consume_flag(i, argc, argv, "--bench-keys", config.bench_keys)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--bench-key-size", config.bench_key_size)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--bench-value-size", config.bench_value_size)) {
+      continue;
+    }
+    if (consume_flag(i, argc, argv, "--bench-pipeline", config.bench_pipeline)) {
+      continue;
+    }
     if (consume_flag(i, argc, argv, "--bench-read-ratio", config.bench_read_ratio)) {
       continue;
     }
@@ -18,11 +18,38 @@ struct Config {
   std::string data_dir = "data";
   bool enable_wal = true;
   uint32_t snapshot_interval_seconds = 30;
-  uint32_t ttl_scan_interval_seconds = 5;
+  uint32_t ttl_tick_ms = 100;
   uint32_t shard_count = 16;
   uint64_t memory_budget_bytes = 512ULL * 1024ULL * 1024ULL;
+  std::string eviction_policy = "clock"; // clock or tinylfu
+  // Percent of the memory budget at which background eviction starts and stops.
+  uint32_t evict_high_watermark = 90;
+  uint32_t evict_low_watermark = 80;
+  // Most bytes of old versions kept for SNAPSHOT readers.
+  uint64_t version_retention_bytes = 64ULL * 1024ULL * 1024ULL;
+  bool huge_pages = false;
+  // Keeps keys in order per shard for RANGE and PREFIX.
+  bool ordered_index = false;
   uint32_t worker_threads = 8;
   uint32_t task_queue_depth = 4096;
+  // Requests still queued this long after they arrived are answered BUSY
+  // unexecuted; 0 means no deadline. Clients can override it per connection.
+  uint32_t request_deadline_ms = 0;
+  // Queue waits above the target for a whole interval make the server answer
+  // new requests BUSY until the queue recovers; a zero target turns this off.
+  uint32_t sojourn_target_us = 0;
+  uint32_t sojourn_interval_ms = 100;
+  std::string network_mode = "threads"; // threads, epoll or percore
+  uint32_t io_threads = 4;
+  // CPU lists such as "0-7,16". Workers are pinned one CPU each, and
+  // connection threads and event loops one I/O CPU each, round robin; empty
+  // lists leave the threads free.
+  std::string worker_cpus;
+  std::string io_cpus;
+  // Gives every shard a home NUMA node whose memory holds its items, pins
+  // unlisted workers to their node's CPUs, and routes requests to workers on
+  // their shard's node.
+  bool numa_placement = false;
 
   // Fault injection
   uint32_t wal_delay_ms = 0;
@@ -31,9 +58,14 @@ struct Config {
   uint32_t replication_delay_ms = 0;
 
   // Benchmark
+  std::string bench_mode = "network"; // network, map, scaling, memory, pool, snapshot or stress
   uint32_t bench_clients = 4;
   uint32_t bench_threads = 8;
   uint32_t bench_requests = 10000;
+  uint32_t bench_keys = 100000;
+  uint32_t bench_key_size = 32;
+  uint32_t bench_value_size = 8;
+  uint32_t bench_pipeline = 1;
   double bench_read_ratio = 0.7;
   double bench_hotspot_ratio = 0.2;
   std::string bench_output = "bench.json";
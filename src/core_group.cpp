@@ -0,0 +1,104 @@
+#include "core_group.hpp"
+
+#include <algorithm>
+#include <thread>
+
+namespace kvstore {
+
+namespace {
+
+// The group whose core runs on this thread, if any, and the core's index.
+thread_local const CoreGroup* current_group = nullptr;
+thread_local size_t current_core = 0;
+
+} // namespace
+
+CoreGroup::CoreGroup(size_t cores, size_t queue_depth) {
+  cores = std::max<size_t>(cores, 1);
+  for (size_t i = 0; i < cores; ++i) {
+    cores_.push_back(std::make_unique<Core>());
+  }
+  for (size_t i = 0; i < cores * cores; ++i) {
+    queues_.push_back(std::make_unique<SpscQueue<Task>>(queue_depth));
+  }
+}
+
+void CoreGroup::attach(size_t core) {
+  current_group = this;
+  current_core = core;
+}
+
+int CoreGroup::self() const {
+  return current_group == this ? static_cast<int>(current_core) : -1;
+}
+
+void CoreGroup::set_waker(size_t core, std::function<void()> wake) {
+  cores_[core]->wake = std::move(wake);
+}
+
+void CoreGroup::forward(size_t to, Task job) {
+  SpscQueue<Task>& target = queue(to, current_core);
+  while (!target.try_push(job)) {
+    // `to` may itself be waiting on this core with its own queue full.
+    if (poll() == 0) {
+      std::this_thread::yield();
+    }
+  }
+  // Pairs with the fence in prepare_sleep(): either the target sees the job
+  // before it sleeps or its sleeping flag is seen here.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  Core& core = *cores_[to];
+  if (core.sleeping.load(std::memory_order_relaxed) && core.wake) {
+    core.wake();
+  }
+}
+
+size_t CoreGroup::poll() {
+  size_t ran = 0;
+  Task job;
+  for (size_t from = 0; from < cores_.size(); ++from) {
+    SpscQueue<Task>& source = queue(current_core, from);
+    for (size_t i = 0; i < kPollBatch && source.try_pop(job); ++i) {
+      job();
+      job.reset();
+      ++ran;
+    }
+  }
+  return ran;
+}
+
+bool CoreGroup::prepare_sleep() {
+  Core& core = *cores_[current_core];
+  core.sleeping.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for (size_t from = 0; from < cores_.size(); ++from) {
+    if (!queue(current_core, from).empty()) {
+      core.sleeping.store(false, std::memory_order_relaxed);
+      return false;
+    }
+  }
+  return true;
+}
+
+void CoreGroup::end_sleep() {
+  cores_[current_core]->sleeping.store(false, std::memory_order_relaxed);
+}
+
+void CoreGroup::leave() {
+  left_.fetch_add(1);
+  while (left_.load() < cores_.size()) {
+    if (poll() == 0) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void CoreGroup::Gather::wait() {
+  while (pending_.load(std::memory_order_acquire) != 0) {
+    if (group_.poll() == 0) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+} // namespace kvstore
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "thread_pool.hpp"
+#include "work_queue.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace kvstore {
+
+// Thread-per-core execution. Each core owns a disjoint set of store shards
+// and runs every keyed operation on them itself, so a shard's lock word, map
+// and slab lines stay in one core's cache instead of bouncing between all of
+// them. A core hands an operation on another core's shard to that core
+// through a lock-free SPSC queue, one per ordered pair of cores, and while it
+// waits for the result it runs whatever the other cores handed it, so cores
+// waiting on each other always make progress.
+//
+// Cores are threads of the caller's, such as event loops, that attach()
+// once, poll() between their own work and leave() when they stop. A core
+// about to block says so with prepare_sleep(); a core forwarding to it then
+// calls the waker set for it.
+class CoreGroup {
+ public:
+  // Jobs that can wait in one queue; a full queue makes the sender run its
+  // own jobs until there is room.
+  static constexpr size_t kQueueDepth = 1024;
+  // Most jobs run from one queue per poll(), so a busy sender cannot keep a
+  // core from its own connections.
+  static constexpr size_t kPollBatch = 64;
+
+  explicit CoreGroup(size_t cores, size_t queue_depth = kQueueDepth);
+
+  CoreGroup(const CoreGroup&) = delete;
+  CoreGroup& operator=(const CoreGroup&) = delete;
+
+  size_t cores() const { return cores_.size(); }
+  // Core owning the shard with index `shard`.
+  size_t owner(size_t shard) const { return shard % cores_.size(); }
+
+  // Makes the calling thread core `core`; each core is attached once.
+  void attach(size_t core);
+  // The calling thread's core in this group, or -1.
+  int self() const;
+  void set_waker(size_t core, std::function<void()> wake);
+
+  // Queues `job` for core `to`; the caller must be a core. `job` must not
+  // throw.
+  void forward(size_t to, Task job);
+  // Runs jobs forwarded to the calling core and returns how many ran.
+  size_t poll();
+  // Returns false, without sleeping, if jobs are already waiting.
+  bool prepare_sleep();
+  void end_sleep();
+  // Runs forwarded jobs until every core has left, so no core is left waiting
+  // on one that is gone.
+  void leave();
+
+  // Runs functions on their owner cores and waits for all of them. Functions
+  // for the calling core run inline, at once; the others are forwarded, and
+  // run on their core in the order they were given. They must not throw.
+  class Gather {
+   public:
+    explicit Gather(CoreGroup& group) : group_(group), self_(static_cast<size_t>(group.self())) {}
+    ~Gather() { wait(); }
+
+    Gather(const Gather&) = delete;
+    Gather& operator=(const Gather&) = delete;
+
+    template <typename Fn>
+    void run(size_t owner, Fn&& fn) {
+      if (owner == self_) {
+        fn();
+        return;
+      }
+      pending_.fetch_add(1, std::memory_order_relaxed);
+      group_.forward(owner, Task([fn = std::forward<Fn>(fn), pending = &pending_]() mutable {
+        fn();
+        pending->fetch_sub(1, std::memory_order_release);
+      }));
+    }
+
+    void wait();
+
+   private:
+    CoreGroup& group_;
+    size_t self_;
+    std::atomic<uint32_t> pending_{0};
+  };
+
+ private:
+  struct alignas(64) Core {
+    std::atomic<bool> sleeping{false};
+    std::function<void()> wake;
+  };
+
+  SpscQueue<Task>& queue(size_t to, size_t from) { return *queues_[to * cores_.size() + from]; }
+
+  std::vector<std::unique_ptr<Core>> cores_;
+  // queues_[to * cores + from] carries jobs from core `from` to core `to`.
+  std::vector<std::unique_ptr<SpscQueue<Task>>> queues_;
+  std::atomic<size_t> left_{0};
+};
+
+} // namespace kvstore
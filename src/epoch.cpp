@@ -0,0 +1,141 @@
+#include "epoch.hpp"
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kvstore {
+
+// Slots are padded to a cache line so announcing an epoch never contends with
+// another thread.
+struct alignas(64) EpochManager::Slot {
+  // 0 while the owning thread is not pinned.
+  std::atomic<uint64_t> epoch{0};
+  std::atomic<bool> in_use{false};
+};
+
+// Slots live in fixed-size blocks that are never freed while the registry
+// exists, so a thread can keep a raw pointer to its slot.
+struct EpochManager::Registry {
+  static constexpr size_t kBlockSize = 64;
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Slot[]>> blocks;
+  // Set when the manager is destroyed; threads then drop their bindings to it.
+  std::atomic<bool> retired{false};
+
+  Slot* claim() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& block : blocks) {
+      for (size_t i = 0; i < kBlockSize; ++i) {
+        bool expected = false;
+        if (block[i].in_use.compare_exchange_strong(expected, true)) {
+          return &block[i];
+        }
+      }
+    }
+    blocks.push_back(std::make_unique<Slot[]>(kBlockSize));
+    blocks.back()[0].in_use = true;
+    return &blocks.back()[0];
+  }
+};
+
+struct EpochManager::Binding {
+  uint64_t manager_id = 0;
+  // Keeps the slot's block alive if the thread outlives the manager.
+  std::shared_ptr<Registry> registry;
+  Slot* slot = nullptr;
+  uint32_t depth = 0;
+};
+
+namespace {
+
+std::atomic<uint64_t> next_manager_id{1};
+
+// Returns the thread's slots to their registries when the thread exits.
+struct ThreadBindings {
+  std::vector<std::unique_ptr<EpochManager::Binding>> bindings;
+
+  ~ThreadBindings() {
+    for (auto& binding : bindings) {
+      binding->slot->epoch.store(0, std::memory_order_release);
+      binding->slot->in_use.store(false, std::memory_order_release);
+    }
+  }
+};
+
+thread_local ThreadBindings thread_bindings;
+
+} // namespace
+
+EpochManager::Guard::~Guard() {
+  if (--binding_->depth == 0) {
+    binding_->slot->epoch.store(0, std::memory_order_release);
+  }
+}
+
+EpochManager::EpochManager()
+    : id_(next_manager_id.fetch_add(1, std::memory_order_relaxed)), registry_(std::make_shared<Registry>()) {}
+
+EpochManager::~EpochManager() {
+  registry_->retired.store(true, std::memory_order_release);
+}
+
+// Bindings to destroyed managers are dropped as the lookup passes them, so a
+// long-lived thread that uses many stores in turn does not keep scanning them.
+EpochManager::Binding* EpochManager::binding_for_this_thread() {
+  auto& bindings = thread_bindings.bindings;
+  for (size_t i = 0; i < bindings.size();) {
+    if (bindings[i]->manager_id == id_) {
+      return bindings[i].get();
+    }
+    if (bindings[i]->registry->retired.load(std::memory_order_acquire)) {
+      bindings[i] = std::move(bindings.back());
+      bindings.pop_back();
+      continue;
+    }
+    ++i;
+  }
+  auto binding = std::make_unique<Binding>();
+  binding->manager_id = id_;
+  binding->registry = registry_;
+  binding->slot = registry_->claim();
+  thread_bindings.bindings.push_back(std::move(binding));
+  return thread_bindings.bindings.back().get();
+}
+
+EpochManager::Guard EpochManager::pin() {
+  Binding* binding = binding_for_this_thread();
+  if (binding->depth++ == 0) {
+    binding->slot->epoch.store(epoch_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    // Pairs with the fence in synchronize(): either the writer sees this
+    // announcement, or this thread sees everything published before it.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+  return Guard(binding);
+}
+
+void EpochManager::synchronize() {
+  uint64_t target = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  std::vector<Slot*> slots;
+  {
+    std::lock_guard<std::mutex> lock(registry_->mutex);
+    for (auto& block : registry_->blocks) {
+      for (size_t i = 0; i < Registry::kBlockSize; ++i) {
+        slots.push_back(&block[i]);
+      }
+    }
+  }
+  for (Slot* slot : slots) {
+    while (true) {
+      uint64_t epoch = slot->epoch.load(std::memory_order_acquire);
+      if (epoch == 0 || epoch >= target) {
+        break;
+      }
+      std::this_thread::yield();
+    }
+  }
+}
+
+} // namespace kvstore
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace kvstore {
+
+// Epoch-based protection for data published through an atomic pointer.
+//
+// A reader pins the manager for the duration of an operation. Pinning only
+// writes the current global epoch into a slot owned by the calling thread and
+// issues a fence; no shared cache line is written. A writer that replaces a
+// published object calls synchronize(), which advances the epoch and waits
+// until every thread pinned under an older epoch has unpinned, after which
+// the replaced object can no longer be referenced and may be freed.
+//
+// Pins nest within a thread. Each thread claims a slot on its first pin and
+// releases it when it exits, so short-lived per-connection threads do not
+// exhaust the registry. A thread forgets managers that have been destroyed
+// the next time it looks up its slot.
+class EpochManager {
+ public:
+  struct Slot;
+  struct Registry;
+  struct Binding;
+
+  class Guard {
+   public:
+    explicit Guard(Binding* binding) : binding_(binding) {}
+    ~Guard();
+
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+
+   private:
+    Binding* binding_;
+  };
+
+  EpochManager();
+  ~EpochManager();
+
+  EpochManager(const EpochManager&) = delete;
+  EpochManager& operator=(const EpochManager&) = delete;
+
+  Guard pin();
+  // Must not be called by a thread that holds a pin on this manager.
+  void synchronize();
+
+ private:
+  Binding* binding_for_this_thread();
+
+  uint64_t id_;
+  std::atomic<uint64_t> epoch_{1};
+  std::shared_ptr<Registry> registry_;
+};
+
+} // namespace kvstore
@@ -0,0 +1,305 @@
+#include "event_loop.hpp"
+
+#include "affinity.hpp"
+#include "core_group.hpp"
+
+#include <stdexcept>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+namespace kvstore {
+
+namespace {
+
+constexpr size_t kReadChunk = 16 * 1024;
+// Stop reading from a client that is not draining its responses.
+constexpr size_t kMaxPendingOutput = 4 * 1024 * 1024;
+constexpr int kMaxEvents = 256;
+
+} // namespace
+
+EventLoop::EventLoop(DataHandler handler, CloseHandler on_close)
+    : handler_(std::move(handler)), on_close_(std::move(on_close)) {}
+
+EventLoop::~EventLoop() {
+  stop();
+}
+
+bool EventLoop::supported() {
+#ifdef __linux__
+  return true;
+#else
+  return false;
+#endif
+}
+
+size_t EventLoop::connection_count() const {
+  return connection_count_.load();
+}
+
+#ifdef __linux__
+
+void EventLoop::start(std::vector<int> cpus) {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0) {
+    throw std::runtime_error("failed to create epoll instance");
+  }
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ < 0) {
+    throw std::runtime_error("failed to create eventfd");
+  }
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+  running_ = true;
+  thread_ = std::thread([this, cpus = std::move(cpus)]() {
+    pin_current_thread(cpus);
+    run();
+  });
+}
+
+void EventLoop::set_core(CoreGroup* group, size_t core) {
+  cores_ = group;
+  core_ = core;
+}
+
+void EventLoop::interrupt() {
+  if (running_.exchange(false)) {
+    wake();
+  }
+}
+
+void EventLoop::wake() {
+  uint64_t one = 1;
+  [[maybe_unused]] auto written = write(wake_fd_, &one, sizeof(one));
+}
+
+void EventLoop::stop() {
+  if (epoll_fd_ < 0) {
+    return;
+  }
+  interrupt();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  for (auto& [fd, conn] : connections_) {
+    if (on_close_) {
+      on_close_(conn->session);
+    }
+    net::close_socket(fd);
+  }
+  connections_.clear();
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    for (auto fd : pending_) {
+      net::close_socket(fd);
+    }
+    pending_.clear();
+  }
+  close(wake_fd_);
+  close(epoll_fd_);
+  wake_fd_ = -1;
+  epoll_fd_ = -1;
+  connection_count_ = 0;
+}
+
+void EventLoop::add_connection(net::Socket fd) {
+  net::set_nonblocking(fd);
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_.push_back(fd);
+  }
+  connection_count_++;
+  wake();
+}
+
+void EventLoop::run() {
+  if (cores_ != nullptr) {
+    cores_->attach(core_);
+  }
+  epoll_event events[kMaxEvents];
+  while (running_) {
+    int timeout_ms = 1000;
+    if (cores_ != nullptr) {
+      cores_->poll();
+      if (!cores_->prepare_sleep()) {
+        timeout_ms = 0;
+      }
+    }
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, timeout_ms);
+    if (cores_ != nullptr) {
+      cores_->end_sleep();
+    }
+    for (int i = 0; i < n; ++i) {
+      if (cores_ != nullptr) {
+        cores_->poll();
+      }
+      auto* conn = static_cast<Connection*>(events[i].data.ptr);
+      if (conn == nullptr) {
+        uint64_t count = 0;
+        [[maybe_unused]] auto read_bytes = read(wake_fd_, &count, sizeof(count));
+        drain_pending();
+        continue;
+      }
+      uint32_t mask = events[i].events;
+      if ((mask & EPOLLERR) || ((mask & EPOLLHUP) && !(mask & EPOLLIN))) {
+        close_connection(*conn);
+        continue;
+      }
+      if (mask & EPOLLOUT) {
+        if (!on_writable(*conn)) {
+          continue;
+        }
+      }
+      if (mask & EPOLLIN) {
+        on_readable(*conn);
+      }
+    }
+  }
+  if (cores_ != nullptr) {
+    cores_->leave();
+  }
+}
+
+void EventLoop::drain_pending() {
+  std::vector<net::Socket> fds;
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    fds.swap(pending_);
+  }
+  for (auto fd : fds) {
+    auto conn = std::make_unique<Connection>();
+    conn->fd = fd;
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn.get();
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      net::close_socket(fd);
+      connection_count_--;
+      continue;
+    }
+    connections_.emplace(fd, std::move(conn));
+  }
+}
+
+bool EventLoop::on_readable(Connection& conn) {
+  bool peer_closed = false;
+  while (true) {
+    char* tail = conn.input.prepare(kReadChunk);
+    size_t room = conn.input.writable();
+    int n = net::recv_data(conn.fd, tail, room);
+    if (n > 0) {
+      conn.input.commit(static_cast<size_t>(n));
+      if (static_cast<size_t>(n) < room) {
+        break;
+      }
+      continue;
+    }
+    if (n < 0 && net::would_block()) {
+      break;
+    }
+    peer_closed = true;
+    break;
+  }
+  return process(conn, peer_closed);
+}
+
+bool EventLoop::on_writable(Connection& conn) {
+  bool was_reading = conn.reading;
+  if (!after_flush(conn)) {
+    return false;
+  }
+  if (!was_reading && conn.reading && !conn.input.empty()) {
+    // Requests that arrived while the client was throttled are still buffered.
+    return process(conn, false);
+  }
+  return true;
+}
+
+bool EventLoop::process(Connection& conn, bool peer_closed) {
+  if (!conn.input.empty()) {
+    size_t consumed = handler_(conn.session, conn.input.readable(), conn.output);
+    conn.input.consume(consumed);
+  }
+  if (!after_flush(conn)) {
+    return false;
+  }
+  if (peer_closed || conn.session.close) {
+    close_connection(conn);
+    return false;
+  }
+  return true;
+}
+
+bool EventLoop::after_flush(Connection& conn) {
+  FlushResult result = flush(conn);
+  if (result == FlushResult::kError) {
+    close_connection(conn);
+    return false;
+  }
+  bool reading = conn.output.pending() < kMaxPendingOutput;
+  bool writing = result == FlushResult::kPending;
+  if (reading != conn.reading || writing != conn.writing) {
+    conn.reading = reading;
+    conn.writing = writing;
+    epoll_event ev{};
+    ev.events = (reading ? EPOLLIN : 0u) | (writing ? EPOLLOUT : 0u);
+    ev.data.ptr = &conn;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd, &ev);
+  }
+  return true;
+}
+
+EventLoop::FlushResult EventLoop::flush(Connection& conn) {
+  std::string_view segments[net::kMaxSendSegments];
+  while (!conn.output.empty()) {
+    size_t count = conn.output.gather(segments, net::kMaxSendSegments);
+    int n = net::send_segments(conn.fd, segments, count);
+    if (n > 0) {
+      conn.output.consume(static_cast<size_t>(n));
+      continue;
+    }
+    if (n < 0 && net::would_block()) {
+      return FlushResult::kPending;
+    }
+    return FlushResult::kError;
+  }
+  return FlushResult::kDone;
+}
+
+void EventLoop::close_connection(Connection& conn) {
+  if (on_close_) {
+    on_close_(conn.session);
+  }
+  net::Socket fd = conn.fd;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  net::close_socket(fd);
+  connections_.erase(fd);
+  connection_count_--;
+}
+
+#else
+
+void EventLoop::set_core(CoreGroup*, size_t) {}
+
+void EventLoop::start(std::vector<int>) {
+  throw std::runtime_error("epoll network mode is only available on Linux");
+}
+
+void EventLoop::interrupt() {}
+
+void EventLoop::stop() {}
+
+void EventLoop::wake() {}
+
+void EventLoop::add_connection(net::Socket fd) {
+  net::close_socket(fd);
+}
+
+#endif
+
+} // namespace kvstore
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "net.hpp"
+#include "protocol.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace kvstore {
+
+class CoreGroup;
+
+// Per-connection buffers. A connection is owned by exactly one EventLoop and
+// is only touched from that loop's thread.
+struct Connection {
+  net::Socket fd = net::kInvalidSocket;
+  Session session;
+  IoBuffer input;
+  OutputBuffer output;
+  bool reading = true;
+  bool writing = false;
+};
+
+// One epoll-driven I/O thread servicing many non-blocking sockets. Requests are
+// executed inline on the loop thread through the data handler.
+class EventLoop {
+ public:
+  // Consumes complete requests at the front of `input`, appends their responses
+  // to `output` and returns the number of input bytes consumed.
+  using DataHandler = std::function<size_t(Session& session, std::string_view input, OutputBuffer& output)>;
+  // Called for every connection that closes, including at stop().
+  using CloseHandler = std::function<void(Session& session)>;
+
+  explicit EventLoop(DataHandler handler, CloseHandler on_close = {});
+  ~EventLoop();
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  // Makes the loop thread core `core` of `group`: between events it runs the
+  // jobs other cores forward to it, and it wakes up for them. Call before
+  // start().
+  void set_core(CoreGroup* group, size_t core);
+  // The loop thread is pinned to `cpus` when it is not empty.
+  void start(std::vector<int> cpus = {});
+  // Tells the loop to stop without waiting for it; stop() still has to be
+  // called. Loops that are cores of one group must all be interrupted before
+  // any is stopped.
+  void interrupt();
+  void stop();
+  // Makes the loop thread return from epoll_wait.
+  void wake();
+  void add_connection(net::Socket fd);
+  size_t connection_count() const;
+
+  static bool supported();
+
+ private:
+  enum class FlushResult { kDone, kPending, kError };
+
+  void run();
+  void drain_pending();
+  // The handlers below return false once the connection has been closed and
+  // destroyed.
+  bool on_readable(Connection& conn);
+  bool on_writable(Connection& conn);
+  bool process(Connection& conn, bool peer_closed);
+  bool after_flush(Connection& conn);
+  FlushResult flush(Connection& conn);
+  void close_connection(Connection& conn);
+
+  DataHandler handler_;
+  CloseHandler on_close_;
+  CoreGroup* cores_ = nullptr;
+  size_t core_ = 0;
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+  std::atomic<bool> running_{false};
+  std::thread thread_;
+  std::mutex pending_mutex_;
+  std::vector<net::Socket> pending_;
+  std::unordered_map<net::Socket, std::unique_ptr<Connection>> connections_;
+  std::atomic<size_t> connection_count_{0};
+};
+
+} // namespace kvstore
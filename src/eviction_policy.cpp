@@ -0,0 +1,214 @@
+#include "eviction_policy.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+#include <string>
+
+namespace kvstore {
+
+namespace {
+
+constexpr uint64_t kRowSeeds[] = {
+    0xC3A5C85C97CB3127ULL,
+    0xB492B66FBE98F273ULL,
+    0x9AE16A3B2F90404FULL,
+    0xCBF29CE484222325ULL,
+};
+
+} // namespace
+
+EvictionPolicy parse_eviction_policy(std::string_view name) {
+  if (name == "clock") {
+    return EvictionPolicy::kClock;
+  }
+  if (name == "tinylfu") {
+    return EvictionPolicy::kTinyLfu;
+  }
+  throw std::runtime_error("unknown eviction policy: " + std::string(name));
+}
+
+void FrequencySketch::ensure_capacity(size_t entries) {
+  size_t wanted = std::bit_ceil(std::max<size_t>(entries, 16));
+  if (wanted <= width_) {
+    return;
+  }
+  table_.assign(kRows * wanted, 0);
+  width_ = wanted;
+  sample_size_ = 10 * wanted;
+  additions_ = 0;
+}
+
+size_t FrequencySketch::index_of(uint64_t hash, size_t row) const {
+  uint64_t mixed = (hash + kRowSeeds[row]) * 0x9E3779B97F4A7C15ULL;
+  mixed ^= mixed >> 32;
+  return row * width_ + static_cast<size_t>(mixed & (width_ - 1));
+}
+
+void FrequencySketch::increment(uint64_t hash) {
+  if (width_ == 0) {
+    ensure_capacity(0);
+  }
+  bool added = false;
+  for (size_t row = 0; row < kRows; ++row) {
+    uint8_t& counter = table_[index_of(hash, row)];
+    if (counter < kMaxCount) {
+      ++counter;
+      added = true;
+    }
+  }
+  if (added && ++additions_ >= sample_size_) {
+    age();
+  }
+}
+
+uint32_t FrequencySketch::estimate(uint64_t hash) const {
+  if (width_ == 0) {
+    return 0;
+  }
+  uint32_t count = kMaxCount;
+  for (size_t row = 0; row < kRows; ++row) {
+    count = std::min<uint32_t>(count, table_[index_of(hash, row)]);
+  }
+  return count;
+}
+
+void FrequencySketch::age() {
+  for (auto& counter : table_) {
+    counter >>= 1;
+  }
+  additions_ /= 2;
+}
+
+TinyLfuPolicy::List& TinyLfuPolicy::list_for(Region region) {
+  switch (region) {
+    case Region::kWindow:
+      return window_;
+    case Region::kProbation:
+      return probation_;
+    case Region::kProtected:
+      break;
+  }
+  return protected_;
+}
+
+void TinyLfuPolicy::push_front(Region region, uint32_t node) {
+  List& list = list_for(region);
+  Node& entry = nodes_[node];
+  entry.region = region;
+  entry.prev = kNoNode;
+  entry.next = list.head;
+  if (list.head != kNoNode) {
+    nodes_[list.head].prev = node;
+  } else {
+    list.tail = node;
+  }
+  list.head = node;
+  ++list.size;
+}
+
+void TinyLfuPolicy::unlink(uint32_t node) {
+  Node& entry = nodes_[node];
+  List& list = list_for(entry.region);
+  if (entry.prev != kNoNode) {
+    nodes_[entry.prev].next = entry.next;
+  } else {
+    list.head = entry.next;
+  }
+  if (entry.next != kNoNode) {
+    nodes_[entry.next].prev = entry.prev;
+  } else {
+    list.tail = entry.prev;
+  }
+  entry.prev = kNoNode;
+  entry.next = kNoNode;
+  --list.size;
+}
+
+void TinyLfuPolicy::move_to_front(Region region, uint32_t node) {
+  unlink(node);
+  push_front(region, node);
+}
+
+size_t TinyLfuPolicy::window_target() const {
+  return std::max<size_t>(size() / 100, 1);
+}
+
+size_t TinyLfuPolicy::protected_target() const {
+  return (size() - window_.size) * 8 / 10;
+}
+
+uint32_t TinyLfuPolicy::on_insert(uint64_t hash) {
+  uint32_t node;
+  if (!free_nodes_.empty()) {
+    node = free_nodes_.back();
+    free_nodes_.pop_back();
+  } else {
+    node = static_cast<uint32_t>(nodes_.size());
+    nodes_.emplace_back();
+  }
+  nodes_[node] = Node{};
+  nodes_[node].hash = hash;
+  push_front(Region::kWindow, node);
+  sketch_.ensure_capacity(size());
+  sketch_.increment(hash);
+
+  while (window_.size > window_target()) {
+    uint32_t spilled = window_.tail;
+    unlink(spilled);
+    nodes_[spilled].candidate = true;
+    push_front(Region::kProbation, spilled);
+  }
+  return node;
+}
+
+void TinyLfuPolicy::on_access(uint32_t node) {
+  Node& entry = nodes_[node];
+  sketch_.increment(entry.hash);
+  switch (entry.region) {
+    case Region::kWindow:
+    case Region::kProtected:
+      move_to_front(entry.region, node);
+      break;
+    case Region::kProbation:
+      unlink(node);
+      entry.candidate = false;
+      push_front(Region::kProtected, node);
+      while (protected_.size > protected_target()) {
+        uint32_t demoted = protected_.tail;
+        unlink(demoted);
+        push_front(Region::kProbation, demoted);
+      }
+      break;
+  }
+}
+
+void TinyLfuPolicy::on_miss(uint64_t hash) {
+  sketch_.increment(hash);
+}
+
+void TinyLfuPolicy::on_remove(uint32_t node) {
+  unlink(node);
+  free_nodes_.push_back(node);
+}
+
+uint32_t TinyLfuPolicy::select_victim() {
+  if (probation_.size > 0) {
+    uint32_t victim = probation_.tail;
+    uint32_t candidate = probation_.head;
+    if (candidate == victim || !nodes_[candidate].candidate) {
+      return victim;
+    }
+    if (sketch_.estimate(nodes_[candidate].hash) > sketch_.estimate(nodes_[victim].hash)) {
+      nodes_[candidate].candidate = false;
+      return victim;
+    }
+    return candidate;
+  }
+  if (protected_.size > 0) {
+    return protected_.tail;
+  }
+  return window_.tail;
+}
+
+} // namespace kvstore
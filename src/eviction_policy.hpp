@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+namespace kvstore {
+
+enum class EvictionPolicy : uint8_t {
+  kClock,
+  kTinyLfu,
+};
+
+// Accepts "clock" or "tinylfu"; throws std::runtime_error otherwise.
+EvictionPolicy parse_eviction_policy(std::string_view name);
+
+// Count-min sketch of access frequencies with four rows of saturating 4-bit
+// counters (stored one per byte). Every counter is halved once the number of
+// increments reaches ten times the width, so the estimates follow the recent
+// popularity of a key rather than its lifetime total.
+class FrequencySketch {
+ public:
+  // Grows the sketch to at least `entries` counters per row. Growing resets the
+  // counts.
+  void ensure_capacity(size_t entries);
+  void increment(uint64_t hash);
+  uint32_t estimate(uint64_t hash) const;
+  size_t allocated_bytes() const { return table_.capacity(); }
+
+ private:
+  static constexpr size_t kRows = 4;
+  static constexpr uint8_t kMaxCount = 15;
+
+  size_t index_of(uint64_t hash, size_t row) const;
+  void age();
+
+  std::vector<uint8_t> table_;
+  size_t width_ = 0;
+  size_t additions_ = 0;
+  size_t sample_size_ = 0;
+};
+
+// Window TinyLFU bookkeeping for one shard. Keys are identified by their hash
+// and a node id handed out on insert; the caller stores the id next to the
+// entry and maps a chosen victim back to it.
+//
+// New keys enter a small LRU window (1% of the shard). Keys pushed out of the
+// window move to the probation segment of the main region as admission
+// candidates; a hit in probation promotes the key to the protected segment
+// (80% of the main region), whose overflow is demoted back to probation. When
+// the store needs room, the newest candidate is evicted instead of the
+// probation LRU victim unless its estimated frequency is higher, so a burst
+// of one-off keys cannot flush the frequently used set.
+class TinyLfuPolicy {
+ public:
+  static constexpr uint32_t kNoNode = std::numeric_limits<uint32_t>::max();
+
+  uint32_t on_insert(uint64_t hash);
+  void on_access(uint32_t node);
+  // A lookup for an absent key still counts towards its frequency, so a key
+  // that keeps being requested after eviction can win admission again.
+  void on_miss(uint64_t hash);
+  void on_remove(uint32_t node);
+
+  // Node that should be evicted next, or kNoNode when the shard is empty. The
+  // node stays tracked until the caller removes it with on_remove().
+  uint32_t select_victim();
+  uint64_t hash_of(uint32_t node) const { return nodes_[node].hash; }
+  size_t size() const { return window_.size + probation_.size + protected_.size; }
+  size_t allocated_bytes() const {
+    return nodes_.capacity() * sizeof(Node) + free_nodes_.capacity() * sizeof(uint32_t) + sketch_.allocated_bytes();
+  }
+
+ private:
+  enum class Region : uint8_t {
+    kWindow,
+    kProbation,
+    kProtected,
+  };
+
+  struct Node {
+    uint64_t hash = 0;
+    uint32_t prev = kNoNode;
+    uint32_t next = kNoNode;
+    Region region = Region::kWindow;
+    // Set when the node was moved out of the window and has not yet had to
+    // prove its frequency against the probation victim.
+    bool candidate = false;
+  };
+
+  struct List {
+    uint32_t head = kNoNode;
+    uint32_t tail = kNoNode;
+    size_t size = 0;
+  };
+
+  List& list_for(Region region);
+  void push_front(Region region, uint32_t node);
+  void unlink(uint32_t node);
+  void move_to_front(Region region, uint32_t node);
+  size_t window_target() const;
+  size_t protected_target() const;
+
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> free_nodes_;
+  List window_;
+  List probation_;
+  List protected_;
+  FrequencySketch sketch_;
+};
+
+} // namespace kvstore
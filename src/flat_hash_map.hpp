@@ -0,0 +1,563 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KVSTORE_FLAT_HASH_SSE2 1
+#endif
+
+namespace kvstore {
+
+// Open-addressing hash map in the style of Swiss tables. Slots are grouped 16
+// at a time; each slot has a control byte that is either empty, deleted, or
+// the low 7 bits of the key's H2 hash fragment. A lookup loads a whole group of
+// control bytes, compares them against H2 in one SSE2 instruction and only
+// touches the slots that match, so keys and values live inline in one flat
+// array with no per-entry node allocation.
+//
+// The caller may compute the hash once and pass it to the *_hashed overloads,
+// e.g. to pick a shard and probe within it. The home group comes from the top
+// bits of the hash and H2 from bits 16..22, leaving the low bits free for shard
+// selection. Insertions may rehash and invalidate iterators and references;
+// erase never moves other elements.
+//
+// probe_unlocked() supports optimistic readers that look up a key while a
+// writer may be changing the map. With deferred release on, a rehash keeps
+// the old arrays as a RetiredTable instead of freeing them, so the owner can
+// free them after every such reader is done.
+template <typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+class FlatHashMap {
+ public:
+  using key_type = Key;
+  using mapped_type = Value;
+  using value_type = std::pair<Key, Value>;
+  using size_type = size_t;
+
+  static constexpr size_t kGroupWidth = 16;
+
+ private:
+  using ctrl_t = int8_t;
+  static constexpr ctrl_t kEmpty = -128;
+  static constexpr ctrl_t kDeleted = -2;
+
+  template <bool Const>
+  class Iterator;
+
+ public:
+  // Control bytes and slots replaced by a rehash under deferred release. Frees
+  // them when destroyed.
+  class RetiredTable {
+   public:
+    RetiredTable(ctrl_t* ctrl, value_type* slots, size_t capacity) : ctrl_(ctrl), slots_(slots), capacity_(capacity) {}
+    ~RetiredTable() { release(ctrl_, slots_, capacity_); }
+
+    RetiredTable(RetiredTable&& other) noexcept
+        : ctrl_(std::exchange(other.ctrl_, nullptr)), slots_(other.slots_), capacity_(other.capacity_) {}
+    RetiredTable& operator=(RetiredTable&& other) noexcept {
+      std::swap(ctrl_, other.ctrl_);
+      std::swap(slots_, other.slots_);
+      std::swap(capacity_, other.capacity_);
+      return *this;
+    }
+    RetiredTable(const RetiredTable&) = delete;
+    RetiredTable& operator=(const RetiredTable&) = delete;
+
+   private:
+    ctrl_t* ctrl_;
+    value_type* slots_;
+    size_t capacity_;
+  };
+
+ private:
+  template <bool Const>
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = FlatHashMap::value_type;
+    using difference_type = std::ptrdiff_t;
+    using reference = std::conditional_t<Const, const value_type&, value_type&>;
+    using pointer = std::conditional_t<Const, const value_type*, value_type*>;
+
+    Iterator() = default;
+    Iterator(const ctrl_t* ctrl, pointer slot, const ctrl_t* end) : ctrl_(ctrl), slot_(slot), end_(end) {
+      skip_free();
+    }
+    template <bool C = Const, typename = std::enable_if_t<C>>
+    Iterator(const Iterator<false>& other) : ctrl_(other.ctrl_), slot_(other.slot_), end_(other.end_) {}
+
+    reference operator*() const { return *slot_; }
+    pointer operator->() const { return slot_; }
+    Iterator& operator++() {
+      ++ctrl_;
+      ++slot_;
+      skip_free();
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator copy = *this;
+      ++*this;
+      return copy;
+    }
+    friend bool operator==(const Iterator& a, const Iterator& b) { return a.ctrl_ == b.ctrl_; }
+    friend bool operator!=(const Iterator& a, const Iterator& b) { return a.ctrl_ != b.ctrl_; }
+
+   private:
+    friend class FlatHashMap;
+    template <bool>
+    friend class Iterator;
+
+    void skip_free() {
+      while (ctrl_ != end_ && *ctrl_ < 0) {
+        ++ctrl_;
+        ++slot_;
+      }
+    }
+
+    const ctrl_t* ctrl_ = nullptr;
+    pointer slot_ = nullptr;
+    const ctrl_t* end_ = nullptr;
+  };
+
+ public:
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  FlatHashMap() = default;
+  ~FlatHashMap() { destroy(); }
+
+  FlatHashMap(const FlatHashMap&) = delete;
+  FlatHashMap& operator=(const FlatHashMap&) = delete;
+
+  FlatHashMap(FlatHashMap&& other) noexcept { swap(other); }
+  FlatHashMap& operator=(FlatHashMap&& other) noexcept {
+    if (this != &other) {
+      destroy();
+      swap(other);
+    }
+    return *this;
+  }
+
+  void swap(FlatHashMap& other) noexcept {
+    std::swap(ctrl_, other.ctrl_);
+    std::swap(slots_, other.slots_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(size_, other.size_);
+    std::swap(deleted_, other.deleted_);
+    std::swap(shift_, other.shift_);
+    std::swap(defer_release_, other.defer_release_);
+    std::swap(retired_, other.retired_);
+  }
+
+  iterator begin() { return iterator(ctrl_, slots_, ctrl_ + capacity_); }
+  iterator end() { return iterator(ctrl_ + capacity_, slots_ + capacity_, ctrl_ + capacity_); }
+  const_iterator begin() const { return const_iterator(ctrl_, slots_, ctrl_ + capacity_); }
+  const_iterator end() const { return const_iterator(ctrl_ + capacity_, slots_ + capacity_, ctrl_ + capacity_); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t capacity() const { return capacity_; }
+
+  // Bytes owned by the table itself, not counting heap memory owned by keys
+  // and values.
+  size_t allocated_bytes() const { return capacity_ * (sizeof(ctrl_t) + sizeof(value_type)); }
+
+  void clear() {
+    destroy();
+    ctrl_ = nullptr;
+    slots_ = nullptr;
+    capacity_ = 0;
+    size_ = 0;
+    deleted_ = 0;
+    shift_ = kHashBits;
+  }
+
+  // While on, rehashing keeps the replaced arrays until take_retired().
+  void set_deferred_release(bool defer) { defer_release_ = defer; }
+  std::vector<RetiredTable> take_retired() { return std::exchange(retired_, {}); }
+
+  void reserve(size_t count) {
+    size_t wanted = kGroupWidth;
+    while (wanted * 7 / 8 < count) {
+      wanted *= 2;
+    }
+    if (wanted > capacity_) {
+      rehash(wanted);
+    }
+  }
+
+  template <typename K>
+  size_t hash_of(const K& key) const {
+    return Hash{}(key);
+  }
+
+  template <typename K>
+  iterator find(const K& key) {
+    return find_hashed(key, hash_of(key));
+  }
+
+  template <typename K>
+  const_iterator find(const K& key) const {
+    size_t index = find_index(key, hash_of(key));
+    return index == kNotFound ? end() : const_iterator(ctrl_ + index, slots_ + index, ctrl_ + capacity_);
+  }
+
+  template <typename K>
+  iterator find_hashed(const K& key, size_t hash) {
+    size_t index = find_index(key, hash);
+    return index == kNotFound ? end() : iterator_at(index);
+  }
+
+  // Starts loading the control bytes and first slots of the home group for
+  // `hash`, so a lookup issued a little later finds them in cache. A hint only;
+  // the map must not be rehashed concurrently.
+  void prefetch(size_t hash) const {
+    if (capacity_ == 0) {
+      return;
+    }
+    size_t index = home_group(hash) * kGroupWidth;
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(ctrl_ + index);
+    __builtin_prefetch(slots_ + index);
+#elif defined(KVSTORE_FLAT_HASH_SSE2)
+    _mm_prefetch(reinterpret_cast<const char*>(ctrl_ + index), _MM_HINT_T0);
+    _mm_prefetch(reinterpret_cast<const char*>(slots_ + index), _MM_HINT_T0);
+#endif
+  }
+
+  // Probes the sequence for `hash` and returns the first live slot whose H2
+  // matches and that satisfies `pred`. Lets a policy that only remembers a
+  // key's hash find the entry again without storing the key.
+  template <typename Pred>
+  iterator find_hashed_if(size_t hash, Pred&& pred) {
+    if (capacity_ == 0) {
+      return end();
+    }
+    ctrl_t tag = static_cast<ctrl_t>(h2(hash));
+    size_t groups = group_count();
+    size_t group = home_group(hash);
+    for (size_t probes = 0; probes < groups; ++probes) {
+      const ctrl_t* ctrl = ctrl_ + group * kGroupWidth;
+      for (uint32_t mask = match_byte(ctrl, tag); mask != 0; mask &= mask - 1) {
+        size_t index = group * kGroupWidth + static_cast<size_t>(std::countr_zero(mask));
+        if (pred(slots_[index])) {
+          return iterator_at(index);
+        }
+      }
+      if (match_byte(ctrl, kEmpty) != 0) {
+        return end();
+      }
+      group = (group + 1) & (groups - 1);
+    }
+    return end();
+  }
+
+  // Calls `visit(slot)` for every entry whose hash lies in [low, high], in slot
+  // order. The range maps to a run of home groups; since probing can displace
+  // an entry past its home group, the walk continues past the run up to a
+  // group with an empty slot, which ends every probe sequence. A key's hash
+  // never changes, so repeated calls over adjacent ranges cover every entry
+  // even if the table is rehashed between them.
+  template <typename Visit>
+  void for_each_in_hash_range(size_t low, size_t high, Visit&& visit) const {
+    if (capacity_ == 0) {
+      return;
+    }
+    size_t groups = group_count();
+    size_t first = home_group(low);
+    size_t run = home_group(high) - first;
+    size_t group = first;
+    for (size_t probes = 0; probes < groups; ++probes) {
+      const ctrl_t* ctrl = ctrl_ + group * kGroupWidth;
+      for (size_t i = 0; i < kGroupWidth; ++i) {
+        if (ctrl[i] < 0) {
+          continue;
+        }
+        const value_type& slot = slots_[group * kGroupWidth + i];
+        size_t hash = hash_of(slot.first);
+        if (hash >= low && hash <= high) {
+          visit(slot);
+        }
+      }
+      if (probes >= run && match_byte(ctrl, kEmpty) != 0) {
+        return;
+      }
+      group = (group + 1) & (groups - 1);
+    }
+  }
+
+  // Looks up `hash` without a lock while a writer may be modifying the map.
+  // The table header and every candidate key and value are copied first and
+  // `validate()` is called before the copies are used; once it returns false
+  // the probe gives up and returns false. Each matching candidate is passed to
+  // `pred(slot, key, value)`, which returns true to stop the probe; `slot` is
+  // the live slot, which may change or belong to a retired table by then. The
+  // caller must keep retired tables alive until the probe returns and check
+  // the final result with its own validation. Returns true when the probe ran
+  // to the end or `pred` stopped it.
+  template <typename Validate, typename Pred>
+  bool probe_unlocked(size_t hash, Validate&& validate, Pred&& pred) const {
+    static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>);
+    const ctrl_t* ctrl_base = ctrl_;
+    const value_type* slots = slots_;
+    size_t capacity = capacity_;
+    unsigned shift = shift_;
+    if (!validate()) {
+      return false;
+    }
+    if (capacity == 0) {
+      return true;
+    }
+    ctrl_t tag = static_cast<ctrl_t>(h2(hash));
+    size_t groups = capacity / kGroupWidth;
+    size_t group = shift >= kHashBits ? 0 : hash >> shift;
+    for (size_t probes = 0; probes < groups; ++probes) {
+      const ctrl_t* ctrl = ctrl_base + group * kGroupWidth;
+      for (uint32_t mask = match_byte(ctrl, tag); mask != 0; mask &= mask - 1) {
+        const value_type* slot = slots + group * kGroupWidth + static_cast<size_t>(std::countr_zero(mask));
+        Key key;
+        Value value;
+        std::memcpy(static_cast<void*>(&key), &slot->first, sizeof(Key));
+        std::memcpy(static_cast<void*>(&value), &slot->second, sizeof(Value));
+        if (!validate()) {
+          return false;
+        }
+        if (pred(slot, key, value)) {
+          return true;
+        }
+      }
+      if (match_byte(ctrl, kEmpty) != 0) {
+        return true;
+      }
+      group = (group + 1) & (groups - 1);
+    }
+    return true;
+  }
+
+  template <typename K>
+  bool contains(const K& key) const {
+    return find(key) != end();
+  }
+
+  template <typename K, typename... Args>
+  std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+    size_t hash = hash_of(key);
+    return try_emplace_hashed(hash, std::forward<K>(key), std::forward<Args>(args)...);
+  }
+
+  template <typename K, typename... Args>
+  std::pair<iterator, bool> try_emplace_hashed(size_t hash, K&& key, Args&&... args) {
+    size_t index = find_index(key, hash);
+    if (index != kNotFound) {
+      return {iterator_at(index), false};
+    }
+    index = prepare_insert(hash);
+    new (slots_ + index) value_type(std::piecewise_construct, std::forward_as_tuple(Key(std::forward<K>(key))),
+                                    std::forward_as_tuple(std::forward<Args>(args)...));
+    return {iterator_at(index), true};
+  }
+
+  template <typename K, typename V>
+  std::pair<iterator, bool> emplace(K&& key, V&& value) {
+    return try_emplace(std::forward<K>(key), std::forward<V>(value));
+  }
+
+  template <typename K>
+  Value& operator[](K&& key) {
+    return try_emplace(std::forward<K>(key)).first->second;
+  }
+
+  // Direct slot access for policies that sweep the table in slot order, such as
+  // a CLOCK hand. Returns null for empty or deleted slots.
+  value_type* slot_at(size_t index) { return ctrl_[index] >= 0 ? slots_ + index : nullptr; }
+  void erase_slot(size_t index) { erase_index(index); }
+
+  iterator erase(iterator it) {
+    erase_index(static_cast<size_t>(it.ctrl_ - ctrl_));
+    ++it;
+    return it;
+  }
+
+  template <typename K>
+  size_t erase(const K& key) {
+    size_t index = find_index(key, hash_of(key));
+    if (index == kNotFound) {
+      return 0;
+    }
+    erase_index(index);
+    return 1;
+  }
+
+ private:
+  static constexpr size_t kNotFound = static_cast<size_t>(-1);
+  static constexpr unsigned kHashBits = sizeof(size_t) * 8;
+
+  static uint8_t h2(size_t hash) { return static_cast<uint8_t>((hash >> 16) & 0x7F); }
+  size_t home_group(size_t hash) const { return shift_ >= kHashBits ? 0 : hash >> shift_; }
+  size_t group_count() const { return capacity_ / kGroupWidth; }
+
+  // Bit i of the result is set when control byte i of the group matches.
+  static uint32_t match_byte(const ctrl_t* group, ctrl_t value) {
+#ifdef KVSTORE_FLAT_HASH_SSE2
+    __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i*>(group));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value))));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; ++i) {
+      mask |= static_cast<uint32_t>(group[i] == value) << i;
+    }
+    return mask;
+#endif
+  }
+
+  // Empty or deleted slots have the sign bit set.
+  static uint32_t match_free(const ctrl_t* group) {
+#ifdef KVSTORE_FLAT_HASH_SSE2
+    __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i*>(group));
+    return static_cast<uint32_t>(_mm_movemask_epi8(ctrl));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; ++i) {
+      mask |= static_cast<uint32_t>(group[i] < 0) << i;
+    }
+    return mask;
+#endif
+  }
+
+  iterator iterator_at(size_t index) { return iterator(ctrl_ + index, slots_ + index, ctrl_ + capacity_); }
+
+  template <typename K>
+  size_t find_index(const K& key, size_t hash) const {
+    if (capacity_ == 0) {
+      return kNotFound;
+    }
+    ctrl_t tag = static_cast<ctrl_t>(h2(hash));
+    size_t groups = group_count();
+    size_t group = home_group(hash);
+    for (size_t probes = 0; probes < groups; ++probes) {
+      const ctrl_t* ctrl = ctrl_ + group * kGroupWidth;
+      for (uint32_t mask = match_byte(ctrl, tag); mask != 0; mask &= mask - 1) {
+        size_t index = group * kGroupWidth + static_cast<size_t>(std::countr_zero(mask));
+        if (KeyEqual{}(slots_[index].first, key)) {
+          return index;
+        }
+      }
+      // A group with an empty slot ends every probe sequence that reaches it.
+      if (match_byte(ctrl, kEmpty) != 0) {
+        return kNotFound;
+      }
+      group = (group + 1) & (groups - 1);
+    }
+    return kNotFound;
+  }
+
+  size_t prepare_insert(size_t hash) {
+    if (capacity_ == 0) {
+      rehash(kGroupWidth);
+    } else if ((size_ + deleted_ + 1) * 8 > capacity_ * 7) {
+      // Mostly tombstones: rebuild at the same size instead of growing.
+      rehash(size_ * 2 < capacity_ ? capacity_ : capacity_ * 2);
+    }
+    size_t index = find_free(hash);
+    if (ctrl_[index] == kDeleted) {
+      --deleted_;
+    }
+    ctrl_[index] = static_cast<ctrl_t>(h2(hash));
+    ++size_;
+    return index;
+  }
+
+  size_t find_free(size_t hash) const {
+    size_t groups = group_count();
+    size_t group = home_group(hash);
+    while (true) {
+      const ctrl_t* ctrl = ctrl_ + group * kGroupWidth;
+      uint32_t mask = match_free(ctrl);
+      if (mask != 0) {
+        return group * kGroupWidth + static_cast<size_t>(std::countr_zero(mask));
+      }
+      group = (group + 1) & (groups - 1);
+    }
+  }
+
+  void erase_index(size_t index) {
+    slots_[index].~value_type();
+    --size_;
+    // Probe sequences only continue past full groups, so a slot in a group
+    // that still has an empty slot can become empty again.
+    const ctrl_t* group = ctrl_ + (index / kGroupWidth) * kGroupWidth;
+    if (match_byte(group, kEmpty) != 0) {
+      ctrl_[index] = kEmpty;
+    } else {
+      ctrl_[index] = kDeleted;
+      ++deleted_;
+    }
+  }
+
+  void rehash(size_t new_capacity) {
+    ctrl_t* old_ctrl = ctrl_;
+    value_type* old_slots = slots_;
+    size_t old_capacity = capacity_;
+
+    ctrl_ = static_cast<ctrl_t*>(::operator new(new_capacity, std::align_val_t(kGroupWidth)));
+    std::memset(ctrl_, static_cast<unsigned char>(kEmpty), new_capacity);
+    slots_ = std::allocator<value_type>{}.allocate(new_capacity);
+    capacity_ = new_capacity;
+    shift_ = kHashBits - static_cast<unsigned>(std::countr_zero(new_capacity / kGroupWidth));
+    deleted_ = 0;
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old_ctrl[i] >= 0) {
+        size_t hash = hash_of(old_slots[i].first);
+        size_t index = find_free(hash);
+        ctrl_[index] = static_cast<ctrl_t>(h2(hash));
+        new (slots_ + index) value_type(std::move(old_slots[i]));
+        old_slots[i].~value_type();
+      }
+    }
+    if (defer_release_ && old_ctrl != nullptr) {
+      retired_.emplace_back(old_ctrl, old_slots, old_capacity);
+    } else {
+      release(old_ctrl, old_slots, old_capacity);
+    }
+  }
+
+  void destroy() {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl_[i] >= 0) {
+        slots_[i].~value_type();
+      }
+    }
+    release(ctrl_, slots_, capacity_);
+  }
+
+  static void release(ctrl_t* ctrl, value_type* slots, size_t capacity) {
+    if (ctrl == nullptr) {
+      return;
+    }
+    ::operator delete(ctrl, std::align_val_t(kGroupWidth));
+    std::allocator<value_type>{}.deallocate(slots, capacity);
+  }
+
+  ctrl_t* ctrl_ = nullptr;
+  value_type* slots_ = nullptr;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+  size_t deleted_ = 0;
+  unsigned shift_ = kHashBits;
+  bool defer_release_ = false;
+  std::vector<RetiredTable> retired_;
+};
+
+} // namespace kvstore
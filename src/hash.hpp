@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+namespace kvstore {
+
+// 64-bit wyhash (final version 4) of a key. It reads the key 8 or 16 bytes at
+// a time and mixes with 64x64->128-bit multiplies, so short keys hash in a
+// handful of instructions; the output passes SMHasher, so any subset of its
+// bits can be used on its own. The store computes it once per operation and
+// splits it: the low bits select a shard, the high bits probe the shard map.
+namespace detail {
+
+inline void wy_multiply(uint64_t& a, uint64_t& b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t product = static_cast<__uint128_t>(a) * b;
+  a = static_cast<uint64_t>(product);
+  b = static_cast<uint64_t>(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  a = _umul128(a, b, &b);
+#else
+  uint64_t ha = a >> 32, hb = b >> 32, la = static_cast<uint32_t>(a), lb = static_cast<uint32_t>(b);
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32);
+  uint64_t carry = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  carry += lo < t;
+  uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+  a = lo;
+  b = hi;
+#endif
+}
+
+inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+  wy_multiply(a, b);
+  return a ^ b;
+}
+
+inline uint64_t wy_read8(const uint8_t* p) {
+  uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;
+}
+
+inline uint64_t wy_read4(const uint8_t* p) {
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+inline uint64_t wy_read3(const uint8_t* p, size_t k) {
+  return (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[k >> 1]) << 8) | p[k - 1];
+}
+
+constexpr uint64_t kWySecret[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL,
+                                   0x4d5a2da51de1aa47ULL};
+
+} // namespace detail
+
+inline uint64_t hash_key(std::string_view key, uint64_t seed = 0) {
+  using namespace detail;
+  const auto* p = reinterpret_cast<const uint8_t*>(key.data());
+  size_t len = key.size();
+  seed ^= wy_mix(seed ^ kWySecret[0], kWySecret[1]);
+  uint64_t a;
+  uint64_t b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (wy_read4(p) << 32) | wy_read4(p + ((len >> 3) << 2));
+      b = (wy_read4(p + len - 4) << 32) | wy_read4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wy_read3(p, len);
+      b = 0;
+    } else {
+      a = 0;
+      b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t seed1 = seed;
+      uint64_t seed2 = seed;
+      do {
+        seed = wy_mix(wy_read8(p) ^ kWySecret[1], wy_read8(p + 8) ^ seed);
+        seed1 = wy_mix(wy_read8(p + 16) ^ kWySecret[2], wy_read8(p + 24) ^ seed1);
+        seed2 = wy_mix(wy_read8(p + 32) ^ kWySecret[3], wy_read8(p + 40) ^ seed2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (i > 16) {
+      seed = wy_mix(wy_read8(p) ^ kWySecret[1], wy_read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = wy_read8(p + i - 16);
+    b = wy_read8(p + i - 8);
+  }
+  a ^= kWySecret[1];
+  b ^= seed;
+  wy_multiply(a, b);
+  return wy_mix(a ^ kWySecret[0] ^ len, b ^ kWySecret[1]);
+}
+
+} // namespace kvstore
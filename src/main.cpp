@@ -1,48 +1,83 @@
+#include "affinity.hpp"
 #include "config.hpp"
 #include "fault_injection.hpp"
 #include "metrics.hpp"
 #include "persistence.hpp"
+#include "protocol.hpp"
 #include "replication.hpp"
 #include "server.hpp"
 #include "storage.hpp"
 #include "thread_pool.hpp"
 #include "net.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <csignal>
 #include <cstdlib>
 #include <filesystem>
 #include <iostream>
-#include <sstream>
 #include <thread>
 
 namespace kvstore {
 
 void apply_record(ShardedStore& store, const std::string& record) {
-  std::istringstream stream(record);
-  std::string cmd;
-  stream >> cmd;
-  if (cmd == "PUT") {
-    std::string key;
-    std::string value;
-    stream >> key >> value;
-    std::optional<uint32_t> ttl;
-    if (!stream.eof()) {
-      uint32_t ttl_value;
-      if (stream >> ttl_value) {
-        ttl = ttl_value;
-      }
+  if (is_binary_frame(record)) {
+    if (record.size() < kBinaryHeaderSize) {
+      return;
     }
-    if (!key.empty()) {
-      store.put(key, value, ttl);
+    BinaryHeader header = decode_binary_header(record.data());
+    if (record.size() < header.frame_size()) {
+      return;
     }
-  } else if (cmd == "DEL") {
-    std::string key;
-    stream >> key;
-    if (!key.empty()) {
+    std::string_view key(record.data() + kBinaryHeaderSize, header.key_len);
+    std::string_view value(record.data() + kBinaryHeaderSize + header.key_len, header.value_len);
+    if (header.opcode == static_cast<uint8_t>(BinaryOpcode::kPut)) {
+      std::optional<uint32_t> ttl;
+      if (header.flags & kBinaryFlagTtl) {
+        ttl = static_cast<uint32_t>(header.arg);
+      }
+      store.put(key, value, ttl);
+    } else if (header.opcode == static_cast<uint8_t>(BinaryOpcode::kDel)) {
       store.del(key);
+    } else if (header.opcode == static_cast<uint8_t>(BinaryOpcode::kMset)) {
+      std::vector<std::pair<std::string_view, std::string_view>> items;
+      if (decode_binary_pairs(value, header.arg, items)) {
+        store.put_many(items);
+      }
+    }
+    return;
+  }
+  Tokens parts = tokenize(record);
+  if (parts.size() < 2) {
+    return;
+  }
+  switch (lookup_command(parts[0])) {
+    case CommandId::kPut: {
+      std::string_view value = parts.size() >= 3 ? parts[2] : std::string_view();
+      std::optional<uint32_t> ttl;
+      uint32_t ttl_value = 0;
+      if (parts.size() >= 4 && parse_u32(parts[3], ttl_value)) {
+        ttl = ttl_value;
+      }
+      store.put(parts[1], value, ttl);
+      break;
     }
+    case CommandId::kDel:
+      store.del(parts[1]);
+      break;
+    case CommandId::kMset: {
+      std::vector<std::string_view> args;
+      tokenize_all(record, args);
+      std::vector<std::pair<std::string_view, std::string_view>> items;
+      for (size_t i = 1; i + 1 < args.size(); i += 2) {
+        items.emplace_back(args[i], args[i + 1]);
+      }
+      store.put_many(items);
+      break;
+    }
+    default:
+      break;
   }
 }
 
@@ -63,8 +98,19 @@ int main(int argc, char** argv) {
   kvstore::net::NetContext net_context;
   kvstore::Metrics metrics;
   kvstore::FaultInjector fault_injector;
-  kvstore::ThreadPool pool(config.worker_threads, config.task_queue_depth);
-  kvstore::ShardedStore store(config.shard_count, config.memory_budget_bytes, metrics);
+  kvstore::ThreadPool pool(config.worker_threads, config.task_queue_depth,
+                           std::chrono::microseconds(config.sojourn_target_us),
+                           std::chrono::milliseconds(config.sojourn_interval_ms),
+                           kvstore::plan_cpu_sets(kvstore::CpuTopology::system(), config.worker_cpus,
+                                                  config.numa_placement));
+  if (config.network_mode == "percore") {
+    // Each core needs at least one shard of its own.
+    config.shard_count = std::max(config.shard_count, std::max<uint32_t>(config.io_threads, 1));
+  }
+  kvstore::ShardedStore store(config.shard_count, config.memory_budget_bytes, metrics,
+                              kvstore::parse_eviction_policy(config.eviction_policy), config.huge_pages,
+                              config.evict_high_watermark, config.evict_low_watermark,
+                              config.version_retention_bytes, config.ordered_index, config.numa_placement);
 
   std::filesystem::create_directories(config.data_dir);
   kvstore::SnapshotManager snapshot_manager(config.data_dir, fault_injector, metrics, config.snapshot_delay_ms);
@@ -115,21 +161,26 @@ int main(int argc, char** argv) {
   kvstore::KvServer server(config, store, pool, metrics, wal_writer, broadcaster);
   server.start();
 
+  // Expiry, eviction and snapshots run as sliced jobs on the pool's background
+  // lane, which yields to client requests; these threads only schedule them.
+  store.set_background_pool(&pool);
   std::atomic<bool> running{true};
   g_running = &running;
   std::thread ttl_thread([&]() {
     while (running) {
-      store.expire_keys();
-      std::this_thread::sleep_for(std::chrono::seconds(config.ttl_scan_interval_seconds));
+      size_t cursor = 0;
+      kvstore::Completion<void> expired;
+      pool.run_sliced([&]() { return store.expire_step(cursor); }, expired);
+      expired.get();
+      store.refresh_memory_stats();
+      std::this_thread::sleep_for(std::chrono::milliseconds(config.ttl_tick_ms));
     }
   });
 
   std::thread snapshot_thread([&]() {
     while (running) {
       std::this_thread::sleep_for(std::chrono::seconds(config.snapshot_interval_seconds));
-      auto version = store.current_version();
-      auto items = store.snapshot(version);
-      snapshot_manager.write_snapshot(items);
+      snapshot_manager.write_snapshot_sliced(store, pool);
     }
   });
 
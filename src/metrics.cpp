@@ -7,11 +7,15 @@ namespace kvstore {
 LatencySampler::LatencySampler(size_t max_samples) : max_samples_(max_samples) {}
 
 void LatencySampler::record(std::chrono::nanoseconds value) {
+  double sample = static_cast<double>(value.count()) / 1000.0;
   std::lock_guard<std::mutex> lock(mutex_);
-  if (samples_.size() >= max_samples_) {
-    samples_.erase(samples_.begin());
+  // Overwrite the oldest sample in place once the window is full.
+  if (samples_.size() < max_samples_) {
+    samples_.push_back(sample);
+  } else {
+    samples_[next_] = sample;
+    next_ = (next_ + 1) % max_samples_;
   }
-  samples_.push_back(static_cast<double>(value.count()) / 1000.0);
 }
 
 Percentiles LatencySampler::percentiles() const {
@@ -32,11 +36,23 @@ Percentiles LatencySampler::percentiles() const {
   return result;
 }
 
-void Metrics::record_get() { get_count_++; }
-void Metrics::record_put() { put_count_++; }
+void Metrics::record_get(uint64_t count) { get_count_ += count; }
+void Metrics::record_put(uint64_t count) { put_count_ += count; }
 void Metrics::record_del() { del_count_++; }
 void Metrics::record_batch() { batch_count_++; }
+void Metrics::record_admitted() { admitted_requests_++; }
+void Metrics::record_shed(uint64_t count) { shed_requests_ += count; }
+void Metrics::record_expired(uint64_t count) { expired_requests_ += count; }
 void Metrics::record_eviction() { eviction_count_++; }
+void Metrics::record_inline_evictions(uint64_t count) {
+  if (count != 0) {
+    inline_eviction_count_ += count;
+  }
+}
+void Metrics::record_cache_hit() { cache_hits_++; }
+void Metrics::record_cache_miss() { cache_misses_++; }
+void Metrics::record_optimistic_retry() { optimistic_read_retries_++; }
+void Metrics::record_optimistic_fallback() { optimistic_read_fallbacks_++; }
 
 void Metrics::record_latency(std::chrono::nanoseconds latency) {
   latency_sampler_.record(latency);
@@ -47,21 +63,95 @@ void Metrics::set_wal_bytes(uint64_t bytes) { wal_bytes_ = bytes; }
 void Metrics::set_snapshot_duration(uint64_t ms) { snapshot_duration_ms_ = ms; }
 void Metrics::set_replication_lag(uint64_t lag) { replication_lag_ = lag; }
 
+void Metrics::set_rebalance_progress(bool active, double progress) {
+  rebalance_progress_ = progress;
+  rebalance_active_ = active;
+}
+
+void Metrics::record_rebalance_moved(uint64_t keys) { rebalance_keys_moved_ += keys; }
+
+void Metrics::set_version_stats(uint64_t snapshots, uint64_t versions, uint64_t bytes) {
+  snapshots_active_ = snapshots;
+  mvcc_versions_ = versions;
+  mvcc_retained_bytes_ = bytes;
+}
+
+void Metrics::record_version_dropped() { mvcc_versions_dropped_++; }
+
+void Metrics::record_node_access(size_t node, bool remote, uint64_t count) {
+  if (node >= kMaxNumaNodes) {
+    return;
+  }
+  auto& counter = remote ? node_accesses_[node].remote : node_accesses_[node].local;
+  counter.fetch_add(count, std::memory_order_relaxed);
+}
+
+void Metrics::set_numa_shards(std::vector<uint64_t> shards_per_node) {
+  std::lock_guard<std::mutex> lock(numa_mutex_);
+  numa_shards_ = std::move(shards_per_node);
+}
+
+void Metrics::set_slab_stats(std::vector<SlabClassMetrics> classes) {
+  std::lock_guard<std::mutex> lock(slab_mutex_);
+  slab_classes_ = std::move(classes);
+}
+
+void Metrics::record_rebalance_switch(std::chrono::nanoseconds elapsed) {
+  uint64_t ns = static_cast<uint64_t>(elapsed.count());
+  rebalance_switch_last_ns_ = ns;
+  uint64_t max = rebalance_switch_max_ns_.load();
+  while (ns > max && !rebalance_switch_max_ns_.compare_exchange_weak(max, ns)) {
+  }
+}
+
 MetricsSnapshot Metrics::snapshot() const {
   MetricsSnapshot snap;
   snap.get_count = get_count_.load();
   snap.put_count = put_count_.load();
   snap.del_count = del_count_.load();
   snap.batch_count = batch_count_.load();
+  snap.admitted_requests = admitted_requests_.load();
+  snap.shed_requests = shed_requests_.load();
+  snap.expired_requests = expired_requests_.load();
   snap.eviction_count = eviction_count_.load();
+  snap.inline_eviction_count = inline_eviction_count_.load();
+  snap.cache_hits = cache_hits_.load();
+  snap.cache_misses = cache_misses_.load();
+  snap.optimistic_read_retries = optimistic_read_retries_.load();
+  snap.optimistic_read_fallbacks = optimistic_read_fallbacks_.load();
+  uint64_t lookups = snap.cache_hits + snap.cache_misses;
+  snap.hit_ratio = lookups == 0 ? 0.0 : static_cast<double>(snap.cache_hits) / static_cast<double>(lookups);
   snap.memory_bytes = memory_bytes_.load();
   snap.wal_bytes = wal_bytes_.load();
   snap.snapshot_duration_ms = snapshot_duration_ms_.load();
   snap.replication_lag = replication_lag_.load();
+  snap.rebalance_active = rebalance_active_.load();
+  snap.rebalance_progress = rebalance_progress_.load();
+  snap.rebalance_keys_moved = rebalance_keys_moved_.load();
+  snap.snapshots_active = snapshots_active_.load();
+  snap.mvcc_versions = mvcc_versions_.load();
+  snap.mvcc_retained_bytes = mvcc_retained_bytes_.load();
+  snap.mvcc_versions_dropped = mvcc_versions_dropped_.load();
+  snap.rebalance_switch_last_us = static_cast<double>(rebalance_switch_last_ns_.load()) / 1000.0;
+  snap.rebalance_switch_max_us = static_cast<double>(rebalance_switch_max_ns_.load()) / 1000.0;
   auto percentiles = latency_sampler_.percentiles();
   snap.p50_us = percentiles.p50;
   snap.p95_us = percentiles.p95;
   snap.p99_us = percentiles.p99;
+  {
+    std::lock_guard<std::mutex> lock(slab_mutex_);
+    snap.slab_classes = slab_classes_;
+  }
+  {
+    std::lock_guard<std::mutex> lock(numa_mutex_);
+    for (size_t node = 0; node < numa_shards_.size() && node < kMaxNumaNodes; ++node) {
+      NumaNodeMetrics metrics;
+      metrics.shards = numa_shards_[node];
+      metrics.local_accesses = node_accesses_[node].local.load(std::memory_order_relaxed);
+      metrics.remote_accesses = node_accesses_[node].remote.load(std::memory_order_relaxed);
+      snap.numa_nodes.push_back(metrics);
+    }
+  }
   return snap;
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <cstdint>
@@ -25,6 +26,26 @@ class LatencySampler {
   size_t max_samples_;
   mutable std::mutex mutex_;
   std::vector<double> samples_;
+  size_t next_ = 0;
+};
+
+// Usage of one slab size class. Large allocations outside the slabs are
+// reported with chunk_size 0.
+struct SlabClassMetrics {
+  uint64_t chunk_size = 0;
+  uint64_t pages = 0;
+  uint64_t reserved_bytes = 0;
+  uint64_t chunks_used = 0;
+  uint64_t chunks_free = 0;
+  uint64_t requested_bytes = 0;
+};
+
+// Home shards of one NUMA node, and the store accesses made from its CPUs to
+// shards homed on it (local) or elsewhere (remote).
+struct NumaNodeMetrics {
+  uint64_t shards = 0;
+  uint64_t local_accesses = 0;
+  uint64_t remote_accesses = 0;
 };
 
 struct MetricsSnapshot {
@@ -32,29 +53,70 @@ struct MetricsSnapshot {
   uint64_t put_count = 0;
   uint64_t del_count = 0;
   uint64_t batch_count = 0;
+  uint64_t admitted_requests = 0;
+  uint64_t shed_requests = 0;
+  uint64_t expired_requests = 0;
   uint64_t eviction_count = 0;
+  uint64_t inline_eviction_count = 0;
+  uint64_t cache_hits = 0;
+  uint64_t cache_misses = 0;
+  double hit_ratio = 0.0;
+  uint64_t optimistic_read_retries = 0;
+  uint64_t optimistic_read_fallbacks = 0;
   uint64_t memory_bytes = 0;
   uint64_t wal_bytes = 0;
   uint64_t snapshot_duration_ms = 0;
   uint64_t replication_lag = 0;
+  bool rebalance_active = false;
+  double rebalance_progress = 0.0;
+  uint64_t rebalance_keys_moved = 0;
+  uint64_t snapshots_active = 0;
+  uint64_t mvcc_versions = 0;
+  uint64_t mvcc_retained_bytes = 0;
+  uint64_t mvcc_versions_dropped = 0;
+  double rebalance_switch_last_us = 0.0;
+  double rebalance_switch_max_us = 0.0;
   double p50_us = 0.0;
   double p95_us = 0.0;
   double p99_us = 0.0;
+  std::vector<SlabClassMetrics> slab_classes;
+  // Empty unless the store places shards on NUMA nodes.
+  std::vector<NumaNodeMetrics> numa_nodes;
 };
 
 class Metrics {
  public:
-  void record_get();
-  void record_put();
+  // Multi-key commands count each key.
+  void record_get(uint64_t count = 1);
+  void record_put(uint64_t count = 1);
   void record_del();
   void record_batch();
+  // Admission control: requests executed, refused because the pool was
+  // overloaded, and refused because they waited past their deadline.
+  void record_admitted();
+  void record_shed(uint64_t count);
+  void record_expired(uint64_t count);
   void record_eviction();
+  void record_inline_evictions(uint64_t count);
+  void record_cache_hit();
+  void record_cache_miss();
+  void record_optimistic_retry();
+  void record_optimistic_fallback();
   void record_latency(std::chrono::nanoseconds latency);
 
   void set_memory_bytes(uint64_t bytes);
   void set_wal_bytes(uint64_t bytes);
   void set_snapshot_duration(uint64_t ms);
   void set_replication_lag(uint64_t lag);
+  void set_rebalance_progress(bool active, double progress);
+  void record_rebalance_moved(uint64_t keys);
+  void set_slab_stats(std::vector<SlabClassMetrics> classes);
+  void record_rebalance_switch(std::chrono::nanoseconds elapsed);
+  void set_version_stats(uint64_t snapshots, uint64_t versions, uint64_t bytes);
+  void record_version_dropped();
+  // Counted by the node of the CPU making the access.
+  void record_node_access(size_t node, bool remote, uint64_t count = 1);
+  void set_numa_shards(std::vector<uint64_t> shards_per_node);
 
   MetricsSnapshot snapshot() const;
 
@@ -63,12 +125,41 @@ class Metrics {
   std::atomic<uint64_t> put_count_{0};
   std::atomic<uint64_t> del_count_{0};
   std::atomic<uint64_t> batch_count_{0};
+  std::atomic<uint64_t> admitted_requests_{0};
+  std::atomic<uint64_t> shed_requests_{0};
+  std::atomic<uint64_t> expired_requests_{0};
   std::atomic<uint64_t> eviction_count_{0};
+  std::atomic<uint64_t> inline_eviction_count_{0};
+  std::atomic<uint64_t> cache_hits_{0};
+  std::atomic<uint64_t> cache_misses_{0};
+  std::atomic<uint64_t> optimistic_read_retries_{0};
+  std::atomic<uint64_t> optimistic_read_fallbacks_{0};
   std::atomic<uint64_t> memory_bytes_{0};
   std::atomic<uint64_t> wal_bytes_{0};
   std::atomic<uint64_t> snapshot_duration_ms_{0};
   std::atomic<uint64_t> replication_lag_{0};
+  std::atomic<bool> rebalance_active_{false};
+  std::atomic<double> rebalance_progress_{0.0};
+  std::atomic<uint64_t> rebalance_keys_moved_{0};
+  std::atomic<uint64_t> rebalance_switch_last_ns_{0};
+  std::atomic<uint64_t> rebalance_switch_max_ns_{0};
+  std::atomic<uint64_t> snapshots_active_{0};
+  std::atomic<uint64_t> mvcc_versions_{0};
+  std::atomic<uint64_t> mvcc_retained_bytes_{0};
+  std::atomic<uint64_t> mvcc_versions_dropped_{0};
   LatencySampler latency_sampler_;
+  mutable std::mutex slab_mutex_;
+  std::vector<SlabClassMetrics> slab_classes_;
+
+  static constexpr size_t kMaxNumaNodes = 16;
+  // One cache line per node, so threads only write their own node's line.
+  struct alignas(64) NodeAccesses {
+    std::atomic<uint64_t> local{0};
+    std::atomic<uint64_t> remote{0};
+  };
+  std::array<NodeAccesses, kMaxNumaNodes> node_accesses_;
+  mutable std::mutex numa_mutex_;
+  std::vector<uint64_t> numa_shards_;
 };
 
 } // namespace kvstore
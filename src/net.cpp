@@ -1,7 +1,12 @@
 #include "net.hpp"
 
+#include <algorithm>
+#include <climits>
+
 #ifdef _WIN32
 #include <mstcpip.h>
+#else
+#include <sys/uio.h>
 #endif
 
 namespace kvstore::net {
@@ -40,14 +45,87 @@ int set_reuseaddr(Socket socket_fd) {
 #endif
 }
 
+int set_nonblocking(Socket socket_fd) {
+#ifdef _WIN32
+  u_long mode = 1;
+  return ioctlsocket(socket_fd, FIONBIO, &mode);
+#else
+  int flags = fcntl(socket_fd, F_GETFL, 0);
+  if (flags < 0) {
+    return flags;
+  }
+  return fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+bool would_block() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
 int send_data(Socket socket_fd, const char* data, size_t size) {
 #ifdef _WIN32
   return send(socket_fd, data, static_cast<int>(size), 0);
+#elif defined(MSG_NOSIGNAL)
+  // A peer that disconnects mid-response must not kill the process with SIGPIPE.
+  return static_cast<int>(send(socket_fd, data, size, MSG_NOSIGNAL));
 #else
   return static_cast<int>(send(socket_fd, data, size, 0));
 #endif
 }
 
+bool send_all(Socket socket_fd, const char* data, size_t size) {
+  size_t sent = 0;
+  while (sent < size) {
+    int n = send_data(socket_fd, data + sent, size - sent);
+    if (n <= 0) {
+      return false;
+    }
+    sent += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+int send_segments(Socket socket_fd, const std::string_view* segments, size_t count) {
+  count = std::min(count, kMaxSendSegments);
+#ifdef _WIN32
+  WSABUF buffers[kMaxSendSegments];
+  for (size_t i = 0; i < count; ++i) {
+    buffers[i].buf = const_cast<char*>(segments[i].data());
+    buffers[i].len = static_cast<ULONG>(segments[i].size());
+  }
+  DWORD sent = 0;
+  if (WSASend(socket_fd, buffers, static_cast<DWORD>(count), &sent, 0, nullptr, nullptr) != 0) {
+    return -1;
+  }
+  return static_cast<int>(sent);
+#else
+  iovec buffers[kMaxSendSegments];
+  size_t total = 0;
+  size_t used = 0;
+  // The result must fit an int; the rest goes out with the next call.
+  for (; used < count && total + segments[used].size() <= INT_MAX; ++used) {
+    buffers[used].iov_base = const_cast<char*>(segments[used].data());
+    buffers[used].iov_len = segments[used].size();
+    total += segments[used].size();
+  }
+  if (used == 0) {
+    return send_data(socket_fd, segments[0].data(), std::min<size_t>(segments[0].size(), INT_MAX));
+  }
+  msghdr message{};
+  message.msg_iov = buffers;
+  message.msg_iovlen = used;
+#ifdef MSG_NOSIGNAL
+  return static_cast<int>(sendmsg(socket_fd, &message, MSG_NOSIGNAL));
+#else
+  return static_cast<int>(sendmsg(socket_fd, &message, 0));
+#endif
+#endif
+}
+
 int recv_data(Socket socket_fd, char* buffer, size_t size) {
 #ifdef _WIN32
   return recv(socket_fd, buffer, static_cast<int>(size), 0);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 
 #ifdef _WIN32
   #ifndef NOMINMAX
@@ -11,8 +12,10 @@
 #else
   #include <arpa/inet.h>
   #include <netinet/in.h>
+  #include <fcntl.h>
   #include <sys/socket.h>
   #include <unistd.h>
+  #include <cerrno>
 #endif
 
 namespace kvstore::net {
@@ -41,7 +44,15 @@ class NetContext {
 
 int close_socket(Socket socket_fd);
 int set_reuseaddr(Socket socket_fd);
+int set_nonblocking(Socket socket_fd);
+bool would_block();
 int send_data(Socket socket_fd, const char* data, size_t size);
+bool send_all(Socket socket_fd, const char* data, size_t size);
+// Most segments passed to one send_segments() call.
+constexpr size_t kMaxSendSegments = 64;
+// Sends up to kMaxSendSegments buffers with one scatter-gather call and returns
+// the number of bytes sent, like send_data().
+int send_segments(Socket socket_fd, const std::string_view* segments, size_t count);
 int recv_data(Socket socket_fd, char* buffer, size_t size);
 
 } // namespace kvstore::net
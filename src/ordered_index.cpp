@@ -0,0 +1,103 @@
+#include "ordered_index.hpp"
+
+namespace kvstore {
+
+OrderedIndex::OrderedIndex() {
+  nodes_.push_back({{}, 0, static_cast<uint8_t>(kMaxHeight)});
+  links_.assign(kMaxHeight, kNoNode);
+}
+
+uint32_t OrderedIndex::find(std::string_view key, Path& preceding) const {
+  uint32_t node = kHead;
+  for (size_t level = height_; level-- > 0;) {
+    for (uint32_t next = link(node, level); next != kNoNode && nodes_[next].key < key; next = link(node, level)) {
+      node = next;
+    }
+    preceding[level] = node;
+  }
+  return link(node, 0);
+}
+
+uint32_t OrderedIndex::lower_bound(std::string_view key) const {
+  Path preceding;
+  return find(key, preceding);
+}
+
+// Each level holds a quarter of the one below, which keeps searches at about
+// 4 log4(n) comparisons with fewer links than the usual one half.
+uint8_t OrderedIndex::random_height() {
+  random_ ^= random_ << 13;
+  random_ ^= random_ >> 7;
+  random_ ^= random_ << 17;
+  uint64_t bits = random_;
+  uint8_t height = 1;
+  while (height < kMaxHeight && (bits & 3) == 0) {
+    ++height;
+    bits >>= 2;
+  }
+  return height;
+}
+
+uint32_t OrderedIndex::allocate(std::string_view key, uint8_t height) {
+  auto& reusable = free_nodes_[height - 1];
+  if (!reusable.empty()) {
+    uint32_t node = reusable.back();
+    reusable.pop_back();
+    nodes_[node].key = key;
+    return node;
+  }
+  auto node = static_cast<uint32_t>(nodes_.size());
+  nodes_.push_back({key, static_cast<uint32_t>(links_.size()), height});
+  links_.resize(links_.size() + height, kNoNode);
+  return node;
+}
+
+void OrderedIndex::insert(std::string_view key) {
+  Path preceding;
+  find(key, preceding);
+  uint8_t height = random_height();
+  for (; height_ < height; ++height_) {
+    preceding[height_] = kHead;
+  }
+  uint32_t node = allocate(key, height);
+  for (size_t level = 0; level < height; ++level) {
+    link(node, level) = link(preceding[level], level);
+    link(preceding[level], level) = node;
+  }
+  ++size_;
+}
+
+void OrderedIndex::erase(std::string_view key) {
+  Path preceding;
+  uint32_t node = find(key, preceding);
+  if (node == kNoNode || nodes_[node].key != key) {
+    return;
+  }
+  uint8_t height = nodes_[node].height;
+  for (size_t level = 0; level < height; ++level) {
+    link(preceding[level], level) = link(node, level);
+  }
+  while (height_ > 1 && link(kHead, height_ - 1) == kNoNode) {
+    --height_;
+  }
+  nodes_[node].key = {};
+  free_nodes_[height - 1].push_back(node);
+  --size_;
+}
+
+void OrderedIndex::rebind(std::string_view key, std::string_view moved) {
+  uint32_t node = lower_bound(key);
+  if (node != kNoNode && nodes_[node].key == key) {
+    nodes_[node].key = moved;
+  }
+}
+
+size_t OrderedIndex::allocated_bytes() const {
+  size_t bytes = nodes_.capacity() * sizeof(Node) + links_.capacity() * sizeof(uint32_t);
+  for (const auto& reusable : free_nodes_) {
+    bytes += reusable.capacity() * sizeof(uint32_t);
+  }
+  return bytes;
+}
+
+} // namespace kvstore
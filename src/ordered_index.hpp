@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+namespace kvstore {
+
+// Skip list over one shard's keys, kept in byte order so range and prefix
+// queries can start at their first key and walk forward. Nodes hold the same
+// view of the key's chunk as the shard map, so the index stores no key bytes
+// of its own. Nodes and their forward links live in pools indexed by 32-bit
+// ids, with freed nodes reused per height, so steady-state writes allocate
+// nothing and a node costs 24 bytes plus 4 bytes per level (4/3 levels on
+// average). Not thread-safe; the owning shard's lock guards it.
+class OrderedIndex {
+ public:
+  static constexpr uint32_t kNoNode = std::numeric_limits<uint32_t>::max();
+
+  OrderedIndex();
+
+  // `key` must not be indexed yet.
+  void insert(std::string_view key);
+  void erase(std::string_view key);
+  // Points the node for `key` at `moved`, a view of the same bytes in another
+  // chunk. `key` must still be readable.
+  void rebind(std::string_view key, std::string_view moved);
+
+  // First node whose key is not less than `key`, or kNoNode.
+  uint32_t lower_bound(std::string_view key) const;
+  uint32_t next(uint32_t node) const { return links_[nodes_[node].links]; }
+  std::string_view key_of(uint32_t node) const { return nodes_[node].key; }
+
+  size_t size() const { return size_; }
+  size_t allocated_bytes() const;
+
+ private:
+  static constexpr size_t kMaxHeight = 16;
+  static constexpr uint32_t kHead = 0;
+
+  struct Node {
+    std::string_view key;
+    // Offset of the node's first forward link in links_.
+    uint32_t links = 0;
+    uint8_t height = 0;
+  };
+
+  using Path = std::array<uint32_t, kMaxHeight>;
+
+  uint32_t& link(uint32_t node, size_t level) { return links_[nodes_[node].links + level]; }
+  uint32_t link(uint32_t node, size_t level) const { return links_[nodes_[node].links + level]; }
+  // Fills `preceding` with the last node before `key` on every level in use
+  // and returns the node after it on level 0.
+  uint32_t find(std::string_view key, Path& preceding) const;
+  uint32_t allocate(std::string_view key, uint8_t height);
+  uint8_t random_height();
+
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> links_;
+  // Freed node ids by height minus one; a reused node keeps its links.
+  std::array<std::vector<uint32_t>, kMaxHeight> free_nodes_;
+  size_t height_ = 1;
+  size_t size_ = 0;
+  uint64_t random_ = 0x9E3779B97F4A7C15ULL;
+};
+
+} // namespace kvstore
@@ -1,5 +1,6 @@
 #include "persistence.hpp"
 
+#include <algorithm>
 #include <chrono>
 #include <cstring>
 #include <iostream>
@@ -8,7 +9,7 @@ namespace kvstore {
 
 namespace {
 
-uint32_t crc32(const std::string& data) {
+uint32_t crc32(std::string_view data) {
   uint32_t crc = 0xFFFFFFFFu;
   for (unsigned char c : data) {
     crc ^= c;
@@ -30,7 +31,7 @@ WalWriter::WalWriter(const std::filesystem::path& path, FaultInjector& fault_inj
   stream_.open(path_, std::ios::binary | std::ios::app);
 }
 
-void WalWriter::append(const std::string& record) {
+void WalWriter::append(std::string_view record) {
   std::lock_guard<std::mutex> lock(mutex_);
   fault_injector_.maybe_delay(std::chrono::milliseconds(delay_ms_));
   if (fault_injector_.should_fail(fail_probability_)) {
@@ -99,13 +100,23 @@ SnapshotManager::SnapshotManager(const std::filesystem::path& dir, FaultInjector
 }
 
 void SnapshotManager::write_snapshot(const std::vector<SnapshotItem>& items) {
-  auto start = std::chrono::steady_clock::now();
-  fault_injector_.maybe_delay(std::chrono::milliseconds(delay_ms_));
+  size_t next = 0;
+  while (write_snapshot_step(items, next, items.size())) {
+  }
+}
+
+bool SnapshotManager::write_snapshot_step(const std::vector<SnapshotItem>& items, size_t& next, size_t count) {
   auto temp = dir_ / "snapshot.tmp";
   auto final = dir_ / "snapshot.dat";
-  std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+  if (next == 0 && !pending_.is_open()) {
+    pending_start_ = std::chrono::steady_clock::now();
+    fault_injector_.maybe_delay(std::chrono::milliseconds(delay_ms_));
+    pending_.open(temp, std::ios::binary | std::ios::trunc);
+  }
   auto now_steady = std::chrono::steady_clock::now();
-  for (const auto& item : items) {
+  size_t end = std::min(items.size(), next + count);
+  for (; next < end; ++next) {
+    const auto& item = items[next];
     uint32_t key_len = static_cast<uint32_t>(item.key.size());
     uint32_t val_len = static_cast<uint32_t>(item.value.size());
     uint64_t version = item.version;
@@ -116,18 +127,62 @@ void SnapshotManager::write_snapshot(const std::vector<SnapshotItem>& items) {
         ttl_ms = -1;
       }
     }
-    out.write(reinterpret_cast<const char*>(&key_len), sizeof(key_len));
-    out.write(reinterpret_cast<const char*>(&val_len), sizeof(val_len));
-    out.write(reinterpret_cast<const char*>(&version), sizeof(version));
-    out.write(reinterpret_cast<const char*>(&ttl_ms), sizeof(ttl_ms));
-    out.write(item.key.data(), item.key.size());
-    out.write(item.value.data(), item.value.size());
+    pending_.write(reinterpret_cast<const char*>(&key_len), sizeof(key_len));
+    pending_.write(reinterpret_cast<const char*>(&val_len), sizeof(val_len));
+    pending_.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    pending_.write(reinterpret_cast<const char*>(&ttl_ms), sizeof(ttl_ms));
+    pending_.write(item.key.data(), item.key.size());
+    pending_.write(item.value.data(), item.value.size());
+  }
+  if (next < items.size()) {
+    return true;
   }
-  out.flush();
-  out.close();
+  pending_.flush();
+  pending_.close();
   std::filesystem::rename(temp, final);
-  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - pending_start_);
   metrics_.set_snapshot_duration(static_cast<uint64_t>(duration.count()));
+  return false;
+}
+
+void SnapshotManager::write_snapshot_sliced(ShardedStore& store, ThreadPool& pool) {
+  // The copy is spread over many slices; pinning its version keeps the values
+  // of keys overwritten or deleted meanwhile until it is done.
+  uint64_t version = store.begin_snapshot();
+  bool pinned = true;
+  std::vector<SnapshotItem> items;
+  SnapshotCursor cursor;
+  bool collected = false;
+  size_t written = 0;
+  bool published = false;
+  Completion<void> saved;
+  try {
+    pool.run_sliced(
+        [&]() {
+          if (!collected) {
+            collected = !store.snapshot_step(version, cursor, items);
+            if (collected) {
+              store.end_snapshot(version);
+              pinned = false;
+            }
+            return true;
+          }
+          if (!published) {
+            published = !write_snapshot_step(items, written, kWriteBatch);
+            return true;
+          }
+          // Freeing the copies costs about as much as making them.
+          items.resize(items.size() - std::min(items.size(), kWriteBatch));
+          return !items.empty();
+        },
+        saved);
+    saved.get();
+  } catch (...) {
+    if (pinned) {
+      store.end_snapshot(version);
+    }
+    throw;
+  }
 }
 
 std::vector<SnapshotItem> SnapshotManager::load_latest() {
@@ -3,13 +3,16 @@
 #include "fault_injection.hpp"
 #include "metrics.hpp"
 #include "storage.hpp"
+#include "thread_pool.hpp"
 
 #include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <mutex>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -19,7 +22,7 @@ class WalWriter {
  public:
   WalWriter(const std::filesystem::path& path, FaultInjector& fault_injector, Metrics& metrics,
             uint32_t delay_ms, double fail_probability);
-  void append(const std::string& record);
+  void append(std::string_view record);
   void flush();
   uint64_t size_bytes() const;
 
@@ -44,13 +47,28 @@ class WalReader {
 
 class SnapshotManager {
  public:
+  // Items serialized per step of write_snapshot_sliced().
+  static constexpr size_t kWriteBatch = 256;
+
   SnapshotManager(const std::filesystem::path& dir, FaultInjector& fault_injector, Metrics& metrics,
                   uint32_t delay_ms);
   void write_snapshot(const std::vector<SnapshotItem>& items);
+  // Writes a snapshot a few items at a time, for running as a sliced job:
+  // each call writes items [next, next + count) and advances `next`. The first
+  // call starts the file and the one that writes the last item publishes it.
+  // Returns false once the snapshot is published.
+  bool write_snapshot_step(const std::vector<SnapshotItem>& items, size_t& next, size_t count);
+  // Copies the store's entries as of one pinned version, writes them out and
+  // frees the copies as one sliced job on `pool`'s background lane, and
+  // returns once done.
+  void write_snapshot_sliced(ShardedStore& store, ThreadPool& pool);
   std::vector<SnapshotItem> load_latest();
 
  private:
   std::filesystem::path dir_;
+  // The snapshot being written by write_snapshot_step().
+  std::ofstream pending_;
+  std::chrono::steady_clock::time_point pending_start_;
   FaultInjector& fault_injector_;
   Metrics& metrics_;
   uint32_t delay_ms_;
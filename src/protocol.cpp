@@ -0,0 +1,295 @@
+#include "protocol.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <limits>
+
+namespace kvstore {
+
+IoBuffer::IoBuffer(size_t initial_capacity) : storage_(initial_capacity, '\0') {}
+
+char* IoBuffer::prepare(size_t min_bytes) {
+  if (writable() >= min_bytes) {
+    return storage_.data() + end_;
+  }
+  size_t live = end_ - begin_;
+  if (begin_ > 0 && begin_ >= live) {
+    // Cheap compaction: the bytes to move are fewer than those already consumed.
+    std::memmove(storage_.data(), storage_.data() + begin_, live);
+    begin_ = 0;
+    end_ = live;
+  }
+  if (writable() < min_bytes) {
+    storage_.resize(std::max(storage_.size() * 2, end_ + min_bytes));
+  }
+  return storage_.data() + end_;
+}
+
+void IoBuffer::append(const char* data, size_t size) {
+  std::memcpy(prepare(size), data, size);
+  commit(size);
+}
+
+void IoBuffer::consume(size_t bytes) {
+  begin_ += bytes;
+  if (begin_ == end_) {
+    begin_ = 0;
+    end_ = 0;
+  }
+}
+
+void OutputBuffer::append_value(ValueRef value) {
+  if (!value.shared()) {
+    bytes_ += value.view();
+    return;
+  }
+  attached_bytes_ += value.size();
+  attachments_.push_back({bytes_.size(), std::move(value)});
+}
+
+void OutputBuffer::rollback(const Mark& mark) {
+  bytes_.resize(mark.bytes);
+  while (attachments_.size() > mark.attachments) {
+    attached_bytes_ -= attachments_.back().value.size();
+    attachments_.pop_back();
+  }
+}
+
+void OutputBuffer::splice(OutputBuffer& other) {
+  size_t base = bytes_.size();
+  bytes_ += other.bytes_;
+  for (auto& attachment : other.attachments_) {
+    attachments_.push_back({base + attachment.offset, std::move(attachment.value)});
+  }
+  attached_bytes_ += other.attached_bytes_;
+  other.clear();
+}
+
+size_t OutputBuffer::gather(std::string_view* segments, size_t max) const {
+  size_t count = 0;
+  size_t offset = byte_offset_;
+  size_t next = next_attachment_;
+  size_t skip = attachment_offset_;
+  while (count < max) {
+    size_t stop = next < attachments_.size() ? attachments_[next].offset : bytes_.size();
+    if (offset < stop) {
+      segments[count++] = std::string_view(bytes_).substr(offset, stop - offset);
+      offset = stop;
+      continue;
+    }
+    if (next == attachments_.size()) {
+      break;
+    }
+    std::string_view value = attachments_[next].value.view().substr(skip);
+    if (!value.empty()) {
+      segments[count++] = value;
+    }
+    skip = 0;
+    ++next;
+  }
+  return count;
+}
+
+void OutputBuffer::consume(size_t count) {
+  consumed_ += count;
+  while (count > 0) {
+    size_t stop = next_attachment_ < attachments_.size() ? attachments_[next_attachment_].offset : bytes_.size();
+    if (byte_offset_ < stop) {
+      size_t step = std::min(count, stop - byte_offset_);
+      byte_offset_ += step;
+      count -= step;
+      continue;
+    }
+    Attachment& attachment = attachments_[next_attachment_];
+    size_t step = std::min(count, attachment.value.size() - attachment_offset_);
+    attachment_offset_ += step;
+    count -= step;
+    if (attachment_offset_ == attachment.value.size()) {
+      attachment.value.reset();
+      attachment_offset_ = 0;
+      ++next_attachment_;
+    }
+  }
+  if (empty()) {
+    clear();
+  }
+}
+
+void OutputBuffer::clear() {
+  bytes_.clear();
+  attachments_.clear();
+  attached_bytes_ = 0;
+  consumed_ = 0;
+  byte_offset_ = 0;
+  next_attachment_ = 0;
+  attachment_offset_ = 0;
+}
+
+namespace {
+
+// Calls `on_token` with each whitespace-separated token of `line` until it
+// returns false.
+template <typename OnToken>
+void for_each_token(std::string_view line, OnToken&& on_token) {
+  size_t pos = 0;
+  auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f'; };
+  while (pos < line.size()) {
+    while (pos < line.size() && is_space(line[pos])) {
+      ++pos;
+    }
+    if (pos == line.size()) {
+      break;
+    }
+    size_t start = pos;
+    while (pos < line.size() && !is_space(line[pos])) {
+      ++pos;
+    }
+    if (!on_token(line.substr(start, pos - start))) {
+      break;
+    }
+  }
+}
+
+} // namespace
+
+Tokens tokenize(std::string_view line) {
+  Tokens tokens;
+  for_each_token(line, [&tokens](std::string_view token) {
+    if (tokens.count == Tokens::kMaxTokens) {
+      tokens.truncated = true;
+      return false;
+    }
+    tokens.parts[tokens.count++] = token;
+    return true;
+  });
+  return tokens;
+}
+
+void tokenize_all(std::string_view line, std::vector<std::string_view>& tokens) {
+  tokens.clear();
+  for_each_token(line, [&tokens](std::string_view token) {
+    tokens.push_back(token);
+    return true;
+  });
+}
+
+bool parse_u64(std::string_view text, uint64_t& value) {
+  auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+  return ec == std::errc() && ptr == text.data() + text.size();
+}
+
+bool parse_u32(std::string_view text, uint32_t& value) {
+  uint64_t wide = 0;
+  if (!parse_u64(text, wide) || wide > std::numeric_limits<uint32_t>::max()) {
+    return false;
+  }
+  value = static_cast<uint32_t>(wide);
+  return true;
+}
+
+namespace {
+
+void put_le(std::string& out, uint64_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; ++i) {
+    out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+
+uint64_t get_le(const char* data, size_t bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < bytes; ++i) {
+    value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+  }
+  return value;
+}
+
+} // namespace
+
+BinaryHeader decode_binary_header(const char* data) {
+  BinaryHeader header;
+  header.magic = static_cast<uint8_t>(data[0]);
+  header.opcode = static_cast<uint8_t>(data[1]);
+  header.flags = static_cast<uint16_t>(get_le(data + 2, 2));
+  header.key_len = static_cast<uint32_t>(get_le(data + 4, 4));
+  header.value_len = static_cast<uint32_t>(get_le(data + 8, 4));
+  header.opaque = static_cast<uint32_t>(get_le(data + 12, 4));
+  header.arg = get_le(data + 16, 8);
+  return header;
+}
+
+void encode_binary_header(const BinaryHeader& header, std::string& out) {
+  out.push_back(static_cast<char>(header.magic));
+  out.push_back(static_cast<char>(header.opcode));
+  put_le(out, header.flags, 2);
+  put_le(out, header.key_len, 4);
+  put_le(out, header.value_len, 4);
+  put_le(out, header.opaque, 4);
+  put_le(out, header.arg, 8);
+}
+
+void encode_binary_request(std::string& out, BinaryOpcode opcode, std::string_view key, std::string_view value,
+                           uint16_t flags, uint64_t arg) {
+  BinaryHeader header;
+  header.opcode = static_cast<uint8_t>(opcode);
+  header.flags = flags;
+  header.key_len = static_cast<uint32_t>(key.size());
+  header.value_len = static_cast<uint32_t>(value.size());
+  header.arg = arg;
+  out.reserve(out.size() + header.frame_size());
+  encode_binary_header(header, out);
+  out.append(key);
+  out.append(value);
+}
+
+void encode_binary_length(std::string& out, uint32_t length) {
+  put_le(out, length, 4);
+}
+
+uint32_t decode_binary_length(const char* data) {
+  return static_cast<uint32_t>(get_le(data, 4));
+}
+
+bool decode_binary_keys(std::string_view payload, uint64_t count, std::vector<std::string_view>& keys) {
+  keys.clear();
+  size_t pos = 0;
+  for (uint64_t i = 0; i < count; ++i) {
+    if (payload.size() - pos < 4) {
+      return false;
+    }
+    size_t key_len = static_cast<size_t>(get_le(payload.data() + pos, 4));
+    pos += 4;
+    if (key_len > kMaxBinaryKeyBytes || payload.size() - pos < key_len) {
+      return false;
+    }
+    keys.push_back(payload.substr(pos, key_len));
+    pos += key_len;
+  }
+  return pos == payload.size();
+}
+
+bool decode_binary_pairs(std::string_view payload, uint64_t count,
+                         std::vector<std::pair<std::string_view, std::string_view>>& pairs) {
+  pairs.clear();
+  size_t pos = 0;
+  for (uint64_t i = 0; i < count; ++i) {
+    if (payload.size() - pos < 8) {
+      return false;
+    }
+    size_t key_len = static_cast<size_t>(get_le(payload.data() + pos, 4));
+    size_t value_len = static_cast<size_t>(get_le(payload.data() + pos + 4, 4));
+    pos += 8;
+    if (key_len > kMaxBinaryKeyBytes || payload.size() - pos < key_len + value_len) {
+      return false;
+    }
+    pairs.emplace_back(payload.substr(pos, key_len), payload.substr(pos + key_len, value_len));
+    pos += key_len + value_len;
+  }
+  return pos == payload.size();
+}
+
+bool is_binary_frame(std::string_view data) {
+  return !data.empty() && static_cast<uint8_t>(data[0]) == kBinaryRequestMagic;
+}
+
+} // namespace kvstore
@@ -0,0 +1,289 @@
+#pragma once
+
+#include "value_ref.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace kvstore {
+
+// Linear receive buffer. Bytes are read straight into the free tail and
+// consumed from the front; the live region is only moved back to offset 0 once
+// the consumed prefix dominates, so framing a request never shifts the whole
+// buffer.
+class IoBuffer {
+ public:
+  explicit IoBuffer(size_t initial_capacity = 16 * 1024);
+
+  // Returns at least `min_bytes` of writable space at the tail.
+  char* prepare(size_t min_bytes);
+  size_t writable() const { return storage_.size() - end_; }
+  void commit(size_t bytes) { end_ += bytes; }
+  void append(const char* data, size_t size);
+
+  std::string_view readable() const { return std::string_view(storage_.data() + begin_, end_ - begin_); }
+  void consume(size_t bytes);
+  bool empty() const { return begin_ == end_; }
+  size_t size() const { return end_ - begin_; }
+
+ private:
+  std::string storage_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+};
+
+// Responses waiting to be sent. Bytes are appended to one string, while values
+// shared with the store are attached by reference at their place in the
+// stream, so a large GET result goes to the socket straight from its slab
+// chunk through a scatter-gather send instead of being copied in.
+class OutputBuffer {
+ public:
+  // Position to roll back to when a command fails halfway through its
+  // response. Only valid until the next send.
+  struct Mark {
+    size_t bytes;
+    size_t attachments;
+  };
+
+  OutputBuffer& operator+=(std::string_view bytes) {
+    bytes_ += bytes;
+    return *this;
+  }
+  void push_back(char c) { bytes_.push_back(c); }
+  // Appends the value, copying it only when it is not shared with the store.
+  void append_value(ValueRef value);
+  // The byte tail, for encoders that append to a std::string.
+  std::string& bytes() { return bytes_; }
+
+  Mark mark() const { return {bytes_.size(), attachments_.size()}; }
+  void rollback(const Mark& mark);
+  // Moves everything `other` holds to the end of this buffer and clears it.
+  // Nothing of `other` may have been sent yet.
+  void splice(OutputBuffer& other);
+
+  bool empty() const { return pending() == 0; }
+  // Bytes appended or attached but not yet consumed.
+  size_t pending() const { return bytes_.size() + attached_bytes_ - consumed_; }
+  // Fills `segments` with up to `max` views of the unsent data, in order, and
+  // returns how many were filled.
+  size_t gather(std::string_view* segments, size_t max) const;
+  // Marks `count` bytes as sent; fully sent values are released right away.
+  void consume(size_t count);
+  void clear();
+
+ private:
+  struct Attachment {
+    // Offset in bytes_ the value is sent at.
+    size_t offset;
+    ValueRef value;
+  };
+
+  std::string bytes_;
+  std::vector<Attachment> attachments_;
+  size_t attached_bytes_ = 0;
+  size_t consumed_ = 0;
+  // Send position: an offset into bytes_, the next attachment to send and how
+  // much of it has gone out.
+  size_t byte_offset_ = 0;
+  size_t next_attachment_ = 0;
+  size_t attachment_offset_ = 0;
+};
+
+enum class CommandId : uint8_t {
+  kUnknown,
+  kGet,
+  kPut,
+  kDel,
+  kBatch,
+  kRebalance,
+  kPing,
+  kSnapshot,
+  kMget,
+  kMset,
+  kScan,
+  kRange,
+  kPrefix,
+  kDeadline,
+};
+
+inline constexpr std::array<std::pair<std::string_view, CommandId>, 13> kCommandTable{{
+    {"GET", CommandId::kGet},
+    {"PUT", CommandId::kPut},
+    {"DEL", CommandId::kDel},
+    {"BATCH", CommandId::kBatch},
+    {"REBALANCE", CommandId::kRebalance},
+    {"PING", CommandId::kPing},
+    {"SNAPSHOT", CommandId::kSnapshot},
+    {"MGET", CommandId::kMget},
+    {"MSET", CommandId::kMset},
+    {"SCAN", CommandId::kScan},
+    {"RANGE", CommandId::kRange},
+    {"PREFIX", CommandId::kPrefix},
+    {"DEADLINE", CommandId::kDeadline},
+}};
+
+constexpr CommandId lookup_command(std::string_view name) {
+  for (const auto& [command, id] : kCommandTable) {
+    if (command.size() == name.size() && command == name) {
+      return id;
+    }
+  }
+  return CommandId::kUnknown;
+}
+
+static_assert(lookup_command("GET") == CommandId::kGet);
+static_assert(lookup_command("PING") == CommandId::kPing);
+static_assert(lookup_command("get") == CommandId::kUnknown);
+
+// Whitespace-separated tokens of one request line. The views point into the
+// caller's buffer and are only valid while that buffer is unchanged.
+struct Tokens {
+  static constexpr size_t kMaxTokens = 8;
+
+  std::array<std::string_view, kMaxTokens> parts;
+  size_t count = 0;
+  // Set when the line held more tokens than fit; the surplus is dropped.
+  bool truncated = false;
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  std::string_view operator[](size_t i) const { return parts[i]; }
+};
+
+Tokens tokenize(std::string_view line);
+// Every token of the line, for commands such as MGET whose arguments do not
+// fit in Tokens.
+void tokenize_all(std::string_view line, std::vector<std::string_view>& tokens);
+
+bool parse_u64(std::string_view text, uint64_t& value);
+bool parse_u32(std::string_view text, uint32_t& value);
+
+// Keys per SCAN step when the request gives no COUNT.
+inline constexpr uint32_t kDefaultScanCount = 10;
+// Entries a RANGE or PREFIX returns when the request gives no LIMIT.
+inline constexpr uint32_t kDefaultRangeLimit = 1000;
+
+// Binary framing. A connection whose first byte is kBinaryRequestMagic speaks
+// the binary protocol for its whole lifetime; anything else is parsed as text
+// lines. Every frame is a fixed little-endian header followed by the raw key
+// and value bytes:
+//
+//   offset 0  u8   magic
+//          1  u8   opcode
+//          2  u16  flags (request) / status (response)
+//          4  u32  key length
+//          8  u32  value length
+//         12  u32  opaque, echoed back in the response
+//         16  u64  argument: TTL seconds, snapshot version, batch or key count,
+//                  or scan cursor
+//
+// A BATCH frame carries `argument` complete request frames as its value.
+inline constexpr uint8_t kBinaryRequestMagic = 0xB0;
+inline constexpr uint8_t kBinaryResponseMagic = 0xB1;
+inline constexpr size_t kBinaryHeaderSize = 24;
+inline constexpr uint32_t kMaxBinaryKeyBytes = 64 * 1024;
+inline constexpr uint32_t kMaxBinaryValueBytes = 64 * 1024 * 1024;
+
+enum class BinaryOpcode : uint8_t {
+  kGet = 1,
+  kPut = 2,
+  kDel = 3,
+  kBatch = 4,
+  kPing = 5,
+  // Pins a snapshot and returns its version in the response argument.
+  kSnapshotBegin = 6,
+  // Releases the snapshot whose version is the request argument.
+  kSnapshotEnd = 7,
+  // Multi-key GET and PUT; see decode_binary_keys() for the frame layout.
+  kMget = 8,
+  kMset = 9,
+  // One step of a cursor scan: the key is the prefix to match, the argument
+  // the cursor, and the value an optional u32 count. The response carries the
+  // next cursor in its argument and the keys packed like MGET values.
+  kScan = 10,
+  // Ordered queries: the key is the start (or prefix), a RANGE value the end,
+  // and a nonzero argument the limit. The response packs a length-prefixed
+  // key and value per entry, in key order.
+  kRange = 11,
+  kPrefix = 12,
+  // Sets the connection's request deadline to `argument` milliseconds; 0
+  // turns it off.
+  kDeadline = 13,
+};
+
+enum class BinaryStatus : uint16_t {
+  kOk = 0,
+  kNotFound = 1,
+  kError = 2,
+  kReadOnly = 3,
+  // Refused by admission control without being executed; safe to retry.
+  kBusy = 4,
+};
+
+// Request flags saying which meaning `argument` carries.
+inline constexpr uint16_t kBinaryFlagTtl = 1u << 0;
+inline constexpr uint16_t kBinaryFlagVersion = 1u << 1;
+
+struct BinaryHeader {
+  uint8_t magic = kBinaryRequestMagic;
+  uint8_t opcode = 0;
+  uint16_t flags = 0;
+  uint32_t key_len = 0;
+  uint32_t value_len = 0;
+  uint32_t opaque = 0;
+  uint64_t arg = 0;
+
+  size_t frame_size() const { return kBinaryHeaderSize + key_len + value_len; }
+};
+
+// `data` must hold at least kBinaryHeaderSize bytes.
+BinaryHeader decode_binary_header(const char* data);
+void encode_binary_header(const BinaryHeader& header, std::string& out);
+// Appends a complete request frame; used for binary WAL and replication records.
+void encode_binary_request(std::string& out, BinaryOpcode opcode, std::string_view key, std::string_view value,
+                           uint16_t flags = 0, uint64_t arg = 0);
+bool is_binary_frame(std::string_view data);
+
+// MGET and MSET frames pack their keys and values into the frame value as
+// length-prefixed fields, `argument` of them in all:
+//
+//   MGET request   per key: u32 key length, key
+//   MSET request   per pair: u32 key length, u32 value length, key, value
+//   MGET response  per key, in request order: u32 value length, value; or
+//                  just kBinaryMissing when the key was not found
+//
+// The decoders fail unless the payload holds exactly `count` fields.
+inline constexpr uint32_t kBinaryMissing = 0xFFFFFFFF;
+void encode_binary_length(std::string& out, uint32_t length);
+// `data` must hold at least 4 bytes.
+uint32_t decode_binary_length(const char* data);
+bool decode_binary_keys(std::string_view payload, uint64_t count, std::vector<std::string_view>& keys);
+bool decode_binary_pairs(std::string_view payload, uint64_t count,
+                         std::vector<std::pair<std::string_view, std::string_view>>& pairs);
+
+enum class WireProtocol : uint8_t {
+  kUndetermined,
+  kText,
+  kBinary,
+};
+
+// Per-connection protocol state, chosen from the first byte the client sends.
+struct Session {
+  WireProtocol protocol = WireProtocol::kUndetermined;
+  // Set when the stream can no longer be framed; the connection is closed once
+  // pending output is flushed.
+  bool close = false;
+  // Milliseconds a request may wait for a worker before it is answered BUSY;
+  // 0 means no deadline.
+  uint32_t deadline_ms = 0;
+  // Versions pinned with SNAPSHOT BEGIN and not yet ended; the server releases
+  // them when the connection closes.
+  std::vector<uint64_t> snapshots;
+};
+
+} // namespace kvstore
@@ -1,6 +1,7 @@
 #include "replication.hpp"
 
 #include "net.hpp"
+#include "protocol.hpp"
 
 #include <chrono>
 #include <cstring>
@@ -54,12 +55,19 @@ void ReplicationBroadcaster::stop() {
   clients_.clear();
 }
 
-void ReplicationBroadcaster::publish(const std::string& record) {
+void ReplicationBroadcaster::publish(std::string_view record) {
   if (!running_) {
     return;
   }
   uint64_t seq = ++sequence_;
-  std::string payload = record + "\n";
+  // Records are length-prefixed so binary values may contain newlines.
+  uint32_t len = static_cast<uint32_t>(record.size());
+  std::string payload;
+  payload.reserve(sizeof(len) + record.size());
+  for (size_t i = 0; i < sizeof(len); ++i) {
+    payload.push_back(static_cast<char>((len >> (8 * i)) & 0xFF));
+  }
+  payload.append(record);
   {
     std::lock_guard<std::mutex> lock(clients_mutex_);
     for (auto it = clients_.begin(); it != clients_.end();) {
@@ -133,21 +141,28 @@ void ReplicationClient::run() {
       std::this_thread::sleep_for(std::chrono::seconds(1));
       continue;
     }
-    std::string buffer;
-    buffer.reserve(1024);
-    char temp[512];
+    IoBuffer buffer;
+    std::string record;
     while (running_) {
-      int n = net::recv_data(fd, temp, sizeof(temp));
+      char* tail = buffer.prepare(16 * 1024);
+      int n = net::recv_data(fd, tail, buffer.writable());
       if (n <= 0) {
         break;
       }
-      buffer.append(temp, temp + n);
-      size_t pos = 0;
-      while ((pos = buffer.find('\n')) != std::string::npos) {
-        std::string line = buffer.substr(0, pos);
-        buffer.erase(0, pos + 1);
-        if (!line.empty()) {
-          apply_fn_(line);
+      buffer.commit(static_cast<size_t>(n));
+      while (buffer.size() >= sizeof(uint32_t)) {
+        std::string_view pending = buffer.readable();
+        uint32_t len = 0;
+        for (size_t i = 0; i < sizeof(len); ++i) {
+          len |= static_cast<uint32_t>(static_cast<unsigned char>(pending[i])) << (8 * i);
+        }
+        if (pending.size() < sizeof(len) + len) {
+          break;
+        }
+        record.assign(pending.substr(sizeof(len), len));
+        buffer.consume(sizeof(len) + len);
+        if (!record.empty()) {
+          apply_fn_(record);
         }
       }
     }
@@ -8,6 +8,7 @@
 #include <mutex>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -20,7 +21,7 @@ class ReplicationBroadcaster {
 
   void start();
   void stop();
-  void publish(const std::string& record);
+  void publish(std::string_view record);
 
  private:
   void accept_loop();
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <shared_mutex>
+
+namespace kvstore {
+
+// A reader-writer mutex with a sequence lock on the side. Writers take it
+// exclusively as usual, and the sequence number is odd for as long as they hold
+// it, so a reader can also skip the lock entirely: it samples the sequence
+// number with read_begin(), copies what it needs, and keeps the copy only if
+// read_validate() finds the number even and unchanged. Such a reader never
+// writes to the lock's cache line, but it may observe a half-written state and
+// must copy through memory that stays valid (and check pointers it follows)
+// before validating.
+//
+// Meets the SharedMutex requirements, so std::unique_lock and std::shared_lock
+// work with it unchanged.
+class SeqMutex {
+ public:
+  void lock() {
+    mutex_.lock();
+    seq_.store(seq_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    // Keeps the writer's data stores from becoming visible before the odd
+    // sequence number.
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  bool try_lock() {
+    if (!mutex_.try_lock()) {
+      return false;
+    }
+    seq_.store(seq_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+  }
+
+  void unlock() {
+    seq_.store(seq_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    mutex_.unlock();
+  }
+
+  void lock_shared() { mutex_.lock_shared(); }
+  bool try_lock_shared() { return mutex_.try_lock_shared(); }
+  void unlock_shared() { mutex_.unlock_shared(); }
+
+  // An odd result means a writer holds the lock and the read should not start.
+  uint64_t read_begin() const { return seq_.load(std::memory_order_acquire); }
+
+  // True when no writer has held the lock since read_begin() returned `seq`,
+  // so everything read in between is consistent.
+  bool read_validate(uint64_t seq) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (seq & 1) == 0 && seq_.load(std::memory_order_relaxed) == seq;
+  }
+
+ private:
+  std::shared_mutex mutex_;
+  std::atomic<uint64_t> seq_{0};
+};
+
+} // namespace kvstore
@@ -1,26 +1,101 @@
 #include "server.hpp"
 
+#include "affinity.hpp"
 #include "net.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <deque>
 #include <iostream>
+#include <limits>
+#include <optional>
 #include <sstream>
-#include <vector>
 
 namespace kvstore {
 
 namespace {
 
-std::vector<std::string> split(const std::string& line) {
-  std::istringstream stream(line);
-  std::vector<std::string> parts;
-  std::string part;
-  while (stream >> part) {
-    parts.push_back(part);
+// Blocks until all of `output` is sent.
+bool send_output(net::Socket fd, OutputBuffer& output) {
+  std::string_view segments[net::kMaxSendSegments];
+  while (!output.empty()) {
+    size_t count = output.gather(segments, net::kMaxSendSegments);
+    int n = net::send_segments(fd, segments, count);
+    if (n <= 0) {
+      return false;
+    }
+    output.consume(static_cast<size_t>(n));
   }
-  return parts;
+  return true;
+}
+
+// Requests that touch only the key they name.
+bool single_key(CommandId id) {
+  return id == CommandId::kGet || id == CommandId::kPut || id == CommandId::kDel;
+}
+
+bool single_key(BinaryOpcode opcode) {
+  return opcode == BinaryOpcode::kGet || opcode == BinaryOpcode::kPut || opcode == BinaryOpcode::kDel;
 }
 
+// Responses to the requests of one input buffer in percore mode. A request is
+// run by the core owning its key, which writes the response into a slot of
+// its own; slots join the output in request order when the window is flushed,
+// which happens when it fills up, before a request that has to run on the
+// calling core, and when the window goes away.
+class ResponseWindow {
+ public:
+  // Requests in flight before the window waits for them.
+  static constexpr size_t kMaxInFlight = 64;
+
+  ResponseWindow(CoreGroup& group, OutputBuffer& output)
+      : gather_(group), self_(static_cast<size_t>(group.self())), output_(output) {}
+  ~ResponseWindow() { flush(); }
+
+  ResponseWindow(const ResponseWindow&) = delete;
+  ResponseWindow& operator=(const ResponseWindow&) = delete;
+
+  // Buffer for the response of the next request, which core `owner` runs.
+  OutputBuffer& slot(size_t owner) {
+    if (used_ == 0 && owner == self_) {
+      return output_;
+    }
+    if (used_ == kMaxInFlight) {
+      flush();
+    }
+    if (used_ == slots_.size()) {
+      slots_.emplace_back();
+    }
+    return slots_[used_++];
+  }
+
+  template <typename Fn>
+  void run(size_t owner, Fn&& fn) {
+    gather_.run(owner, std::forward<Fn>(fn));
+  }
+
+  void flush() {
+    gather_.wait();
+    for (size_t i = 0; i < used_; ++i) {
+      output_.splice(slots_[i]);
+    }
+    used_ = 0;
+  }
+
+ private:
+  // Kept per core so the slots' storage is reused from buffer to buffer.
+  static std::deque<OutputBuffer>& core_slots() {
+    thread_local std::deque<OutputBuffer> slots;
+    return slots;
+  }
+
+  CoreGroup::Gather gather_;
+  size_t self_;
+  OutputBuffer& output_;
+  std::deque<OutputBuffer>& slots_ = core_slots();
+  size_t used_ = 0;
+};
+
 } // namespace
 
 MetricsServer::MetricsServer(uint16_t port, Metrics& metrics) : port_(port), metrics_(metrics) {}
@@ -73,14 +148,61 @@ void MetricsServer::run() {
     body << "  \"put_count\": " << snap.put_count << ",\n";
     body << "  \"del_count\": " << snap.del_count << ",\n";
     body << "  \"batch_count\": " << snap.batch_count << ",\n";
+    body << "  \"admitted_requests\": " << snap.admitted_requests << ",\n";
+    body << "  \"shed_requests\": " << snap.shed_requests << ",\n";
+    body << "  \"expired_requests\": " << snap.expired_requests << ",\n";
     body << "  \"eviction_count\": " << snap.eviction_count << ",\n";
+    body << "  \"inline_eviction_count\": " << snap.inline_eviction_count << ",\n";
+    body << "  \"cache_hits\": " << snap.cache_hits << ",\n";
+    body << "  \"cache_misses\": " << snap.cache_misses << ",\n";
+    body << "  \"hit_ratio\": " << snap.hit_ratio << ",\n";
+    body << "  \"optimistic_read_retries\": " << snap.optimistic_read_retries << ",\n";
+    body << "  \"optimistic_read_fallbacks\": " << snap.optimistic_read_fallbacks << ",\n";
     body << "  \"memory_bytes\": " << snap.memory_bytes << ",\n";
     body << "  \"wal_bytes\": " << snap.wal_bytes << ",\n";
     body << "  \"snapshot_duration_ms\": " << snap.snapshot_duration_ms << ",\n";
     body << "  \"replication_lag\": " << snap.replication_lag << ",\n";
+    body << "  \"rebalance_active\": " << (snap.rebalance_active ? "true" : "false") << ",\n";
+    body << "  \"rebalance_progress\": " << snap.rebalance_progress << ",\n";
+    body << "  \"rebalance_keys_moved\": " << snap.rebalance_keys_moved << ",\n";
+    body << "  \"snapshots_active\": " << snap.snapshots_active << ",\n";
+    body << "  \"mvcc_versions\": " << snap.mvcc_versions << ",\n";
+    body << "  \"mvcc_retained_bytes\": " << snap.mvcc_retained_bytes << ",\n";
+    body << "  \"mvcc_versions_dropped\": " << snap.mvcc_versions_dropped << ",\n";
+    body << "  \"rebalance_switch_last_us\": " << snap.rebalance_switch_last_us << ",\n";
+    body << "  \"rebalance_switch_max_us\": " << snap.rebalance_switch_max_us << ",\n";
     body << "  \"p50_us\": " << snap.p50_us << ",\n";
     body << "  \"p95_us\": " << snap.p95_us << ",\n";
-    body << "  \"p99_us\": " << snap.p99_us << "\n";
+    body << "  \"p99_us\": " << snap.p99_us << ",\n";
+    body << "  \"numa_nodes\": [";
+    for (size_t node = 0; node < snap.numa_nodes.size(); ++node) {
+      const auto& numa = snap.numa_nodes[node];
+      body << (node == 0 ? "\n" : ",\n");
+      body << "    {\"node\": " << node << ", \"shards\": " << numa.shards
+           << ", \"local_accesses\": " << numa.local_accesses << ", \"remote_accesses\": " << numa.remote_accesses
+           << "}";
+    }
+    body << (snap.numa_nodes.empty() ? "],\n" : "\n  ],\n");
+    uint64_t slab_reserved = 0;
+    uint64_t slab_requested = 0;
+    body << "  \"slab_classes\": [";
+    for (size_t i = 0; i < snap.slab_classes.size(); ++i) {
+      const auto& cls = snap.slab_classes[i];
+      slab_reserved += cls.reserved_bytes;
+      slab_requested += cls.requested_bytes;
+      uint64_t handed_out = cls.chunk_size == 0 ? cls.requested_bytes : cls.chunk_size * cls.chunks_used;
+      double utilization = handed_out == 0 ? 0.0 : static_cast<double>(cls.requested_bytes) / handed_out;
+      double fragmentation =
+          cls.reserved_bytes == 0 ? 0.0 : 1.0 - static_cast<double>(cls.requested_bytes) / cls.reserved_bytes;
+      body << (i == 0 ? "\n" : ",\n");
+      body << "    {\"chunk_size\": " << cls.chunk_size << ", \"pages\": " << cls.pages
+           << ", \"chunks_used\": " << cls.chunks_used << ", \"chunks_free\": " << cls.chunks_free
+           << ", \"requested_bytes\": " << cls.requested_bytes << ", \"utilization\": " << utilization
+           << ", \"fragmentation\": " << fragmentation << "}";
+    }
+    body << "\n  ],\n";
+    body << "  \"slab_reserved_bytes\": " << slab_reserved << ",\n";
+    body << "  \"slab_requested_bytes\": " << slab_requested << "\n";
     body << "}\n";
     std::string body_str = body.str();
     std::ostringstream response;
@@ -97,7 +219,13 @@ void MetricsServer::run() {
 
 KvServer::KvServer(const Config& config, ShardedStore& store, ThreadPool& pool, Metrics& metrics,
                    WalWriter* wal, ReplicationBroadcaster* replication)
-    : config_(config), store_(store), pool_(pool), metrics_(metrics), wal_(wal), replication_(replication) {}
+    : config_(config),
+      store_(store),
+      pool_(pool),
+      metrics_(metrics),
+      wal_(wal),
+      replication_(replication),
+      io_cpus_(plan_cpu_sets(CpuTopology::system(), config.io_cpus, false)) {}
 
 KvServer::~KvServer() {
   stop();
@@ -117,9 +245,34 @@ void KvServer::start() {
   if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
     throw std::runtime_error("failed to bind socket");
   }
-  if (listen(listen_fd_, 128) < 0) {
+  if (listen(listen_fd_, SOMAXCONN) < 0) {
     throw std::runtime_error("failed to listen on socket");
   }
+  if (config_.network_mode == "epoll" || config_.network_mode == "percore") {
+    if (EventLoop::supported()) {
+      size_t count = config_.io_threads == 0 ? 1 : config_.io_threads;
+      if (config_.network_mode == "percore") {
+        cores_ = std::make_unique<CoreGroup>(count);
+      }
+      for (size_t i = 0; i < count; ++i) {
+        auto loop = std::make_unique<EventLoop>(
+            [this](Session& session, std::string_view input, OutputBuffer& output) {
+              return process_buffer(session, input, output);
+            },
+            [this](Session& session) { release_session(session); });
+        if (cores_) {
+          loop->set_core(cores_.get(), i);
+          cores_->set_waker(i, [loop = loop.get()]() { loop->wake(); });
+        }
+        loops_.push_back(std::move(loop));
+      }
+      for (size_t i = 0; i < count; ++i) {
+        loops_[i]->start(io_cpus_.empty() ? std::vector<int>{} : io_cpus_[i % io_cpus_.size()]);
+      }
+    } else {
+      std::cerr << config_.network_mode << " network mode is not supported on this platform, using threads\n";
+    }
+  }
   accept_thread_ = std::thread([this]() { accept_loop(); });
 }
 
@@ -135,6 +288,16 @@ void KvServer::stop() {
   if (accept_thread_.joinable()) {
     accept_thread_.join();
   }
+  // Cores wait for each other to leave, so all of them are told to stop
+  // before any is joined.
+  for (auto& loop : loops_) {
+    loop->interrupt();
+  }
+  for (auto& loop : loops_) {
+    loop->stop();
+  }
+  loops_.clear();
+  cores_.reset();
 }
 
 void KvServer::accept_loop() {
@@ -145,150 +308,776 @@ void KvServer::accept_loop() {
     if (client_fd == net::kInvalidSocket) {
       continue;
     }
+    if (!loops_.empty()) {
+      loops_[next_loop_++ % loops_.size()]->add_connection(client_fd);
+      continue;
+    }
     std::thread(&KvServer::handle_connection, this, client_fd).detach();
   }
 }
 
 void KvServer::handle_connection(int client_fd) {
-  std::string buffer;
-  buffer.reserve(2048);
-  char temp[1024];
+  if (!io_cpus_.empty()) {
+    pin_current_thread(io_cpus_[next_io_cpus_++ % io_cpus_.size()]);
+  }
+  IoBuffer buffer;
+  Session session;
+  session.deadline_ms = config_.request_deadline_ms;
+  OutputBuffer output;
+  size_t scanned = 0;
   while (true) {
-    int n = net::recv_data(client_fd, temp, sizeof(temp));
+    char* tail = buffer.prepare(16 * 1024);
+    int n = net::recv_data(client_fd, tail, buffer.writable());
     if (n <= 0) {
       break;
     }
-    buffer.append(temp, temp + n);
-    size_t pos = 0;
-    while ((pos = buffer.find('\n')) != std::string::npos) {
-      std::string line = buffer.substr(0, pos);
-      buffer.erase(0, pos + 1);
-      if (line.empty()) {
-        continue;
-      }
-      auto start = std::chrono::steady_clock::now();
-      std::vector<std::string> batch_lines;
-      std::string response;
-      bool precomputed = false;
-      if (line.rfind("BATCH", 0) == 0) {
-        auto parts = split(line);
-        if (parts.size() != 2) {
-          response = "ERROR invalid batch";
-          precomputed = true;
-        } else {
-          size_t count = std::stoul(parts[1]);
-          while (batch_lines.size() < count) {
-            size_t end = buffer.find('\n');
-            if (end == std::string::npos) {
-              int more = net::recv_data(client_fd, temp, sizeof(temp));
-              if (more <= 0) {
-                break;
-              }
-              buffer.append(temp, temp + more);
-              continue;
-            }
-            batch_lines.push_back(buffer.substr(0, end));
-            buffer.erase(0, end + 1);
-          }
-          response = "OK";
-          precomputed = true;
+    buffer.commit(static_cast<size_t>(n));
+    auto arrived = std::chrono::steady_clock::now();
+    std::string_view pending = buffer.readable();
+    if (session.protocol != WireProtocol::kBinary && !is_binary_frame(pending) &&
+        pending.find('\n', scanned) == std::string_view::npos) {
+      scanned = pending.size();
+      continue;
+    }
+    // Every complete request in the buffer is executed by a single pool task and
+    // the responses leave together, in request order, in one send.
+    auto task = [this, &session, pending, &output]() { return process_buffer(session, pending, output); };
+    Completion<size_t> done;
+    size_t consumed = 0;
+    int node = config_.numa_placement ? route_node(session, pending) : -1;
+    if (config_.sojourn_target_us == 0 && session.deadline_ms == 0) {
+      pool_.submit(task, done, TaskPriority::kForeground, node);
+      consumed = done.get();
+    } else {
+      // Under admission control the buffer is never left waiting for a queue
+      // slot: work the pool will not take, or takes too late, is answered BUSY
+      // from this thread without touching the store.
+      auto deadline = session.deadline_ms == 0
+                          ? std::chrono::steady_clock::time_point::max()
+                          : arrived + std::chrono::milliseconds(session.deadline_ms);
+      uint64_t refused = 0;
+      if (!pool_.try_submit(task, done, deadline, node)) {
+        consumed = process_buffer(session, pending, output, &refused);
+        metrics_.record_shed(refused);
+      } else {
+        try {
+          consumed = done.get();
+        } catch (const TaskExpired&) {
+          consumed = process_buffer(session, pending, output, &refused);
+          metrics_.record_expired(refused);
+        }
+      }
+    }
+    buffer.consume(consumed);
+    scanned = buffer.size();
+    if (!output.empty()) {
+      if (!send_output(client_fd, output)) {
+        break;
+      }
+    }
+    if (session.close) {
+      break;
+    }
+  }
+  release_session(session);
+  net::close_socket(client_fd);
+}
+
+// The whole buffer runs as one task, so it follows its first request: for
+// keyed commands that is the key's shard, and a buffer from a client working
+// on one shard runs on that shard's node.
+int KvServer::route_node(const Session& session, std::string_view input) {
+  if (session.protocol == WireProtocol::kBinary || (session.protocol == WireProtocol::kUndetermined &&
+                                                     is_binary_frame(input))) {
+    if (input.size() < kBinaryHeaderSize) {
+      return -1;
+    }
+    BinaryHeader header = decode_binary_header(input.data());
+    auto opcode = static_cast<BinaryOpcode>(header.opcode);
+    if ((opcode != BinaryOpcode::kGet && opcode != BinaryOpcode::kPut && opcode != BinaryOpcode::kDel) ||
+        input.size() - kBinaryHeaderSize < header.key_len) {
+      return -1;
+    }
+    return store_.home_node(input.substr(kBinaryHeaderSize, header.key_len));
+  }
+  Tokens parts = tokenize(input.substr(0, input.find('\n')));
+  if (parts.size() < 2) {
+    return -1;
+  }
+  switch (lookup_command(parts[0])) {
+    case CommandId::kGet:
+    case CommandId::kPut:
+    case CommandId::kDel:
+    case CommandId::kMget:
+    case CommandId::kMset:
+      return store_.home_node(parts[1]);
+    default:
+      return -1;
+  }
+}
+
+void KvServer::release_session(Session& session) {
+  for (uint64_t version : session.snapshots) {
+    store_.end_snapshot(version);
+  }
+  session.snapshots.clear();
+}
+
+// Only the connection that began a snapshot may end it.
+bool KvServer::end_snapshot(Session& session, uint64_t version) {
+  auto it = std::find(session.snapshots.begin(), session.snapshots.end(), version);
+  if (it == session.snapshots.end()) {
+    return false;
+  }
+  session.snapshots.erase(it);
+  return store_.end_snapshot(version);
+}
+
+size_t KvServer::process_buffer(Session& session, std::string_view input, OutputBuffer& output,
+                                uint64_t* refused) {
+  if (session.protocol == WireProtocol::kUndetermined && !input.empty()) {
+    session.protocol = is_binary_frame(input) ? WireProtocol::kBinary : WireProtocol::kText;
+  }
+  if (session.protocol == WireProtocol::kBinary) {
+    return process_binary(session, input, output, refused);
+  }
+  return process_text(session, input, output, refused);
+}
+
+size_t KvServer::process_text(Session& session, std::string_view input, OutputBuffer& output, uint64_t* refused) {
+  size_t consumed = 0;
+  OutputBuffer discarded;
+  std::optional<ResponseWindow> window;
+  if (cores_ != nullptr && refused == nullptr && cores_->self() >= 0) {
+    window.emplace(*cores_, output);
+  }
+  while (true) {
+    size_t end = input.find('\n', consumed);
+    if (end == std::string_view::npos) {
+      break;
+    }
+    std::string_view line = input.substr(consumed, end - consumed);
+    size_t next = end + 1;
+    Tokens parts = tokenize(line);
+    if (parts.empty()) {
+      consumed = next;
+      continue;
+    }
+    CommandId id = lookup_command(parts[0]);
+    bool batch = id == CommandId::kBatch;
+    uint64_t count = 0;
+    bool framed = batch && parts.size() == 2 && parse_u64(parts[1], count);
+    size_t body = next;
+    if (framed) {
+      // Frame the whole batch before executing any of it.
+      for (uint64_t i = 0; i < count; ++i) {
+        size_t batch_end = input.find('\n', next);
+        if (batch_end == std::string_view::npos) {
+          return consumed;
         }
+        next = batch_end + 1;
       }
-      if (!precomputed) {
-        auto future = pool_.submit([this, line]() { return process_command(line); });
-        response = future.get();
-      } else if (!batch_lines.empty()) {
-        auto future = pool_.submit([this, batch_lines]() {
-          for (const auto& cmd : batch_lines) {
-            process_command(cmd);
+    }
+    if (refused != nullptr) {
+      output += "BUSY\n";
+      ++*refused;
+      consumed = next;
+      continue;
+    }
+    metrics_.record_admitted();
+    if (window && !batch && parts.size() >= 2 && single_key(id)) {
+      size_t owner = owner_core(parts[1]);
+      OutputBuffer& slot = window->slot(owner);
+      window->run(owner, [this, &session, line, &slot]() { execute_text(session, line, tokenize(line), slot); });
+      consumed = next;
+      continue;
+    }
+    // Everything else runs on this core, after the requests before it.
+    if (window) {
+      window->flush();
+    }
+    if (!batch) {
+      execute_text(session, line, parts, output);
+      consumed = next;
+      continue;
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto rollback = output.mark();
+    try {
+      if (!framed) {
+        output += "ERROR invalid batch";
+      } else {
+        if (window) {
+          execute_text_batch(session, input.substr(body, next - body));
+        } else {
+          while (body < next) {
+            size_t batch_end = input.find('\n', body);
+            std::string_view cmd = input.substr(body, batch_end - body);
+            body = batch_end + 1;
+            discarded.clear();
+            process_command(session, cmd, tokenize(cmd), discarded);
           }
+        }
+        if (count > 0) {
           metrics_.record_batch();
-          return std::string("OK");
-        });
-        response = future.get();
+        }
+        output += "OK";
       }
-      auto duration = std::chrono::steady_clock::now() - start;
-      metrics_.record_latency(std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
-      response.push_back('\n');
-      net::send_data(client_fd, response.data(), response.size());
+    } catch (const std::exception& e) {
+      output.rollback(rollback);
+      output += "ERROR ";
+      output += e.what();
     }
+    consumed = next;
+    auto duration = std::chrono::steady_clock::now() - start;
+    metrics_.record_latency(std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
+    output.push_back('\n');
   }
-  net::close_socket(client_fd);
+  return consumed;
 }
 
-std::string KvServer::process_command(const std::string& line) {
-  auto parts = split(line);
+void KvServer::execute_text(Session& session, std::string_view line, const Tokens& parts, OutputBuffer& output) {
+  auto start = std::chrono::steady_clock::now();
+  auto rollback = output.mark();
+  try {
+    process_command(session, line, parts, output);
+  } catch (const std::exception& e) {
+    output.rollback(rollback);
+    output += "ERROR ";
+    output += e.what();
+  }
+  auto duration = std::chrono::steady_clock::now() - start;
+  metrics_.record_latency(std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
+  output.push_back('\n');
+}
+
+// Members of one core run on it in batch order, and members that are not for
+// a single key run here once every member before them is done. A failing
+// member does not stop the ones after it, which may already be running on
+// other cores.
+void KvServer::execute_text_batch(Session& session, std::string_view members) {
+  struct Failure {
+    std::atomic<bool> failed{false};
+    std::string message;
+  } failure;
+  auto run = [this, &session, &failure](std::string_view cmd) {
+    thread_local OutputBuffer discarded;
+    try {
+      discarded.clear();
+      process_command(session, cmd, tokenize(cmd), discarded);
+    } catch (const std::exception& e) {
+      if (!failure.failed.exchange(true)) {
+        failure.message = e.what();
+      }
+    }
+  };
+  {
+    CoreGroup::Gather gather(*cores_);
+    while (!members.empty()) {
+      size_t end = members.find('\n');
+      std::string_view cmd = members.substr(0, end);
+      members.remove_prefix(end + 1);
+      Tokens parts = tokenize(cmd);
+      if (parts.size() >= 2 && single_key(lookup_command(parts[0]))) {
+        gather.run(owner_core(parts[1]), [&run, cmd]() { run(cmd); });
+      } else {
+        gather.wait();
+        run(cmd);
+      }
+    }
+  }
+  if (failure.failed) {
+    throw std::runtime_error(failure.message);
+  }
+}
+
+void KvServer::process_command(Session& session, std::string_view line, const Tokens& parts,
+                               OutputBuffer& response) {
   if (parts.empty()) {
-    return "ERROR empty";
+    response += "ERROR empty";
+    return;
   }
-  const std::string& cmd = parts[0];
-  if (cmd == "GET") {
-    if (parts.size() < 2) {
-      return "ERROR usage GET key [version]";
+  switch (lookup_command(parts[0])) {
+    case CommandId::kGet: {
+      if (parts.size() < 2) {
+        response += "ERROR usage GET key [version]";
+        return;
+      }
+      std::optional<uint64_t> version;
+      if (parts.size() >= 3) {
+        uint64_t value = 0;
+        if (!parse_u64(parts[2], value)) {
+          response += "ERROR invalid version";
+          return;
+        }
+        version = value;
+      }
+      auto result = store_.get(parts[1], version);
+      metrics_.record_get();
+      if (!result) {
+        response += "NOT_FOUND";
+        return;
+      }
+      response += "VALUE ";
+      response.append_value(std::move(*result));
+      return;
     }
-    std::optional<uint64_t> version;
-    if (parts.size() >= 3) {
-      version = std::stoull(parts[2]);
+    case CommandId::kPut: {
+      if (config_.role == "replica") {
+        response += "ERROR read_only";
+        return;
+      }
+      if (parts.size() < 3) {
+        response += "ERROR usage PUT key value [ttl]";
+        return;
+      }
+      std::optional<uint32_t> ttl;
+      if (parts.size() >= 4) {
+        uint32_t value = 0;
+        if (!parse_u32(parts[3], value)) {
+          response += "ERROR invalid ttl";
+          return;
+        }
+        ttl = value;
+      }
+      store_.put(parts[1], parts[2], ttl);
+      metrics_.record_put();
+      log_mutation(line);
+      response += "OK";
+      return;
     }
-    auto result = store_.get(parts[1], version);
-    metrics_.record_get();
-    if (!result) {
-      return "NOT_FOUND";
+    case CommandId::kDel: {
+      if (config_.role == "replica") {
+        response += "ERROR read_only";
+        return;
+      }
+      if (parts.size() < 2) {
+        response += "ERROR usage DEL key";
+        return;
+      }
+      bool removed = store_.del(parts[1]);
+      metrics_.record_del();
+      log_mutation(line);
+      response += removed ? "OK" : "NOT_FOUND";
+      return;
     }
-    return "VALUE " + *result;
-  }
-  if (cmd == "PUT") {
-    if (config_.role == "replica") {
-      return "ERROR read_only";
+    case CommandId::kRebalance: {
+      if (config_.role == "replica") {
+        response += "ERROR read_only";
+        return;
+      }
+      uint32_t shard_count = 0;
+      if (parts.size() != 2 || !parse_u32(parts[1], shard_count)) {
+        response += "ERROR usage REBALANCE shard_count";
+        return;
+      }
+      response += store_.rebalance(shard_count) ? "OK" : "ERROR rebalance in progress";
+      return;
+    }
+    case CommandId::kPing:
+      response += "PONG";
+      return;
+    case CommandId::kDeadline: {
+      uint32_t ms = 0;
+      if (parts.size() != 2 || !parse_u32(parts[1], ms)) {
+        response += "ERROR usage DEADLINE ms";
+        return;
+      }
+      // Only connection threads queue requests; the event loops run them
+      // inline, so there is no queueing time to bound.
+      if (config_.network_mode != "threads") {
+        response += "ERROR DEADLINE needs net-mode threads";
+        return;
+      }
+      session.deadline_ms = ms;
+      response += "OK";
+      return;
     }
-    if (parts.size() < 3) {
-      return "ERROR usage PUT key value [ttl]";
+    case CommandId::kSnapshot: {
+      if (parts.size() == 2 && parts[1] == "BEGIN") {
+        uint64_t version = store_.begin_snapshot();
+        session.snapshots.push_back(version);
+        response += "VERSION ";
+        response += std::to_string(version);
+        return;
+      }
+      uint64_t version = 0;
+      if (parts.size() == 3 && parts[1] == "END" && parse_u64(parts[2], version)) {
+        response += end_snapshot(session, version) ? "OK" : "NOT_FOUND";
+        return;
+      }
+      response += "ERROR usage SNAPSHOT BEGIN | SNAPSHOT END version";
+      return;
     }
-    std::optional<uint32_t> ttl;
-    if (parts.size() >= 4) {
-      ttl = static_cast<uint32_t>(std::stoul(parts[3]));
+    case CommandId::kMget: {
+      std::vector<std::string_view> keys;
+      tokenize_all(line, keys);
+      keys.erase(keys.begin());
+      if (keys.empty()) {
+        response += "ERROR usage MGET key [key ...]";
+        return;
+      }
+      auto results = store_.get_many(keys);
+      metrics_.record_get(keys.size());
+      // One line per key follows the count, in request order.
+      response += "VALUES ";
+      response += std::to_string(results.size());
+      for (auto& result : results) {
+        response.push_back('\n');
+        if (!result) {
+          response += "NOT_FOUND";
+          continue;
+        }
+        response += "VALUE ";
+        response.append_value(std::move(*result));
+      }
+      return;
+    }
+    case CommandId::kMset: {
+      if (config_.role == "replica") {
+        response += "ERROR read_only";
+        return;
+      }
+      std::vector<std::string_view> args;
+      tokenize_all(line, args);
+      if (args.size() < 3 || args.size() % 2 == 0) {
+        response += "ERROR usage MSET key value [key value ...]";
+        return;
+      }
+      std::vector<std::pair<std::string_view, std::string_view>> items;
+      items.reserve(args.size() / 2);
+      for (size_t i = 1; i < args.size(); i += 2) {
+        items.emplace_back(args[i], args[i + 1]);
+      }
+      store_.put_many(items);
+      metrics_.record_put(items.size());
+      // Logged as one record, so a replica applies the whole MSET at once.
+      log_mutation(line);
+      response += "OK";
+      return;
     }
-    store_.put(parts[1], parts[2], ttl);
-    metrics_.record_put();
-    if (wal_) {
-      wal_->append(line);
+    case CommandId::kScan: {
+      uint64_t cursor = 0;
+      std::string_view prefix;
+      uint32_t count = kDefaultScanCount;
+      bool valid = parts.size() >= 2 && parse_u64(parts[1], cursor);
+      for (size_t i = 2; valid && i < parts.size(); i += 2) {
+        if (i + 1 == parts.size()) {
+          valid = false;
+        } else if (parts[i] == "MATCH") {
+          prefix = parts[i + 1];
+        } else if (parts[i] != "COUNT" || !parse_u32(parts[i + 1], count) || count == 0) {
+          valid = false;
+        }
+      }
+      if (!valid || parts.truncated) {
+        response += "ERROR usage SCAN cursor [MATCH prefix] [COUNT n]";
+        return;
+      }
+      ScanPage page = store_.scan(cursor, prefix, count);
+      // One line per key follows the next cursor and the key count.
+      response += "CURSOR ";
+      response += std::to_string(page.cursor);
+      response.push_back(' ');
+      response += std::to_string(page.keys.size());
+      for (const auto& key : page.keys) {
+        response += "\nKEY ";
+        response += key;
+      }
+      return;
     }
-    if (replication_) {
-      replication_->publish(line);
+    case CommandId::kRange:
+    case CommandId::kPrefix: {
+      bool is_range = lookup_command(parts[0]) == CommandId::kRange;
+      size_t bounds = is_range ? 3 : 2;
+      uint64_t limit = kDefaultRangeLimit;
+      bool valid = parts.size() == bounds ||
+                   (parts.size() == bounds + 2 && parts[bounds] == "LIMIT" && parse_u64(parts[bounds + 1], limit));
+      if (!valid) {
+        response += is_range ? "ERROR usage RANGE start end [LIMIT n]" : "ERROR usage PREFIX prefix [LIMIT n]";
+        return;
+      }
+      auto items = is_range ? store_.range(parts[1], parts[2], limit) : store_.prefix(parts[1], limit);
+      metrics_.record_get(items.size());
+      // One line per entry follows the count, in key order.
+      response += "ENTRIES ";
+      response += std::to_string(items.size());
+      for (auto& item : items) {
+        response += "\nITEM ";
+        response += item.key;
+        response.push_back(' ');
+        response.append_value(std::move(item.value));
+      }
+      return;
     }
-    return "OK";
+    case CommandId::kBatch:
+    case CommandId::kUnknown:
+      break;
   }
-  if (cmd == "DEL") {
-    if (config_.role == "replica") {
-      return "ERROR read_only";
+  response += "ERROR unknown command";
+}
+
+size_t KvServer::process_binary(Session& session, std::string_view input, OutputBuffer& output,
+                                uint64_t* refused) {
+  size_t consumed = 0;
+  std::optional<ResponseWindow> window;
+  if (cores_ != nullptr && refused == nullptr && cores_->self() >= 0) {
+    window.emplace(*cores_, output);
+  }
+  while (input.size() - consumed >= kBinaryHeaderSize) {
+    BinaryHeader header = decode_binary_header(input.data() + consumed);
+    if (header.magic != kBinaryRequestMagic || header.key_len > kMaxBinaryKeyBytes ||
+        header.value_len > kMaxBinaryValueBytes) {
+      // The stream cannot be re-synchronised after a bad header.
+      if (window) {
+        window->flush();
+      }
+      BinaryHeader response;
+      response.magic = kBinaryResponseMagic;
+      response.opcode = header.opcode;
+      response.flags = static_cast<uint16_t>(BinaryStatus::kError);
+      response.opaque = header.opaque;
+      encode_binary_header(response, output.bytes());
+      session.close = true;
+      return input.size();
+    }
+    if (input.size() - consumed < header.frame_size()) {
+      break;
     }
-    if (parts.size() < 2) {
-      return "ERROR usage DEL key";
+    if (refused != nullptr) {
+      BinaryHeader response;
+      response.magic = kBinaryResponseMagic;
+      response.opcode = header.opcode;
+      response.flags = static_cast<uint16_t>(BinaryStatus::kBusy);
+      response.opaque = header.opaque;
+      encode_binary_header(response, output.bytes());
+      consumed += header.frame_size();
+      ++*refused;
+      continue;
     }
-    bool removed = store_.del(parts[1]);
-    metrics_.record_del();
-    if (wal_) {
-      wal_->append(line);
+    metrics_.record_admitted();
+    std::string_view frame = input.substr(consumed, header.frame_size());
+    consumed += header.frame_size();
+    if (window && single_key(static_cast<BinaryOpcode>(header.opcode))) {
+      size_t owner = owner_core(frame.substr(kBinaryHeaderSize, header.key_len));
+      OutputBuffer& slot = window->slot(owner);
+      window->run(owner, [this, &session, frame, &slot]() {
+        auto start = std::chrono::steady_clock::now();
+        execute_binary(session, decode_binary_header(frame.data()), frame, &slot);
+        auto duration = std::chrono::steady_clock::now() - start;
+        metrics_.record_latency(std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
+      });
+      continue;
     }
-    if (replication_) {
-      replication_->publish(line);
+    if (window) {
+      window->flush();
     }
-    return removed ? "OK" : "NOT_FOUND";
+    auto start = std::chrono::steady_clock::now();
+    execute_binary(session, header, frame, &output);
+    auto duration = std::chrono::steady_clock::now() - start;
+    metrics_.record_latency(std::chrono::duration_cast<std::chrono::nanoseconds>(duration));
   }
-  if (cmd == "REBALANCE") {
-    if (config_.role == "replica") {
-      return "ERROR read_only";
+  return consumed;
+}
+
+void KvServer::execute_binary(Session& session, const BinaryHeader& header, std::string_view frame,
+                              OutputBuffer* output) {
+  std::string_view key = frame.substr(kBinaryHeaderSize, header.key_len);
+  std::string_view value = frame.substr(kBinaryHeaderSize + header.key_len, header.value_len);
+  BinaryStatus status = BinaryStatus::kOk;
+  std::optional<ValueRef> result;
+  // MGET results, SCAN keys or RANGE entries, packed into the response value.
+  std::vector<std::optional<ValueRef>> results;
+  uint64_t executed = 0;
+  // Returned in the response argument.
+  uint64_t reply_arg = 0;
+  bool read_only = config_.role == "replica";
+  try {
+    switch (static_cast<BinaryOpcode>(header.opcode)) {
+      case BinaryOpcode::kGet: {
+        std::optional<uint64_t> version;
+        if (header.flags & kBinaryFlagVersion) {
+          version = header.arg;
+        }
+        result = store_.get(key, version);
+        metrics_.record_get();
+        status = result ? BinaryStatus::kOk : BinaryStatus::kNotFound;
+        break;
+      }
+      case BinaryOpcode::kPut: {
+        if (read_only) {
+          status = BinaryStatus::kReadOnly;
+          break;
+        }
+        std::optional<uint32_t> ttl;
+        if (header.flags & kBinaryFlagTtl) {
+          ttl = static_cast<uint32_t>(header.arg);
+        }
+        store_.put(key, value, ttl);
+        metrics_.record_put();
+        log_mutation(frame);
+        break;
+      }
+      case BinaryOpcode::kDel: {
+        if (read_only) {
+          status = BinaryStatus::kReadOnly;
+          break;
+        }
+        bool removed = store_.del(key);
+        metrics_.record_del();
+        log_mutation(frame);
+        status = removed ? BinaryStatus::kOk : BinaryStatus::kNotFound;
+        break;
+      }
+      case BinaryOpcode::kBatch: {
+        // In percore mode members run on the cores owning their keys, as in
+        // a text batch.
+        std::optional<CoreGroup::Gather> members;
+        if (cores_ != nullptr && cores_->self() >= 0) {
+          members.emplace(*cores_);
+        }
+        size_t pos = 0;
+        for (; executed < header.arg && value.size() - pos >= kBinaryHeaderSize; ++executed) {
+          BinaryHeader member = decode_binary_header(value.data() + pos);
+          if (member.magic != kBinaryRequestMagic || member.opcode == static_cast<uint8_t>(BinaryOpcode::kBatch) ||
+              value.size() - pos < member.frame_size()) {
+            status = BinaryStatus::kError;
+            break;
+          }
+          std::string_view member_frame = value.substr(pos, member.frame_size());
+          if (members && single_key(static_cast<BinaryOpcode>(member.opcode))) {
+            members->run(owner_core(member_frame.substr(kBinaryHeaderSize, member.key_len)),
+                         [this, &session, member_frame]() {
+                           execute_binary(session, decode_binary_header(member_frame.data()), member_frame, nullptr);
+                         });
+          } else {
+            if (members) {
+              members->wait();
+            }
+            execute_binary(session, member, member_frame, nullptr);
+          }
+          pos += member.frame_size();
+        }
+        if (executed > 0) {
+          metrics_.record_batch();
+        }
+        reply_arg = executed;
+        break;
+      }
+      case BinaryOpcode::kMget: {
+        std::vector<std::string_view> keys;
+        if (!decode_binary_keys(value, header.arg, keys)) {
+          status = BinaryStatus::kError;
+          break;
+        }
+        results = store_.get_many(keys);
+        metrics_.record_get(keys.size());
+        reply_arg = keys.size();
+        break;
+      }
+      case BinaryOpcode::kMset: {
+        if (read_only) {
+          status = BinaryStatus::kReadOnly;
+          break;
+        }
+        std::vector<std::pair<std::string_view, std::string_view>> items;
+        if (!decode_binary_pairs(value, header.arg, items)) {
+          status = BinaryStatus::kError;
+          break;
+        }
+        store_.put_many(items);
+        metrics_.record_put(items.size());
+        log_mutation(frame);
+        reply_arg = items.size();
+        break;
+      }
+      case BinaryOpcode::kScan: {
+        uint32_t count = value.size() == 4 ? decode_binary_length(value.data()) : kDefaultScanCount;
+        if ((!value.empty() && value.size() != 4) || count == 0) {
+          status = BinaryStatus::kError;
+          break;
+        }
+        ScanPage page = store_.scan(header.arg, key, count);
+        for (auto& member : page.keys) {
+          results.emplace_back(ValueRef(std::move(member)));
+        }
+        reply_arg = page.cursor;
+        break;
+      }
+      case BinaryOpcode::kRange:
+      case BinaryOpcode::kPrefix: {
+        size_t limit = header.arg == 0 ? kDefaultRangeLimit : header.arg;
+        auto items = static_cast<BinaryOpcode>(header.opcode) == BinaryOpcode::kRange ? store_.range(key, value, limit)
+                                                                                      : store_.prefix(key, limit);
+        metrics_.record_get(items.size());
+        for (auto& item : items) {
+          results.emplace_back(ValueRef(std::move(item.key)));
+          results.emplace_back(std::move(item.value));
+        }
+        reply_arg = items.size();
+        break;
+      }
+      case BinaryOpcode::kPing:
+        break;
+      case BinaryOpcode::kDeadline:
+        if (header.arg > std::numeric_limits<uint32_t>::max() || config_.network_mode != "threads") {
+          status = BinaryStatus::kError;
+          break;
+        }
+        session.deadline_ms = static_cast<uint32_t>(header.arg);
+        break;
+      case BinaryOpcode::kSnapshotBegin:
+        reply_arg = store_.begin_snapshot();
+        session.snapshots.push_back(reply_arg);
+        break;
+      case BinaryOpcode::kSnapshotEnd:
+        status = end_snapshot(session, header.arg) ? BinaryStatus::kOk : BinaryStatus::kNotFound;
+        break;
+      default:
+        status = BinaryStatus::kError;
+        break;
     }
-    if (parts.size() != 2) {
-      return "ERROR usage REBALANCE shard_count";
+  } catch (const std::exception&) {
+    status = BinaryStatus::kError;
+  }
+  if (output == nullptr) {
+    return;
+  }
+  uint64_t value_len = result ? result->size() : 0;
+  for (const auto& member : results) {
+    value_len += 4 + (member ? member->size() : 0);
+  }
+  if (value_len > std::numeric_limits<uint32_t>::max()) {
+    status = BinaryStatus::kError;
+    results.clear();
+    value_len = 0;
+  }
+  BinaryHeader response;
+  response.magic = kBinaryResponseMagic;
+  response.opcode = header.opcode;
+  response.flags = static_cast<uint16_t>(status);
+  response.opaque = header.opaque;
+  response.value_len = static_cast<uint32_t>(value_len);
+  response.arg = reply_arg;
+  encode_binary_header(response, output->bytes());
+  if (result) {
+    output->append_value(std::move(*result));
+  }
+  for (auto& member : results) {
+    encode_binary_length(output->bytes(), member ? static_cast<uint32_t>(member->size()) : kBinaryMissing);
+    if (member) {
+      output->append_value(std::move(*member));
     }
-    store_.rebalance(static_cast<uint32_t>(std::stoul(parts[1])));
-    return "OK";
   }
-  if (cmd == "PING") {
-    return "PONG";
+}
+
+void KvServer::log_mutation(std::string_view record) {
+  if (wal_) {
+    wal_->append(record);
+  }
+  if (replication_) {
+    replication_->publish(record);
   }
-  return "ERROR unknown command";
 }
 
 } // namespace kvstore
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "config.hpp"
+#include "core_group.hpp"
+#include "event_loop.hpp"
 #include "fault_injection.hpp"
 #include "metrics.hpp"
 #include "persistence.hpp"
+#include "protocol.hpp"
 #include "replication.hpp"
 #include "storage.hpp"
 #include "thread_pool.hpp"
@@ -11,7 +14,9 @@
 
 #include <atomic>
 #include <memory>
+#include <string_view>
 #include <thread>
+#include <vector>
 
 namespace kvstore {
 
@@ -44,8 +49,32 @@ class KvServer {
  private:
   void accept_loop();
   void handle_connection(int client_fd);
-  std::string process_command(const std::string& line);
-  void apply_record(const std::string& record);
+  // Home NUMA node of the first key in `input`, or -1 if there is none.
+  int route_node(const Session& session, std::string_view input);
+  // Executes every complete request in `input` and returns the bytes consumed.
+  // With `refused` set, the requests are framed and answered BUSY instead, and
+  // counted there.
+  size_t process_buffer(Session& session, std::string_view input, OutputBuffer& output,
+                        uint64_t* refused = nullptr);
+  size_t process_text(Session& session, std::string_view input, OutputBuffer& output, uint64_t* refused);
+  size_t process_binary(Session& session, std::string_view input, OutputBuffer& output, uint64_t* refused);
+  void process_command(Session& session, std::string_view line, const Tokens& parts, OutputBuffer& response);
+  // Executes one text request and ends its response with a newline; a failure
+  // becomes an ERROR response.
+  void execute_text(Session& session, std::string_view line, const Tokens& parts, OutputBuffer& output);
+  // Executes the newline-terminated members of a text batch on the cores
+  // owning their keys, discarding their responses. Throws the first failure
+  // once every member has run.
+  void execute_text_batch(Session& session, std::string_view members);
+  // Core owning the shard `key` is written to, in percore mode.
+  size_t owner_core(std::string_view key) { return cores_->owner(store_.home_shard(key)); }
+  // Executes one complete binary frame. Responses are skipped when `output` is
+  // null, as for the members of a batch.
+  void execute_binary(Session& session, const BinaryHeader& header, std::string_view frame, OutputBuffer* output);
+  // Releases what a closed connection still holds in the store.
+  void release_session(Session& session);
+  bool end_snapshot(Session& session, uint64_t version);
+  void log_mutation(std::string_view record);
 
   Config config_;
   ShardedStore& store_;
@@ -56,6 +85,13 @@ class KvServer {
   std::atomic<bool> running_{false};
   std::thread accept_thread_;
   net::Socket listen_fd_ = net::kInvalidSocket;
+  std::vector<std::unique_ptr<EventLoop>> loops_;
+  // In percore mode the event loops are its cores.
+  std::unique_ptr<CoreGroup> cores_;
+  size_t next_loop_ = 0;
+  // CPU sets that connection threads and event loops are pinned to in turn.
+  std::vector<std::vector<int>> io_cpus_;
+  std::atomic<size_t> next_io_cpus_{0};
 };
 
 } // namespace kvstore
@@ -0,0 +1,193 @@
+#include "slab_arena.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace kvstore {
+
+namespace {
+
+constexpr size_t kPageSize = 1024 * 1024;
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+constexpr size_t kSmallestChunk = 32;
+constexpr size_t kChunkAlignment = 8;
+
+#ifdef __linux__
+// Maps `size` bytes aligned to `size`, so a 2 MiB page can be backed by one
+// transparent huge page.
+char* map_aligned(size_t size, bool huge_pages) {
+  size_t span = huge_pages ? size * 2 : size;
+  void* raw = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  char* base = static_cast<char*>(raw);
+  if (!huge_pages) {
+    return base;
+  }
+  auto address = reinterpret_cast<uintptr_t>(base);
+  char* aligned = base + ((size - address % size) % size);
+  if (aligned > base) {
+    munmap(base, static_cast<size_t>(aligned - base));
+  }
+  size_t tail = static_cast<size_t>((base + span) - (aligned + size));
+  if (tail > 0) {
+    munmap(aligned + size, tail);
+  }
+  madvise(aligned, size, MADV_HUGEPAGE);
+  return aligned;
+}
+#endif
+
+} // namespace
+
+SlabArena::SlabArena(bool huge_pages, const CpuTopology* topology)
+    : page_size_(huge_pages ? kHugePageSize : kPageSize), huge_pages_(huge_pages), topology_(topology) {
+#ifndef __linux__
+  // Large pages need extra privileges elsewhere; fall back to normal pages.
+  huge_pages_ = false;
+#endif
+  for (size_t size = kSmallestChunk; size <= page_size_ / 2;) {
+    chunk_sizes_.push_back(size);
+    size_t next = (size + size / 4 + kChunkAlignment - 1) / kChunkAlignment * kChunkAlignment;
+    size = std::max(next, size + kChunkAlignment);
+  }
+  if (topology_ != nullptr) {
+    // Node and class share the 8-bit class id.
+    nodes_ = std::clamp<size_t>(topology_->nodes(), 1, kLargeClass / chunk_sizes_.size());
+  }
+  classes_ = std::make_unique<SizeClass[]>(chunk_sizes_.size() * nodes_);
+  for (size_t i = 0; i < chunk_sizes_.size() * nodes_; ++i) {
+    classes_[i].chunk_size = chunk_sizes_[i % chunk_sizes_.size()];
+  }
+}
+
+SlabArena::~SlabArena() {
+  for (char* page : pages_) {
+#ifdef __linux__
+    munmap(page, page_size_);
+#else
+    ::operator delete(page);
+#endif
+  }
+}
+
+uint8_t SlabArena::class_for(size_t bytes) const {
+  auto it = std::lower_bound(chunk_sizes_.begin(), chunk_sizes_.end(), bytes);
+  if (it == chunk_sizes_.end()) {
+    return kLargeClass;
+  }
+  return static_cast<uint8_t>(it - chunk_sizes_.begin());
+}
+
+size_t SlabArena::footprint(size_t bytes) const {
+  uint8_t size_class = class_for(bytes);
+  return size_class == kLargeClass ? bytes : chunk_sizes_[size_class];
+}
+
+char* SlabArena::reserve_page(size_t node) {
+#ifdef __linux__
+  char* page = map_aligned(page_size_, huge_pages_);
+  if (nodes_ > 1) {
+    topology_->bind_memory(page, page_size_, node);
+  }
+#else
+  (void)node;
+  char* page = static_cast<char*>(::operator new(page_size_));
+#endif
+  std::lock_guard<std::mutex> lock(pages_mutex_);
+  pages_.push_back(page);
+  return page;
+}
+
+char* SlabArena::allocate(size_t bytes, uint8_t& size_class, size_t node) {
+  size_class = class_for(bytes);
+  if (size_class == kLargeClass) {
+    large_count_.fetch_add(1, std::memory_order_relaxed);
+    large_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    return static_cast<char*>(::operator new(bytes));
+  }
+  node %= nodes_;
+  size_class = static_cast<uint8_t>(node * chunk_sizes_.size() + size_class);
+  SizeClass& cls = classes_[size_class];
+  std::lock_guard<std::mutex> lock(cls.mutex);
+  char* chunk = cls.free_list;
+  if (chunk != nullptr) {
+    std::memcpy(&cls.free_list, chunk, sizeof(char*));
+    --cls.chunks_free;
+  } else {
+    if (cls.carve == cls.carve_end) {
+      // Page reservation is rare; hold the class lock so only one thread
+      // grows this class at a time.
+      cls.carve = reserve_page(node);
+      cls.carve_end = cls.carve + page_size_ / cls.chunk_size * cls.chunk_size;
+      ++cls.pages;
+    }
+    chunk = cls.carve;
+    cls.carve += cls.chunk_size;
+  }
+  ++cls.chunks_used;
+  cls.requested_bytes += bytes;
+  return chunk;
+}
+
+void SlabArena::deallocate(char* chunk, size_t bytes, uint8_t size_class) {
+  if (size_class == kLargeClass) {
+    large_count_.fetch_sub(1, std::memory_order_relaxed);
+    large_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+    ::operator delete(chunk);
+    return;
+  }
+  SizeClass& cls = classes_[size_class];
+  std::lock_guard<std::mutex> lock(cls.mutex);
+  std::memcpy(chunk, &cls.free_list, sizeof(char*));
+  cls.free_list = chunk;
+  --cls.chunks_used;
+  ++cls.chunks_free;
+  cls.requested_bytes -= bytes;
+}
+
+bool SlabArena::resize_in_place(uint8_t size_class, size_t old_bytes, size_t new_bytes) {
+  if (size_class == kLargeClass || class_for(new_bytes) != size_class % chunk_sizes_.size()) {
+    return false;
+  }
+  SizeClass& cls = classes_[size_class];
+  std::lock_guard<std::mutex> lock(cls.mutex);
+  cls.requested_bytes = cls.requested_bytes - old_bytes + new_bytes;
+  return true;
+}
+
+std::vector<SlabClassMetrics> SlabArena::stats() const {
+  std::vector<SlabClassMetrics> result;
+  result.reserve(chunk_sizes_.size() + 1);
+  for (size_t i = 0; i < chunk_sizes_.size(); ++i) {
+    SlabClassMetrics metrics;
+    metrics.chunk_size = chunk_sizes_[i];
+    for (size_t node = 0; node < nodes_; ++node) {
+      const SizeClass& cls = classes_[node * chunk_sizes_.size() + i];
+      std::lock_guard<std::mutex> lock(cls.mutex);
+      metrics.pages += cls.pages;
+      metrics.chunks_used += cls.chunks_used;
+      metrics.chunks_free += cls.chunks_free + static_cast<uint64_t>(cls.carve_end - cls.carve) / cls.chunk_size;
+      metrics.requested_bytes += cls.requested_bytes;
+    }
+    if (metrics.pages == 0) {
+      continue;
+    }
+    metrics.reserved_bytes = metrics.pages * page_size_;
+    result.push_back(metrics);
+  }
+  SlabClassMetrics large;
+  large.chunks_used = large_count_.load(std::memory_order_relaxed);
+  large.requested_bytes = large_bytes_.load(std::memory_order_relaxed);
+  large.reserved_bytes = large.requested_bytes;
+  result.push_back(large);
+  return result;
+}
+
+} // namespace kvstore
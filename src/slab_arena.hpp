@@ -0,0 +1,90 @@
+#pragma once
+
+#include "affinity.hpp"
+#include "metrics.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace kvstore {
+
+// Size-classed slab allocator for key/value bytes. Memory is reserved in
+// fixed-size pages (1 MiB, or 2 MiB transparent huge pages when enabled) that
+// are carved into equal chunks of one size class; classes grow by 1.25x from
+// 32 bytes up to half a page. Freed chunks go back on their class's free list
+// and pages are never returned, so the allocator neither calls malloc per
+// item nor fragments the heap. Requests larger than the biggest class get an
+// exact-size allocation of their own.
+//
+// Each class has its own mutex, so writers in different shards only contend
+// when they allocate from the same class at the same moment.
+//
+// Given a topology with several NUMA nodes, every node gets its own set of
+// classes whose pages are bound to that node's memory. The class id returned
+// by allocate() names the node too, so a chunk always goes back to the node
+// it came from.
+class SlabArena {
+ public:
+  static constexpr uint8_t kLargeClass = 0xFF;
+
+  explicit SlabArena(bool huge_pages = false, const CpuTopology* topology = nullptr);
+  ~SlabArena();
+
+  SlabArena(const SlabArena&) = delete;
+  SlabArena& operator=(const SlabArena&) = delete;
+
+  // Returns a chunk of at least `bytes`, from `node`'s pages, and the class to
+  // hand back to deallocate() together with the same `bytes`.
+  char* allocate(size_t bytes, uint8_t& size_class, size_t node = 0);
+  void deallocate(char* chunk, size_t bytes, uint8_t size_class);
+  // Lets a chunk holding `old_bytes` hold `new_bytes` instead when both map to
+  // its class, so an overwrite can reuse it. Returns false otherwise.
+  bool resize_in_place(uint8_t size_class, size_t old_bytes, size_t new_bytes);
+
+  // Bytes an allocation of `bytes` really occupies: its chunk size.
+  size_t footprint(size_t bytes) const;
+  size_t page_size() const { return page_size_; }
+  bool huge_pages() const { return huge_pages_; }
+  // Nodes with pages of their own; at most one per topology node.
+  size_t nodes() const { return nodes_; }
+
+  // Per-class usage summed over nodes; the last element describes large
+  // allocations.
+  std::vector<SlabClassMetrics> stats() const;
+
+ private:
+  struct SizeClass {
+    size_t chunk_size = 0;
+    mutable std::mutex mutex;
+    // Intrusive free list threaded through the first bytes of each free chunk.
+    char* free_list = nullptr;
+    // Uncarved tail of the class's newest page.
+    char* carve = nullptr;
+    char* carve_end = nullptr;
+    uint64_t pages = 0;
+    uint64_t chunks_used = 0;
+    uint64_t chunks_free = 0;
+    uint64_t requested_bytes = 0;
+  };
+
+  uint8_t class_for(size_t bytes) const;
+  char* reserve_page(size_t node);
+
+  size_t page_size_;
+  bool huge_pages_;
+  const CpuTopology* topology_;
+  size_t nodes_ = 1;
+  std::vector<size_t> chunk_sizes_;
+  // chunk_sizes_.size() classes per node, node by node.
+  std::unique_ptr<SizeClass[]> classes_;
+  std::mutex pages_mutex_;
+  std::vector<char*> pages_;
+  std::atomic<uint64_t> large_count_{0};
+  std::atomic<uint64_t> large_bytes_{0};
+};
+
+} // namespace kvstore
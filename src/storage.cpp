@@ -1,123 +1,1112 @@
 #include "storage.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <functional>
+#include <limits>
+#include <stdexcept>
 
 namespace kvstore {
 
-ShardedStore::ShardedStore(uint32_t shards, uint64_t memory_budget_bytes, Metrics& metrics)
-    : shards_(shards), memory_budget_bytes_(memory_budget_bytes), metrics_(metrics) {}
+namespace {
 
-ShardedStore::Shard& ShardedStore::shard_for(const std::string& key) {
-  size_t idx = std::hash<std::string>{}(key) % shards_.size();
-  return shards_[idx];
+// Lamping & Veach jump consistent hash. Growing from n to m buckets moves only
+// the (m - n) / m of keys that land in the new buckets, and shrinking moves
+// only the keys of the removed buckets, so a reshard never shuffles keys
+// between shards that exist in both layouts.
+uint32_t jump_consistent_hash(uint64_t key, uint32_t buckets) {
+  int64_t bucket = -1;
+  int64_t next = 0;
+  while (next < static_cast<int64_t>(buckets)) {
+    bucket = next;
+    key = key * 2862933555777941757ULL + 1;
+    next = static_cast<int64_t>(static_cast<double>(bucket + 1) *
+                                (static_cast<double>(1LL << 31) / static_cast<double>((key >> 33) + 1)));
+  }
+  return static_cast<uint32_t>(bucket);
+}
+
+} // namespace
+
+ShardedStore::ShardedStore(uint32_t shards, uint64_t memory_budget_bytes, Metrics& metrics, EvictionPolicy policy,
+                           bool huge_pages, uint32_t high_watermark, uint32_t low_watermark,
+                           uint64_t version_retention_bytes, bool ordered_index, bool numa_placement)
+    : memory_budget_bytes_(memory_budget_bytes),
+      policy_(policy),
+      ordered_index_(ordered_index),
+      numa_placement_(numa_placement),
+      arena_(huge_pages, numa_placement ? &CpuTopology::system() : nullptr),
+      history_limit_bytes_(version_retention_bytes),
+      metrics_(metrics) {
+  high_watermark = std::clamp<uint32_t>(high_watermark, 1, 100);
+  low_watermark = std::clamp<uint32_t>(low_watermark, 1, high_watermark);
+  high_water_bytes_ = memory_budget_bytes / 100 * high_watermark;
+  low_water_bytes_ = memory_budget_bytes / 100 * low_watermark;
+  uint32_t count = std::clamp<uint32_t>(shards, 1, kMaxShards);
+  for (uint32_t i = 0; i < count; ++i) {
+    add_shard();
+  }
+  layout_ = make_layout(count, count, count);
+  evictor_ = std::thread([this]() { run_evictor(); });
+}
+
+ShardedStore::~ShardedStore() {
+  {
+    std::lock_guard<std::mutex> guard(evictor_mutex_);
+    stopping_ = true;
+  }
+  evictor_cv_.notify_all();
+  evictor_.join();
+  {
+    std::lock_guard<std::mutex> guard(migration_mutex_);
+    if (migrator_.joinable()) {
+      migrator_.join();
+    }
+  }
+  delete layout_.load();
+  // Slab pages go with the arena, but large items are allocations of their own.
+  for (auto& shard : shards_) {
+    for (auto& slot : shard->map) {
+      unref_item(slot.first, slot.second);
+    }
+  }
+  for (auto& slot : history_) {
+    for (const auto& old : slot.second) {
+      drop_version(old);
+    }
+  }
 }
 
-const ShardedStore::Shard& ShardedStore::shard_for(const std::string& key) const {
-  size_t idx = std::hash<std::string>{}(key) % shards_.size();
-  return shards_[idx];
+const ShardedStore::Layout* ShardedStore::make_layout(size_t shards, uint32_t home_count, uint32_t previous_count) const {
+  auto* layout = new Layout;
+  layout->home_count = home_count;
+  layout->previous_count = previous_count;
+  layout->home_slots = slot_table(home_count);
+  layout->previous_slots = previous_count == home_count ? layout->home_slots : slot_table(previous_count);
+  for (size_t i = 0; i < shards; ++i) {
+    layout->shards.push_back(shards_[i].get());
+  }
+  return layout;
 }
 
-void ShardedStore::touch(Shard& shard, const std::string& key, Entry& entry) {
-  shard.lru.erase(entry.lru_it);
-  shard.lru.push_front(key);
-  entry.lru_it = shard.lru.begin();
+// Swaps in a new layout and frees the old one once no pinned operation can
+// still be using it. Only the migrator calls this, never while pinned.
+void ShardedStore::publish(const Layout* layout) {
+  auto started = std::chrono::steady_clock::now();
+  const Layout* old = layout_.exchange(layout, std::memory_order_acq_rel);
+  epochs_.synchronize();
+  delete old;
+  metrics_.record_rebalance_switch(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started));
 }
 
-void ShardedStore::remove_entry(Shard& shard, const std::string& key) {
-  auto it = shard.map.find(key);
-  if (it == shard.map.end()) {
+ShardedStore::SlotTable ShardedStore::slot_table(uint32_t shards) {
+  SlotTable table(kSlots);
+  for (size_t slot = 0; slot < kSlots; ++slot) {
+    table[slot] = static_cast<uint16_t>(jump_consistent_hash(slot, shards));
+  }
+  return table;
+}
+
+ShardedStore::Placement ShardedStore::placement(const Layout& layout, size_t hash) {
+  size_t slot = slot_of(hash);
+  return {layout.home_slots[slot], layout.previous_slots[slot]};
+}
+
+// Shard locks are always taken in index order so a migration batch and an
+// operation on the same pair of shards cannot deadlock.
+template <typename Lock>
+void ShardedStore::lock_placement(const Layout& layout, const Placement& placement, Lock& first, Lock& second) {
+  size_t low = std::min(placement.home, placement.previous);
+  size_t high = std::max(placement.home, placement.previous);
+  first = Lock(layout.shards[low]->mutex);
+  if (high != low) {
+    second = Lock(layout.shards[high]->mutex);
+  }
+}
+
+// Homes are assigned round robin, so resharding never changes an existing
+// shard's node.
+void ShardedStore::add_shard() {
+  shards_.push_back(std::make_unique<Shard>());
+  shards_.back()->node = static_cast<uint32_t>((shards_.size() - 1) % arena_.nodes());
+}
+
+void ShardedStore::note_access(const Shard& shard, uint64_t count) {
+  if (!numa_placement_) {
     return;
   }
-  memory_usage_bytes_ -= it->second.size_bytes;
-  shard.lru.erase(it->second.lru_it);
-  shard.map.erase(it);
+  int node = CpuTopology::system().current_node();
+  if (node >= 0) {
+    size_t local = static_cast<size_t>(node) % arena_.nodes();
+    metrics_.record_node_access(local, local != shard.node, count);
+  }
 }
 
-std::optional<std::string> ShardedStore::get(const std::string& key, std::optional<uint64_t> snapshot_version) {
-  std::shared_lock<std::shared_mutex> rebalance_lock(rebalance_mutex_);
-  auto& shard = shard_for(key);
-  std::shared_lock<std::shared_mutex> lock(shard.mutex);
-  auto it = shard.map.find(key);
-  if (it == shard.map.end()) {
+// Copies the key and value into a new chunk on the shard's node and returns
+// the key's view of it, which becomes the entry's map key.
+std::string_view ShardedStore::store_item(const Shard& shard, std::string_view key, std::string_view value,
+                                          Entry& entry) {
+  char* item = arena_.allocate(item_bytes(key.size(), value.size()), entry.size_class, shard.node);
+  init_item_refs(item);
+  char* stored = item + kItemHeaderBytes;
+  std::memcpy(stored, key.data(), key.size());
+  std::memcpy(stored + key.size(), value.data(), value.size());
+  entry.value_size = static_cast<uint32_t>(value.size());
+  return {stored, key.size()};
+}
+
+// Drops the store's reference to the entry's chunk. A reader still holding a
+// ValueRef frees it later, so until then the chunk is no longer charged to
+// the budget but still occupies its slab.
+void ShardedStore::unref_item(std::string_view key, const Entry& entry) {
+  char* item = item_of(key);
+  if (release_item(item)) {
+    arena_.deallocate(item, item_bytes(key.size(), entry.value_size), entry.size_class);
+  }
+}
+
+// Called with the shard's unique lock held.
+void ShardedStore::insert_entry(Shard& shard, size_t hash, std::string_view key, std::string_view value, Entry entry) {
+  std::string_view stored = store_item(shard, key, value, entry);
+  track_entry(shard, entry, hash);
+  if (ordered_index_) {
+    shard.index.insert(stored);
+  }
+  charge(shard, charge_of(stored, entry));
+  shard.map.try_emplace_hashed(hash, stored, entry);
+}
+
+// Both are called with the shard's unique lock held.
+void ShardedStore::charge(Shard& shard, uint64_t bytes) {
+  shard.memory_bytes.store(shard.memory_bytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+  memory_usage_bytes_ += bytes;
+}
+
+void ShardedStore::discharge(Shard& shard, uint64_t bytes) {
+  shard.memory_bytes.store(shard.memory_bytes.load(std::memory_order_relaxed) - bytes, std::memory_order_relaxed);
+  memory_usage_bytes_ -= bytes;
+}
+
+// Re-charges the shard's table, policy and timer storage after it may have
+// grown. None of them shrink on erase, so erasing paths need not call this.
+void ShardedStore::account_overhead(Shard& shard) {
+  size_t bytes = shard.map.allocated_bytes() + shard.lfu.allocated_bytes() + shard.timers.allocated_bytes() +
+                 shard.index.allocated_bytes();
+  if (bytes > shard.overhead_bytes) {
+    charge(shard, bytes - shard.overhead_bytes);
+  } else if (bytes < shard.overhead_bytes) {
+    discharge(shard, shard.overhead_bytes - bytes);
+  }
+  shard.overhead_bytes = bytes;
+}
+
+void ShardedStore::mark_referenced(const Entry& entry) {
+  std::atomic_ref<uint8_t> referenced(entry.referenced);
+  // Skip the store when the bit is already set so hot keys do not keep
+  // dirtying a cache line shared by every reader.
+  if (referenced.load(std::memory_order_relaxed) == 0) {
+    referenced.store(1, std::memory_order_relaxed);
+  }
+}
+
+// Called with the shard's shared lock held. `entry` is null on a miss.
+void ShardedStore::record_read(Shard& shard, const Entry* entry, size_t hash) {
+  if (entry != nullptr) {
+    metrics_.record_cache_hit();
+  } else {
+    metrics_.record_cache_miss();
+  }
+  if (policy_ == EvictionPolicy::kClock) {
+    if (entry != nullptr) {
+      mark_referenced(*entry);
+    }
+    return;
+  }
+  // Dropping an access under contention only makes the policy slightly less
+  // precise; blocking here would serialise readers of a hot shard again.
+  std::unique_lock<std::mutex> policy_lock(shard.policy_mutex, std::try_to_lock);
+  if (!policy_lock.owns_lock()) {
+    return;
+  }
+  if (entry != nullptr) {
+    shard.lfu.on_access(entry->policy_node);
+  } else {
+    shard.lfu.on_miss(hash);
+  }
+}
+
+// Called with the shard's unique lock held for a newly inserted entry.
+void ShardedStore::track_entry(Shard& shard, Entry& entry, size_t hash) {
+  if (policy_ == EvictionPolicy::kTinyLfu) {
+    entry.policy_node = shard.lfu.on_insert(hash);
+  }
+  schedule_expiry(shard, entry, hash);
+}
+
+// (Re)indexes the entry's deadline in the shard's timing wheel.
+void ShardedStore::schedule_expiry(Shard& shard, Entry& entry, size_t hash) {
+  if (entry.timer != TimingWheel::kNoTimer) {
+    shard.timers.cancel(entry.timer);
+    entry.timer = TimingWheel::kNoTimer;
+  }
+  if (entry.expire_at != kNoExpiry) {
+    entry.timer = shard.timers.schedule(hash, entry.expire_at);
+  }
+}
+
+// Unhooks the entry from the shard's policy and timing wheel.
+void ShardedStore::detach_entry(Shard& shard, Entry& entry) {
+  if (entry.policy_node != TinyLfuPolicy::kNoNode) {
+    shard.lfu.on_remove(entry.policy_node);
+    entry.policy_node = TinyLfuPolicy::kNoNode;
+  }
+  if (entry.timer != TimingWheel::kNoTimer) {
+    shard.timers.cancel(entry.timer);
+    entry.timer = TimingWheel::kNoTimer;
+  }
+}
+
+// Drops the entry's accounting, policy node, timer and chunk before it is
+// erased. The map key views the chunk, so nothing may look at it afterwards.
+// When a write at version `superseded` removes the entry, its chunk may be kept
+// as an old version instead.
+void ShardedStore::release_entry(Shard& shard, std::string_view key, Entry& entry, uint64_t superseded) {
+  if (ordered_index_) {
+    shard.index.erase(key);
+  }
+  discharge(shard, charge_of(key, entry));
+  detach_entry(shard, entry);
+  if (superseded != 0) {
+    retire_version(key, entry, superseded);
+    return;
+  }
+  // Eviction and restore remove a value pinned snapshots may still see, with
+  // no write to keep it for; their reads must fail rather than miss it. An
+  // expired value needs nothing, since every read already finds it gone.
+  if (retains(entry) && (entry.expire_at == kNoExpiry || std::chrono::steady_clock::now() < entry.expire_at)) {
+    drop_pinned_versions(++version_);
+  }
+  unref_item(key, entry);
+}
+
+ShardedStore::Map::iterator ShardedStore::remove_entry(Shard& shard, Map::iterator it, uint64_t superseded) {
+  release_entry(shard, it->first, it->second, superseded);
+  return shard.map.erase(it);
+}
+
+// Small values are copied; large ones are shared by taking a reference.
+ValueRef ShardedStore::read_value(std::string_view key, uint32_t value_size, uint8_t size_class) {
+  std::string_view value(key.data() + key.size(), value_size);
+  if (value.size() < kShareValueBytes) {
+    return ValueRef(std::string(value));
+  }
+  char* item = item_of(key);
+  retain_item(item);
+  return ValueRef(arena_, item, item_bytes(key.size(), value.size()), size_class, value);
+}
+
+// Called with the shard lock held by a write at version `superseded` that
+// replaced or deleted `entry`, whose chunk `key` views and which is no longer
+// charged to the shard. Keeps the chunk if a pinned snapshot may still read it
+// and drops the store's reference otherwise.
+void ShardedStore::retire_version(std::string_view key, const Entry& entry, uint64_t superseded) {
+  if (!retains(entry)) {
+    unref_item(key, entry);
+    return;
+  }
+  OldVersion old{key, entry.version, superseded, entry.expire_at, entry.value_size, entry.size_class};
+  uint64_t bytes = charge_of(old);
+  std::lock_guard<std::mutex> guard(history_mutex_);
+  if (history_bytes_ + bytes > history_limit_bytes_) {
+    drop_pinned_versions(superseded);
+    unref_item(key, entry);
+    return;
+  }
+  auto it = history_.try_emplace_hashed(KeyHash{}(key), key).first;
+  it->second.push_back(old);
+  history_bytes_ += bytes;
+  ++history_versions_;
+  memory_usage_bytes_ += bytes;
+}
+
+// Called with the shard lock held when a value snapshots pinned below
+// `superseded` may need is gone. They can no longer be answered exactly, so
+// their reads fail rather than return a newer value or none.
+void ShardedStore::drop_pinned_versions(uint64_t superseded) {
+  uint64_t floor = history_floor_.load();
+  while (floor < superseded && !history_floor_.compare_exchange_weak(floor, superseded)) {
+  }
+  metrics_.record_version_dropped();
+}
+
+// Called with history_mutex_ held.
+void ShardedStore::drop_version(const OldVersion& old) {
+  char* item = item_of(old.key);
+  if (release_item(item)) {
+    arena_.deallocate(item, item_bytes(old.key.size(), old.value_size), old.size_class);
+  }
+}
+
+// Called with the key's shard locks held, so a write cannot move the version
+// being looked for between its shard and the history.
+std::optional<ValueRef> ShardedStore::read_version(std::string_view key, size_t hash, uint64_t snapshot_version) {
+  std::lock_guard<std::mutex> guard(history_mutex_);
+  auto it = history_.find_hashed(key, hash);
+  const OldVersion* old = it == history_.end() ? nullptr : version_at(it->second, snapshot_version);
+  if (old == nullptr || (old->expire_at != kNoExpiry && std::chrono::steady_clock::now() >= old->expire_at)) {
     return std::nullopt;
   }
-  const Entry& entry = it->second;
-  if (snapshot_version && entry.version > *snapshot_version) {
+  return read_value(old->key, old->value_size, old->size_class);
+}
+
+const ShardedStore::OldVersion* ShardedStore::version_at(const std::vector<OldVersion>& chain,
+                                                         uint64_t snapshot_version) {
+  for (const OldVersion& old : chain) {
+    if (old.version <= snapshot_version && snapshot_version < old.superseded) {
+      return &old;
+    }
+  }
+  return nullptr;
+}
+
+// GET found the entry expired under the shared lock; retake the shard lock
+// exclusively and remove it unless a writer replaced it in between.
+void ShardedStore::remove_if_expired(Shard& shard, std::string_view key, size_t hash) {
+  std::unique_lock<SeqMutex> lock(shard.mutex);
+  auto it = shard.map.find_hashed(key, hash);
+  if (it != shard.map.end() && it->second.expire_at != kNoExpiry &&
+      std::chrono::steady_clock::now() >= it->second.expire_at) {
+    remove_entry(shard, it);
+  }
+}
+
+bool ShardedStore::evict_one(Shard& shard) {
+  size_t slots = shard.map.capacity();
+  if (shard.map.empty()) {
+    return false;
+  }
+  if (policy_ == EvictionPolicy::kTinyLfu) {
+    uint32_t node = shard.lfu.select_victim();
+    if (node == TinyLfuPolicy::kNoNode) {
+      return false;
+    }
+    auto it = shard.map.find_hashed_if(static_cast<size_t>(shard.lfu.hash_of(node)),
+                                       [node](const auto& slot) { return slot.second.policy_node == node; });
+    if (it == shard.map.end()) {
+      return false;
+    }
+    remove_entry(shard, it);
+    return true;
+  }
+  // Two full turns guarantee a victim: the first may only clear bits.
+  for (size_t step = 0; step < 2 * slots; ++step) {
+    size_t index = shard.clock_hand;
+    shard.clock_hand = (index + 1) & (slots - 1);
+    auto* slot = shard.map.slot_at(index);
+    if (slot == nullptr) {
+      continue;
+    }
+    std::atomic_ref<uint8_t> referenced(slot->second.referenced);
+    if (referenced.load(std::memory_order_relaxed) != 0) {
+      referenced.store(0, std::memory_order_relaxed);
+      continue;
+    }
+    release_entry(shard, slot->first, slot->second);
+    shard.map.erase_slot(index);
+    return true;
+  }
+  return false;
+}
+
+// Lock-free GET for CLOCK. Copies the entry and the value while the shard's
+// sequence number stays even and unchanged, and retries when a writer
+// overlapped. A key's bytes are only followed into slab chunks, whose pages are
+// never unmapped, so a stale view reads garbage at worst and fails validation.
+// Returns false when the caller must take the shard lock instead: after
+// kOptimisticAttempts tries, or for an expired or shared value.
+bool ShardedStore::get_optimistic(Shard& shard, std::string_view key, size_t hash, std::optional<ValueRef>& result) {
+  std::string value;
+  for (int attempt = 0; attempt < kOptimisticAttempts; ++attempt) {
+    if (attempt > 0) {
+      metrics_.record_optimistic_retry();
+    }
+    uint64_t seq = shard.mutex.read_begin();
+    auto validate = [&shard, seq]() { return shard.mutex.read_validate(seq); };
+    const Entry* live = nullptr;
+    Entry entry;
+    bool locked_read = false;
+    bool consistent = shard.map.probe_unlocked(
+        hash, validate, [&](const Map::value_type* slot, std::string_view stored, const Entry& candidate) {
+          if (candidate.size_class == SlabArena::kLargeClass || candidate.value_size >= kShareValueBytes) {
+            locked_read = true;
+            return true;
+          }
+          if (stored.size() != key.size() || std::memcmp(stored.data(), key.data(), key.size()) != 0) {
+            return false;
+          }
+          value.assign(stored.data() + stored.size(), candidate.value_size);
+          live = &slot->second;
+          entry = candidate;
+          return true;
+        });
+    if (!consistent || !validate()) {
+      continue;
+    }
+    if (locked_read) {
+      return false;
+    }
+    if (live == nullptr) {
+      record_read(shard, nullptr, hash);
+      result = std::nullopt;
+      return true;
+    }
+    if (entry.expire_at != kNoExpiry && std::chrono::steady_clock::now() >= entry.expire_at) {
+      return false;
+    }
+    // The slot may hold another entry by now; a stray reference bit only
+    // makes CLOCK keep that entry one sweep longer.
+    record_read(shard, live, hash);
+    result = ValueRef(std::move(value));
+    return true;
+  }
+  metrics_.record_optimistic_fallback();
+  return false;
+}
+
+// Called with the placement's shard locks held. Leaves `shard` at the shard
+// searched last: the previous one when a key that has not migrated yet is
+// missing from its home.
+ShardedStore::Map::iterator ShardedStore::find_locked(const Layout& layout, const Placement& where,
+                                                      std::string_view key, size_t hash, Shard*& shard) {
+  shard = layout.shards[where.home];
+  auto it = shard->map.find_hashed(key, hash);
+  if (it == shard->map.end() && where.previous != where.home) {
+    shard = layout.shards[where.previous];
+    it = shard->map.find_hashed(key, hash);
+  }
+  return it;
+}
+
+std::optional<ValueRef> ShardedStore::get(std::string_view key, std::optional<uint64_t> snapshot_version) {
+  auto pin = epochs_.pin();
+  const Layout& layout = current_layout();
+  size_t hash = KeyHash{}(key);
+  auto where = placement(layout, hash);
+  note_access(*layout.shards[where.home]);
+  // A key that is moving between shards may be in either, so it is read under
+  // both locks. Snapshot reads may need the history, which is locked too.
+  if (policy_ == EvictionPolicy::kClock && where.home == where.previous && !snapshot_version) {
+    std::optional<ValueRef> result;
+    if (get_optimistic(*layout.shards[where.home], key, hash, result)) {
+      return result;
+    }
+  }
+  std::shared_lock<SeqMutex> lock;
+  std::shared_lock<SeqMutex> second_lock;
+  lock_placement(layout, where, lock, second_lock);
+  Shard* shard = nullptr;
+  auto it = find_locked(layout, where, key, hash, shard);
+  if (snapshot_version) {
+    // Writes raise the floor under the shard lock, so checking it here covers
+    // every version dropped before this read.
+    if (*snapshot_version < history_floor_.load()) {
+      throw std::runtime_error("snapshot too old");
+    }
+    if (it == shard->map.end() || it->second.version > *snapshot_version) {
+      return read_version(key, hash, *snapshot_version);
+    }
+  }
+  if (it == shard->map.end()) {
+    record_read(*layout.shards[where.home], nullptr, hash);
     return std::nullopt;
   }
-  if (entry.expire_at && std::chrono::steady_clock::now() >= *entry.expire_at) {
+  const Entry& entry = it->second;
+  if (entry.expire_at != kNoExpiry && std::chrono::steady_clock::now() >= entry.expire_at) {
+    record_read(*shard, nullptr, hash);
+    lock = {};
+    second_lock = {};
+    remove_if_expired(*shard, key, hash);
     return std::nullopt;
   }
-  return entry.value;
+  record_read(*shard, &entry, hash);
+  return read_value(it->first, entry.value_size, entry.size_class);
 }
 
-void ShardedStore::put(const std::string& key, std::string value, std::optional<uint32_t> ttl_seconds) {
-  std::shared_lock<std::shared_mutex> rebalance_lock(rebalance_mutex_);
-  auto& shard = shard_for(key);
-  std::unique_lock<std::shared_mutex> lock(shard.mutex);
-  auto now = std::chrono::steady_clock::now();
-  auto expire_at = ttl_seconds ? std::optional<std::chrono::steady_clock::time_point>(now + std::chrono::seconds(*ttl_seconds))
-                               : std::nullopt;
-  auto it = shard.map.find(key);
+void ShardedStore::put(std::string_view key, std::string_view value, std::optional<uint32_t> ttl_seconds) {
+  auto pin = epochs_.pin();
+  const Layout& layout = current_layout();
+  size_t hash = KeyHash{}(key);
+  auto where = placement(layout, hash);
+  auto expire_at = ttl_seconds ? std::chrono::steady_clock::now() + std::chrono::seconds(*ttl_seconds) : kNoExpiry;
+  note_access(*layout.shards[where.home]);
+  std::unique_lock<SeqMutex> lock;
+  std::unique_lock<SeqMutex> second_lock;
+  lock_placement(layout, where, lock, second_lock);
+  write_locked(layout, where, key, hash, value, expire_at);
+  // Eviction takes shard locks itself, including this one.
+  lock = {};
+  second_lock = {};
+  relieve_memory_pressure();
+}
+
+// Called with the placement's shard locks held uniquely.
+void ShardedStore::write_locked(const Layout& layout, const Placement& where, std::string_view key, size_t hash,
+                                std::string_view value, std::chrono::steady_clock::time_point expire_at) {
   uint64_t version = ++version_;
-  size_t size = key.size() + value.size();
+  if (where.previous != where.home) {
+    // A copy still waiting in the old layout is superseded by this write.
+    auto& previous = *layout.shards[where.previous];
+    auto stale = previous.map.find_hashed(key, hash);
+    if (stale != previous.map.end()) {
+      remove_entry(previous, stale, version);
+    }
+  }
+  auto& shard = *layout.shards[where.home];
+  auto it = shard.map.find_hashed(key, hash);
   if (it == shard.map.end()) {
-    shard.lru.push_front(key);
-    Entry entry{std::move(value), version, expire_at, size, shard.lru.begin()};
-    shard.map.emplace(key, std::move(entry));
-    memory_usage_bytes_ += size;
+    Entry entry;
+    entry.version = version;
+    entry.expire_at = expire_at;
+    insert_entry(shard, hash, key, value, entry);
   } else {
-    memory_usage_bytes_ -= it->second.size_bytes;
-    it->second.value = std::move(value);
-    it->second.version = version;
-    it->second.expire_at = expire_at;
-    it->second.size_bytes = size;
-    touch(shard, key, it->second);
-    memory_usage_bytes_ += size;
+    Entry& entry = it->second;
+    discharge(shard, charge_of(it->first, entry));
+    // Readers only take references under the shared lock, so with the unique
+    // lock held a count of one means no reader holds the old value. A lock-free
+    // reader copying it meanwhile fails validation and retries. A value a
+    // snapshot may still read is never overwritten.
+    char* item = item_of(it->first);
+    if (item_refs(item) == 1 && !retains(entry) &&
+        arena_.resize_in_place(entry.size_class, item_bytes(key.size(), entry.value_size),
+                               item_bytes(key.size(), value.size()))) {
+      std::memcpy(item + kItemHeaderBytes + key.size(), value.data(), value.size());
+      entry.value_size = static_cast<uint32_t>(value.size());
+    } else {
+      std::string_view old_key = it->first;
+      Entry old_entry = entry;
+      it->first = store_item(shard, key, value, entry);
+      if (ordered_index_) {
+        shard.index.rebind(old_key, it->first);
+      }
+      retire_version(old_key, old_entry, version);
+    }
+    charge(shard, charge_of(it->first, entry));
+    entry.version = version;
+    entry.expire_at = expire_at;
+    schedule_expiry(shard, entry, hash);
+    mark_referenced(entry);
+    if (entry.policy_node != TinyLfuPolicy::kNoNode) {
+      shard.lfu.on_access(entry.policy_node);
+    }
   }
-  enforce_memory_budget();
+  account_overhead(shard);
 }
 
-bool ShardedStore::del(const std::string& key) {
-  std::shared_lock<std::shared_mutex> rebalance_lock(rebalance_mutex_);
-  auto& shard = shard_for(key);
-  std::unique_lock<std::shared_mutex> lock(shard.mutex);
-  auto it = shard.map.find(key);
-  if (it == shard.map.end()) {
-    return false;
+bool ShardedStore::del(std::string_view key) {
+  auto pin = epochs_.pin();
+  const Layout& layout = current_layout();
+  size_t hash = KeyHash{}(key);
+  auto where = placement(layout, hash);
+  note_access(*layout.shards[where.home]);
+  std::unique_lock<SeqMutex> lock;
+  std::unique_lock<SeqMutex> second_lock;
+  lock_placement(layout, where, lock, second_lock);
+  for (size_t index : {where.home, where.previous}) {
+    auto& shard = *layout.shards[index];
+    auto it = shard.map.find_hashed(key, hash);
+    if (it != shard.map.end()) {
+      // Deleting a value a snapshot may read takes a version of its own, so
+      // reads at older versions still find it.
+      remove_entry(shard, it, retains(it->second) ? ++version_ : 0);
+      return true;
+    }
   }
-  remove_entry(shard, key);
-  return true;
+  return false;
+}
+
+// Hashes each key once and orders the keys so that those behind the same shard
+// locks are adjacent, keeping request order among them.
+template <typename KeyAt>
+std::vector<ShardedStore::BatchKey> ShardedStore::group_by_shard(const Layout& layout, size_t count, KeyAt key_at) {
+  std::vector<BatchKey> batch(count);
+  for (size_t i = 0; i < count; ++i) {
+    size_t hash = KeyHash{}(key_at(i));
+    batch[i] = {hash, placement(layout, hash), i};
+  }
+  std::stable_sort(batch.begin(), batch.end(),
+                   [](const BatchKey& a, const BatchKey& b) { return lock_order(a.where) < lock_order(b.where); });
+  return batch;
+}
+
+// Runs `apply` on every key of `batch`, taking each group's shard locks once.
+// While it handles one key the map buckets of the next few are prefetched, so
+// their cache misses overlap instead of following each other.
+template <typename Lock, typename Apply>
+void ShardedStore::for_each_grouped(const Layout& layout, const std::vector<BatchKey>& batch, Apply&& apply) {
+  auto prefetch = [&](const BatchKey& next) { layout.shards[next.where.home]->map.prefetch(next.hash); };
+  for (size_t begin = 0; begin < batch.size();) {
+    size_t end = begin + 1;
+    while (end < batch.size() && lock_order(batch[end].where) == lock_order(batch[begin].where)) {
+      ++end;
+    }
+    note_access(*layout.shards[batch[begin].where.home], end - begin);
+    Lock lock;
+    Lock second_lock;
+    lock_placement(layout, batch[begin].where, lock, second_lock);
+    for (size_t i = begin; i < std::min(end, begin + kPrefetchDistance); ++i) {
+      prefetch(batch[i]);
+    }
+    for (size_t i = begin; i < end; ++i) {
+      if (i + kPrefetchDistance < end) {
+        prefetch(batch[i + kPrefetchDistance]);
+      }
+      apply(batch[i]);
+    }
+    begin = end;
+  }
+}
+
+std::vector<std::optional<ValueRef>> ShardedStore::get_many(const std::vector<std::string_view>& keys) {
+  auto pin = epochs_.pin();
+  const Layout& layout = current_layout();
+  auto batch = group_by_shard(layout, keys.size(), [&](size_t i) { return keys[i]; });
+  std::vector<std::optional<ValueRef>> results(keys.size());
+  std::vector<std::pair<Shard*, const BatchKey*>> expired;
+  auto now = std::chrono::steady_clock::now();
+  for_each_grouped<std::shared_lock<SeqMutex>>(layout, batch, [&](const BatchKey& item) {
+    Shard* shard = nullptr;
+    auto it = find_locked(layout, item.where, keys[item.index], item.hash, shard);
+    if (it == shard->map.end()) {
+      record_read(*layout.shards[item.where.home], nullptr, item.hash);
+      return;
+    }
+    const Entry& entry = it->second;
+    if (entry.expire_at != kNoExpiry && now >= entry.expire_at) {
+      record_read(*shard, nullptr, item.hash);
+      expired.emplace_back(shard, &item);
+      return;
+    }
+    record_read(*shard, &entry, item.hash);
+    results[item.index] = read_value(it->first, entry.value_size, entry.size_class);
+  });
+  for (const auto& [shard, item] : expired) {
+    remove_if_expired(*shard, keys[item->index], item->hash);
+  }
+  return results;
+}
+
+void ShardedStore::put_many(const std::vector<std::pair<std::string_view, std::string_view>>& items) {
+  auto pin = epochs_.pin();
+  const Layout& layout = current_layout();
+  auto batch = group_by_shard(layout, items.size(), [&](size_t i) { return items[i].first; });
+  for_each_grouped<std::unique_lock<SeqMutex>>(layout, batch, [&](const BatchKey& item) {
+    const auto& [key, value] = items[item.index];
+    write_locked(layout, item.where, key, item.hash, value, kNoExpiry);
+  });
+  relieve_memory_pressure();
+}
+
+namespace {
+
+// Length of the stretch of hash space expected to hold `count` of `keys`
+// uniformly hashed keys.
+uint64_t scan_span(size_t count, uint64_t keys) {
+  if (keys <= count) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  return std::numeric_limits<uint64_t>::max() / keys * std::max<size_t>(count, 1);
+}
+
+// Last hash of the stretch of `span` hashes from `first`, clamped to the end
+// of hash space. A span of the whole space always runs to the end.
+uint64_t span_end(uint64_t first, uint64_t span) {
+  constexpr uint64_t kEnd = std::numeric_limits<uint64_t>::max();
+  if (span == kEnd || span - 1 > kEnd - first) {
+    return kEnd;
+  }
+  return first + (span - 1);
+}
+
+} // namespace
+
+void ShardedStore::scan_shard(const Shard& shard, size_t low, size_t high, std::string_view prefix,
+                              std::chrono::steady_clock::time_point now, std::vector<std::string>& keys) const {
+  shard.map.for_each_in_hash_range(low, high, [&](const Map::value_type& slot) {
+    const Entry& entry = slot.second;
+    if ((entry.expire_at == kNoExpiry || now < entry.expire_at) && slot.first.starts_with(prefix)) {
+      keys.emplace_back(slot.first);
+    }
+  });
+}
+
+uint64_t ShardedStore::entry_count(const Layout& layout) const {
+  uint64_t entries = 0;
+  for (const Shard* shard : layout.shards) {
+    std::shared_lock<SeqMutex> lock(shard->mutex);
+    entries += shard->map.size();
+  }
+  return entries;
+}
+
+ScanPage ShardedStore::scan(uint64_t cursor, std::string_view prefix, size_t count) {
+  auto pin = epochs_.pin();
+  const Layout& layout = current_layout();
+  auto now = std::chrono::steady_clock::now();
+  ScanPage page;
+  auto range_end = [&](uint64_t keys) {
+    uint64_t last = span_end(cursor, scan_span(count, keys));
+    page.cursor = last == std::numeric_limits<uint64_t>::max() ? 0 : last + 1;
+    return last;
+  };
+  if (layout.home_count != layout.previous_count) {
+    // Keys are moving between shards, so one visited later could have come
+    // from one visited earlier. Holding every shard lock (in index order)
+    // freezes them for this step.
+    std::vector<std::shared_lock<SeqMutex>> locks;
+    locks.reserve(layout.shards.size());
+    uint64_t keys = 0;
+    for (Shard* shard : layout.shards) {
+      locks.emplace_back(shard->mutex);
+      keys += shard->map.size();
+    }
+    uint64_t last = range_end(keys);
+    for (Shard* shard : layout.shards) {
+      scan_shard(*shard, cursor, last, prefix, now, page.keys);
+    }
+    return page;
+  }
+  // Otherwise no key changes shard while this pin is held: a migration
+  // publishes its layouts, and waits out their grace periods, before it moves
+  // any key.
+  uint64_t last = range_end(entry_count(layout));
+  for (Shard* shard : layout.shards) {
+    std::shared_lock<SeqMutex> lock(shard->mutex);
+    scan_shard(*shard, cursor, last, prefix, now, page.keys);
+  }
+  return page;
+}
+
+std::vector<RangeItem> ShardedStore::range(std::string_view start, std::string_view end, size_t limit) {
+  if (!ordered_index_) {
+    throw std::runtime_error("ordered index is disabled");
+  }
+  std::vector<RangeItem> items;
+  // Each batch resumes after the last key of the one before.
+  std::string resume(start);
+  bool after_resume = false;
+  // Keys read from the indexes, with the shard that holds each.
+  std::vector<std::pair<std::string, size_t>> keys;
+  std::vector<std::optional<ValueRef>> values;
+  std::vector<size_t> by_shard;
+  while (items.size() < limit) {
+    size_t want = std::min(kRangeBatch, limit - items.size());
+    auto pin = epochs_.pin();
+    const Layout& layout = current_layout();
+    auto now = std::chrono::steady_clock::now();
+    // Outside a reshard no key changes shard while the pin is held, so each
+    // shard is locked on its own. During one, every shard stays locked for
+    // the batch, as in scan().
+    bool moving = layout.home_count != layout.previous_count;
+    std::vector<std::shared_lock<SeqMutex>> locks;
+    if (moving) {
+      locks.reserve(layout.shards.size());
+      for (Shard* shard : layout.shards) {
+        locks.emplace_back(shard->mutex);
+      }
+    }
+    auto lock_shard = [moving](const Shard& shard) {
+      return moving ? std::shared_lock<SeqMutex>() : std::shared_lock<SeqMutex>(shard.mutex);
+    };
+
+    // The batch is the first `want` keys of all shards, so no shard has to
+    // give more than that.
+    keys.clear();
+    bool exhausted = true;
+    for (size_t i = 0; i < layout.shards.size(); ++i) {
+      const Shard& shard = *layout.shards[i];
+      auto lock = lock_shard(shard);
+      uint32_t node = shard.index.lower_bound(resume);
+      if (after_resume && node != OrderedIndex::kNoNode && shard.index.key_of(node) == resume) {
+        node = shard.index.next(node);
+      }
+      size_t taken = 0;
+      for (; node != OrderedIndex::kNoNode && taken < want; node = shard.index.next(node), ++taken) {
+        std::string_view key = shard.index.key_of(node);
+        if (!end.empty() && key >= end) {
+          break;
+        }
+        keys.emplace_back(key, i);
+      }
+      if (taken == want) {
+        exhausted = false;
+      }
+    }
+    std::sort(keys.begin(), keys.end());
+    if (keys.size() > want) {
+      keys.resize(want);
+      exhausted = false;
+    }
+
+    // Values are read one shard at a time.
+    values.clear();
+    values.resize(keys.size());
+    by_shard.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      by_shard[i] = i;
+    }
+    std::stable_sort(by_shard.begin(), by_shard.end(),
+                     [&keys](size_t a, size_t b) { return keys[a].second < keys[b].second; });
+    for (size_t begin = 0; begin < by_shard.size();) {
+      size_t index = keys[by_shard[begin]].second;
+      Shard& shard = *layout.shards[index];
+      auto lock = lock_shard(shard);
+      for (; begin < by_shard.size() && keys[by_shard[begin]].second == index; ++begin) {
+        const std::string& key = keys[by_shard[begin]].first;
+        auto it = shard.map.find_hashed(key, KeyHash{}(key));
+        // Deleted since its key was read.
+        if (it == shard.map.end()) {
+          continue;
+        }
+        const Entry& entry = it->second;
+        if (entry.expire_at != kNoExpiry && now >= entry.expire_at) {
+          continue;
+        }
+        values[by_shard[begin]] = read_value(it->first, entry.value_size, entry.size_class);
+      }
+    }
+    if (keys.empty()) {
+      break;
+    }
+    resume = keys.back().first;
+    after_resume = true;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (values[i]) {
+        items.push_back({std::move(keys[i].first), std::move(*values[i])});
+      }
+    }
+    if (exhausted) {
+      break;
+    }
+  }
+  return items;
+}
+
+std::vector<RangeItem> ShardedStore::prefix(std::string_view prefix, size_t limit) {
+  // The smallest key above every key with the prefix: drop trailing 0xFF
+  // bytes and increment the last one left. None exists for an all-0xFF prefix.
+  std::string end(prefix);
+  while (!end.empty() && static_cast<unsigned char>(end.back()) == 0xFF) {
+    end.pop_back();
+  }
+  if (!end.empty()) {
+    end.back() = static_cast<char>(static_cast<unsigned char>(end.back()) + 1);
+  }
+  return range(prefix, end, limit);
 }
 
 uint64_t ShardedStore::current_version() const {
   return version_.load();
 }
 
+uint64_t ShardedStore::begin_snapshot() {
+  std::lock_guard<std::mutex> guard(snapshots_mutex_);
+  // A write that took its version before the snapshot's but checks
+  // retain_up_to_ after it is registered would drop a value the snapshot
+  // sees. So writes keep everything they replace until every operation
+  // already in flight has finished; the snapshot's version then covers all
+  // of those writes, and every later one sees it registered.
+  retain_up_to_.store(std::numeric_limits<uint64_t>::max());
+  epochs_.synchronize();
+  uint64_t version = version_.load();
+  snapshots_.insert(version);
+  retain_up_to_.store(*snapshots_.rbegin());
+  return version;
+}
+
+bool ShardedStore::end_snapshot(uint64_t version) {
+  std::lock_guard<std::mutex> guard(snapshots_mutex_);
+  auto it = snapshots_.find(version);
+  if (it == snapshots_.end()) {
+    return false;
+  }
+  snapshots_.erase(it);
+  retain_up_to_.store(snapshots_.empty() ? 0 : *snapshots_.rbegin());
+  return true;
+}
+
+// Frees old versions that no pinned snapshot can read: those with no pinned
+// version in [version, superseded). A snapshot pinned after this starts sees
+// none of them, since every version in the history was superseded before it.
+void ShardedStore::collect_versions() {
+  // Snapshots below the floor can no longer read anything, so they keep no
+  // versions alive either.
+  std::vector<uint64_t> pinned;
+  size_t snapshot_count = 0;
+  {
+    std::lock_guard<std::mutex> guard(snapshots_mutex_);
+    pinned.assign(snapshots_.lower_bound(history_floor_.load()), snapshots_.end());
+    snapshot_count = snapshots_.size();
+  }
+  std::lock_guard<std::mutex> guard(history_mutex_);
+  auto needed = [&pinned](const OldVersion& old) {
+    auto oldest_reader = std::lower_bound(pinned.begin(), pinned.end(), old.version);
+    return oldest_reader != pinned.end() && *oldest_reader < old.superseded;
+  };
+  for (auto it = history_.begin(); it != history_.end();) {
+    auto& chain = it->second;
+    size_t kept = 0;
+    for (const OldVersion& old : chain) {
+      if (needed(old)) {
+        chain[kept++] = old;
+        continue;
+      }
+      uint64_t bytes = charge_of(old);
+      history_bytes_ -= bytes;
+      --history_versions_;
+      memory_usage_bytes_ -= bytes;
+      drop_version(old);
+    }
+    chain.resize(kept);
+    if (chain.empty()) {
+      it = history_.erase(it);
+      continue;
+    }
+    it->first = chain.front().key;
+    ++it;
+  }
+  metrics_.set_version_stats(snapshot_count, history_versions_, history_bytes_);
+}
+
 std::vector<SnapshotItem> ShardedStore::snapshot(uint64_t version) {
-  std::shared_lock<std::shared_mutex> rebalance_lock(rebalance_mutex_);
   std::vector<SnapshotItem> items;
-  for (auto& shard : shards_) {
-    std::shared_lock<std::shared_mutex> lock(shard.mutex);
-    for (const auto& [key, entry] : shard.map) {
-      if (entry.version <= version) {
-        items.push_back({key, entry.value, entry.version, entry.expire_at});
+  SnapshotCursor cursor;
+  while (snapshot_step(version, cursor, items)) {
+  }
+  return items;
+}
+
+// Walks hash space as scan() does: every key lives at its own hash whichever
+// shard holds it, so each stretch copies every key in it exactly once, across
+// rehashes and reshards. The history is walked over the same stretch, under
+// the same shard locks, for keys deleted since `version`; a key still in its
+// shard has already been copied from there.
+bool ShardedStore::snapshot_step(uint64_t version, SnapshotCursor& cursor, std::vector<SnapshotItem>& items) {
+  if (cursor.done) {
+    return false;
+  }
+  auto pin = epochs_.pin();
+  const Layout& layout = current_layout();
+  auto append_old = [&](const OldVersion& old) {
+    auto expire_at = old.expire_at == kNoExpiry ? std::nullopt : std::optional(old.expire_at);
+    items.push_back({std::string(old.key), std::string(old.key.data() + old.key.size(), old.value_size), old.version,
+                     expire_at});
+  };
+  auto copy = [&](const Shard& shard, uint64_t last) {
+    shard.map.for_each_in_hash_range(cursor.hash, last, [&](const Map::value_type& slot) {
+      const Entry& entry = slot.second;
+      if (entry.version > version) {
+        std::lock_guard<std::mutex> guard(history_mutex_);
+        auto it = history_.find_hashed(slot.first, KeyHash{}(slot.first));
+        if (const OldVersion* old = it == history_.end() ? nullptr : version_at(it->second, version)) {
+          append_old(*old);
+          return;
+        }
+        // Created since `version`, unless the value it replaced was dropped
+        // at the retention limit; then the current one stands in.
+        if (history_floor_.load() <= version) {
+          return;
+        }
+      }
+      auto expire_at = entry.expire_at == kNoExpiry ? std::nullopt : std::optional(entry.expire_at);
+      items.push_back({std::string(slot.first), std::string(value_of(slot)), entry.version, expire_at});
+    });
+  };
+  // `gone` tells whether a key of the stretch is absent from the shards
+  // whose locks are held, rather than held by an unlocked one.
+  auto copy_deleted = [&](uint64_t last, auto&& gone) {
+    std::lock_guard<std::mutex> guard(history_mutex_);
+    history_.for_each_in_hash_range(cursor.hash, last, [&](const History::value_type& chain) {
+      if (!gone(chain.first, KeyHash{}(chain.first))) {
+        return;
+      }
+      if (const OldVersion* old = version_at(chain.second, version)) {
+        append_old(*old);
       }
+    });
+  };
+  uint64_t last = 0;
+  if (layout.home_count != layout.previous_count) {
+    // Keys are moving between shards; every shard lock freezes them for this
+    // step, as in scan().
+    std::vector<std::shared_lock<SeqMutex>> locks;
+    locks.reserve(layout.shards.size());
+    uint64_t entries = 0;
+    for (Shard* shard : layout.shards) {
+      locks.emplace_back(shard->mutex);
+      entries += shard->map.size();
+    }
+    last = span_end(cursor.hash, scan_span(kSnapshotBatch, entries));
+    for (Shard* shard : layout.shards) {
+      copy(*shard, last);
+    }
+    copy_deleted(last, [&](std::string_view key, size_t hash) {
+      auto where = placement(layout, hash);
+      for (size_t index : {where.home, where.previous}) {
+        Shard& shard = *layout.shards[index];
+        if (shard.map.find_hashed(key, hash) != shard.map.end()) {
+          return false;
+        }
+      }
+      return true;
+    });
+  } else {
+    // No key changes shard while the pin is held.
+    uint64_t entries = entry_count(layout);
+    if (cursor.hash == 0) {
+      // Growing by doubling would move every copy made so far in one step.
+      items.reserve(items.size() + entries + entries / 8);
+    }
+    last = span_end(cursor.hash, scan_span(kSnapshotBatch, entries));
+    for (size_t i = 0; i < layout.shards.size(); ++i) {
+      Shard& shard = *layout.shards[i];
+      std::shared_lock<SeqMutex> lock(shard.mutex);
+      copy(shard, last);
+      copy_deleted(last, [&](std::string_view key, size_t hash) {
+        return placement(layout, hash).home == i && shard.map.find_hashed(key, hash) == shard.map.end();
+      });
     }
   }
-  return items;
+  if (last == std::numeric_limits<uint64_t>::max()) {
+    cursor.done = true;
+    return false;
+  }
+  cursor.hash = last + 1;
+  return true;
 }
 
 void ShardedStore::restore(const std::vector<SnapshotItem>& items) {
-  std::unique_lock<std::shared_mutex> rebalance_lock(rebalance_mutex_);
+  auto pin = epochs_.pin();
+  const Layout& layout = current_layout();
   for (const auto& item : items) {
-    auto& shard = shard_for(item.key);
-    std::unique_lock<std::shared_mutex> lock(shard.mutex);
-    size_t size = item.key.size() + item.value.size();
-    shard.lru.push_front(item.key);
-    Entry entry{item.value, item.version, item.expire_at, size, shard.lru.begin()};
-    shard.map[item.key] = std::move(entry);
-    memory_usage_bytes_ += size;
+    size_t hash = KeyHash{}(item.key);
+    auto where = placement(layout, hash);
+    std::unique_lock<SeqMutex> lock;
+    std::unique_lock<SeqMutex> second_lock;
+    lock_placement(layout, where, lock, second_lock);
+    for (size_t index : {where.home, where.previous}) {
+      auto& holder = *layout.shards[index];
+      auto existing = holder.map.find_hashed(item.key, hash);
+      if (existing != holder.map.end()) {
+        remove_entry(holder, existing);
+      }
+    }
+    auto& shard = *layout.shards[where.home];
+    Entry entry;
+    entry.version = item.version;
+    entry.expire_at = item.expire_at.value_or(kNoExpiry);
+    insert_entry(shard, hash, item.key, item.value, entry);
+    account_overhead(shard);
     if (item.version > version_) {
       version_ = item.version;
     }
@@ -125,68 +1114,364 @@ void ShardedStore::restore(const std::vector<SnapshotItem>& items) {
   enforce_memory_budget();
 }
 
+// Frees the tables the shards' maps replaced since the last call, once no
+// optimistic reader can still be probing them. Must not be called while pinned.
+void ShardedStore::reclaim_tables() {
+  std::vector<Map::RetiredTable> retired;
+  {
+    auto pin = epochs_.pin();
+    for (Shard* shard : current_layout().shards) {
+      std::unique_lock<SeqMutex> lock(shard->mutex);
+      for (auto& table : shard->map.take_retired()) {
+        retired.push_back(std::move(table));
+      }
+    }
+  }
+  if (!retired.empty()) {
+    epochs_.synchronize();
+  }
+}
+
 void ShardedStore::expire_keys() {
-  std::shared_lock<std::shared_mutex> rebalance_lock(rebalance_mutex_);
-  auto now = std::chrono::steady_clock::now();
-  for (auto& shard : shards_) {
-    std::unique_lock<std::shared_mutex> lock(shard.mutex);
-    for (auto it = shard.map.begin(); it != shard.map.end();) {
-      if (it->second.expire_at && now >= *(it->second.expire_at)) {
-        memory_usage_bytes_ -= it->second.size_bytes;
-        shard.lru.erase(it->second.lru_it);
-        it = shard.map.erase(it);
+  size_t cursor = 0;
+  while (expire_step(cursor)) {
+  }
+}
+
+bool ShardedStore::expire_step(size_t& cursor) {
+  if (cursor == 0) {
+    reclaim_tables();
+    collect_versions();
+    cursor = 1;
+    return true;
+  }
+  auto pin = epochs_.pin();
+  const auto& shards = current_layout().shards;
+  if (cursor <= shards.size()) {
+    auto& shard = *shards[cursor - 1];
+    // A shard with more due keys than one batch takes several steps, so a
+    // burst of expirations cannot stall its writers for long.
+    std::vector<uint32_t> due;
+    due.reserve(kExpireBatch);
+    std::unique_lock<SeqMutex> lock(shard.mutex);
+    size_t collected = shard.timers.collect_due(std::chrono::steady_clock::now(), kExpireBatch, due);
+    for (uint32_t timer : due) {
+      auto it = shard.map.find_hashed_if(static_cast<size_t>(shard.timers.hash_of(timer)),
+                                         [timer](const auto& slot) { return slot.second.timer == timer; });
+      if (it != shard.map.end()) {
+        remove_entry(shard, it);
       } else {
-        ++it;
+        shard.timers.cancel(timer);
       }
     }
+    if (collected < kExpireBatch) {
+      ++cursor;
+    }
   }
+  if (cursor <= shards.size()) {
+    return true;
+  }
+  metrics_.set_memory_bytes(memory_usage_bytes_.load());
+  return false;
+}
+
+void ShardedStore::set_background_pool(ThreadPool* pool) {
+  background_pool_.store(pool);
 }
 
 void ShardedStore::enforce_memory_budget() {
-  std::shared_lock<std::shared_mutex> rebalance_lock(rebalance_mutex_);
-  while (memory_usage_bytes_.load() > memory_budget_bytes_) {
-    bool evicted = false;
-    for (auto& shard : shards_) {
-      std::unique_lock<std::shared_mutex> lock(shard.mutex);
-      if (!shard.lru.empty()) {
-        std::string key = shard.lru.back();
-        remove_entry(shard, key);
+  metrics_.record_inline_evictions(evict_to(memory_budget_bytes_));
+  metrics_.set_memory_bytes(memory_usage_bytes_.load());
+}
+
+// Evicts until memory use is at most `target` and returns the number of
+// entries evicted. Each shard's budget is an equal share of `target`: shards
+// over their share are drained down to it first, so cold entries leave every
+// shard rather than whichever one is visited first. Only if that is not
+// enough, e.g. because map tables count against the shares, are entries taken
+// one at a time from each shard in turn.
+uint64_t ShardedStore::evict_to(uint64_t target, size_t max_batches) {
+  auto pin = epochs_.pin();
+  const auto& shards = current_layout().shards;
+  uint64_t share = target / shards.size();
+  uint64_t evicted = 0;
+  size_t batches = 0;
+  auto over = [this, target, &batches, max_batches]() {
+    return batches < max_batches && memory_usage_bytes_.load() > target;
+  };
+  // Start at the next shard each time so ties are not always broken the same
+  // way.
+  size_t start = evict_cursor_.fetch_add(1, std::memory_order_relaxed);
+  for (size_t i = 0; i < shards.size() && over(); ++i) {
+    auto& shard = *shards[(start + i) % shards.size()];
+    // The lock is dropped between batches so writers to a shard being drained
+    // are not stalled for long.
+    size_t batch = kEvictBatch;
+    while (batch == kEvictBatch && shard.memory_bytes.load(std::memory_order_relaxed) > share && over()) {
+      std::unique_lock<SeqMutex> lock(shard.mutex);
+      for (batch = 0; batch < kEvictBatch && shard.memory_bytes.load(std::memory_order_relaxed) > share && over();
+           ++batch) {
+        if (!evict_one(shard)) {
+          break;
+        }
         metrics_.record_eviction();
-        evicted = true;
-        break;
       }
+      evicted += batch;
+      ++batches;
     }
-    if (!evicted) {
+  }
+  while (over()) {
+    ++batches;
+    bool progress = false;
+    for (size_t i = 0; i < shards.size() && over(); ++i) {
+      auto& shard = *shards[(start + i) % shards.size()];
+      std::unique_lock<SeqMutex> lock(shard.mutex);
+      if (evict_one(shard)) {
+        metrics_.record_eviction();
+        ++evicted;
+        progress = true;
+      }
+    }
+    if (!progress) {
       break;
     }
   }
-  metrics_.set_memory_bytes(memory_usage_bytes_.load());
+  return evicted;
+}
+
+// Called after a write with no shard lock held.
+void ShardedStore::relieve_memory_pressure() {
+  uint64_t usage = memory_usage_bytes_.load(std::memory_order_relaxed);
+  if (usage <= high_water_bytes_) {
+    return;
+  }
+  if (!evict_requested_.load(std::memory_order_relaxed) && !evict_requested_.exchange(true)) {
+    std::lock_guard<std::mutex> guard(evictor_mutex_);
+    evictor_cv_.notify_one();
+  }
+  // The evictor fell behind; this write pays for getting back under the hard
+  // limit, but no further.
+  if (usage > memory_budget_bytes_) {
+    metrics_.record_inline_evictions(evict_to(memory_budget_bytes_));
+  }
+}
+
+// Runs on the evictor thread for the store's lifetime.
+void ShardedStore::run_evictor() {
+  std::unique_lock<std::mutex> lock(evictor_mutex_);
+  while (true) {
+    evictor_cv_.wait(lock, [this]() { return stopping_.load() || evict_requested_.load(); });
+    if (stopping_) {
+      return;
+    }
+    evict_requested_ = false;
+    lock.unlock();
+    if (memory_usage_bytes_.load() > high_water_bytes_) {
+      ThreadPool* pool = background_pool_.load();
+      if (pool == nullptr) {
+        evict_to(low_water_bytes_);
+      } else {
+        // One batch per step; this thread only waits for the job to finish.
+        Completion<void> drained;
+        try {
+          pool->run_sliced([this]() { return !stopping_ && evict_to(low_water_bytes_, 1) > 0; }, drained);
+          drained.get();
+        } catch (const std::runtime_error&) {
+          // The pool is shutting down; writes still evict inline past the
+          // budget.
+        }
+      }
+      metrics_.set_memory_bytes(memory_usage_bytes_.load());
+    }
+    lock.lock();
+  }
 }
 
 uint64_t ShardedStore::memory_usage() const {
   return memory_usage_bytes_.load();
 }
 
-void ShardedStore::rebalance(uint32_t new_shard_count) {
-  if (new_shard_count == 0 || new_shard_count == shards_.size()) {
+void ShardedStore::refresh_memory_stats() {
+  metrics_.set_slab_stats(arena_.stats());
+  metrics_.set_memory_bytes(memory_usage_bytes_.load());
+  if (numa_placement_) {
+    std::vector<uint64_t> shards(arena_.nodes());
+    auto pin = epochs_.pin();
+    const Layout& layout = current_layout();
+    for (size_t i = 0; i < layout.home_count; ++i) {
+      ++shards[layout.shards[i]->node];
+    }
+    metrics_.set_numa_shards(std::move(shards));
+  }
+}
+
+int ShardedStore::home_node(std::string_view key) {
+  if (!numa_placement_) {
+    return -1;
+  }
+  auto pin = epochs_.pin();
+  const Layout& layout = current_layout();
+  return static_cast<int>(layout.shards[placement(layout, KeyHash{}(key)).home]->node);
+}
+
+size_t ShardedStore::home_shard(std::string_view key) {
+  auto pin = epochs_.pin();
+  return placement(current_layout(), KeyHash{}(key)).home;
+}
+
+bool ShardedStore::rebalance(uint32_t new_shard_count) {
+  if (new_shard_count == 0) {
+    return true;
+  }
+  new_shard_count = std::min(new_shard_count, kMaxShards);
+  std::lock_guard<std::mutex> guard(migration_mutex_);
+  if (migrating_) {
+    return false;
+  }
+  if (migrator_.joinable()) {
+    migrator_.join();
+  }
+  // No migration is running, so the layout cannot change under this read.
+  if (new_shard_count == layout_.load(std::memory_order_acquire)->home_count) {
+    return true;
+  }
+  migrating_ = true;
+  migrator_ = std::thread([this, new_shard_count]() { migrate(new_shard_count); });
+  return true;
+}
+
+// Runs on the migrator thread, which owns shards_ until it finishes. Operations
+// never block on a layout switch: each switch is published through layout_
+// and the migrator waits out a grace period before relying on it. Keys move
+// in small batches that lock just the two shards involved.
+//
+// Switching straight from the old layout to the new one would let an
+// operation still on the old layout miss a key that a new-layout write has
+// just placed at its new home. The first switch therefore keeps writes at the
+// old homes while reads already check both; only once every operation reads
+// both homes do writes move to the new ones.
+void ShardedStore::migrate(uint32_t target) {
+  uint32_t previous = layout_.load(std::memory_order_acquire)->home_count;
+  while (shards_.size() < target) {
+    add_shard();
+  }
+  size_t span = shards_.size();
+  publish(make_layout(span, previous, target));
+  publish(make_layout(span, target, previous));
+  metrics_.set_rebalance_progress(true, 0.0);
+
+  // Growing only moves keys out of the existing shards into the new ones;
+  // shrinking only empties the removed shards.
+  size_t first = target > previous ? 0 : target;
+  size_t last = previous;
+  SlotTable destinations = slot_table(target);
+  for (size_t source = first; source < last && !stopping_; ++source) {
+    migrate_shard(source, destinations);
+    metrics_.set_rebalance_progress(true, static_cast<double>(source - first + 1) / static_cast<double>(last - first));
+  }
+  if (stopping_) {
     return;
   }
-  std::unique_lock<std::shared_mutex> rebalance_lock(rebalance_mutex_);
-  std::vector<Shard> new_shards(new_shard_count);
-  for (auto& shard : shards_) {
-    std::unique_lock<std::shared_mutex> lock(shard.mutex);
-    for (auto& [key, entry] : shard.map) {
-      size_t idx = std::hash<std::string>{}(key) % new_shards.size();
-      auto& target = new_shards[idx];
-      std::unique_lock<std::shared_mutex> target_lock(target.mutex);
-      target.lru.push_front(key);
-      entry.lru_it = target.lru.begin();
-      target.map.emplace(key, std::move(entry));
-    }
-    shard.map.clear();
-    shard.lru.clear();
-  }
-  shards_ = std::move(new_shards);
+
+  // Once the final layout's grace period is over, nothing can reach the
+  // emptied shards any more.
+  publish(make_layout(target, target, target));
+  for (size_t i = target; i < shards_.size(); ++i) {
+    memory_usage_bytes_ -= shards_[i]->overhead_bytes;
+  }
+  shards_.resize(target);
+  metrics_.set_rebalance_progress(false, 1.0);
+  migrating_ = false;
+}
+
+// Moves every key of `source` whose home under the new layout is elsewhere.
+// The shard is scanned in slot order between lock acquisitions, so a rehash
+// caused by concurrent inserts can reorder it; scanning repeats until a full
+// pass finds nothing left to move. Writers only ever insert keys at their new
+// home, so the passes converge.
+void ShardedStore::migrate_shard(size_t source, const SlotTable& destinations) {
+  std::vector<std::pair<std::string, size_t>> batch;
+  std::vector<std::pair<std::string, size_t>> group;
+  bool found = true;
+  while (found && !stopping_) {
+    found = false;
+    size_t cursor = 0;
+    bool scanned = false;
+    while (!scanned && !stopping_) {
+      batch.clear();
+      {
+        auto& shard = *shards_[source];
+        std::shared_lock<SeqMutex> lock(shard.mutex);
+        size_t capacity = shard.map.capacity();
+        for (; cursor < capacity && batch.size() < kMigrateBatch; ++cursor) {
+          auto* slot = shard.map.slot_at(cursor);
+          if (slot == nullptr) {
+            continue;
+          }
+          size_t hash = KeyHash{}(slot->first);
+          if (destinations[slot_of(hash)] != source) {
+            batch.emplace_back(slot->first, hash);
+          }
+        }
+        scanned = cursor >= capacity;
+      }
+      if (batch.empty()) {
+        continue;
+      }
+      found = true;
+      // One lock acquisition per destination shard.
+      auto destination = [&destinations](const auto& key) { return destinations[slot_of(key.second)]; };
+      std::sort(batch.begin(), batch.end(),
+                [&destination](const auto& a, const auto& b) { return destination(a) < destination(b); });
+      size_t moved = 0;
+      for (size_t begin = 0; begin < batch.size();) {
+        size_t dest = destination(batch[begin]);
+        size_t end = begin;
+        group.clear();
+        while (end < batch.size() && destination(batch[end]) == dest) {
+          group.push_back(std::move(batch[end]));
+          ++end;
+        }
+        moved += move_keys(source, dest, group);
+        begin = end;
+      }
+      metrics_.record_rebalance_moved(moved);
+    }
+  }
+}
+
+// Returns the number of keys moved; keys deleted or rewritten at their new home
+// since the scan are skipped.
+size_t ShardedStore::move_keys(size_t source, size_t dest, const std::vector<std::pair<std::string, size_t>>& keys) {
+  std::unique_lock<SeqMutex> lock(shards_[std::min(source, dest)]->mutex);
+  std::unique_lock<SeqMutex> second_lock(shards_[std::max(source, dest)]->mutex);
+  auto& from = *shards_[source];
+  auto& to = *shards_[dest];
+  size_t moved = 0;
+  for (const auto& [key, hash] : keys) {
+    auto it = from.map.find_hashed(key, hash);
+    if (it == from.map.end()) {
+      continue;
+    }
+    // The chunk comes along unchanged; only the policy node and timer are
+    // per shard.
+    std::string_view stored = it->first;
+    Entry entry = it->second;
+    uint64_t bytes = charge_of(stored, entry);
+    from.memory_bytes.store(from.memory_bytes.load(std::memory_order_relaxed) - bytes, std::memory_order_relaxed);
+    to.memory_bytes.store(to.memory_bytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+    detach_entry(from, entry);
+    from.map.erase(it);
+    track_entry(to, entry, hash);
+    to.map.try_emplace_hashed(hash, stored, entry);
+    if (ordered_index_) {
+      from.index.erase(stored);
+      to.index.insert(stored);
+    }
+    ++moved;
+  }
+  account_overhead(to);
+  return moved;
 }
 
 } // namespace kvstore
@@ -1,15 +1,31 @@
 #pragma once
 
+#include "epoch.hpp"
+#include "eviction_policy.hpp"
+#include "flat_hash_map.hpp"
+#include "hash.hpp"
+#include "ordered_index.hpp"
+#include "slab_arena.hpp"
+#include "thread_pool.hpp"
+#include "timing_wheel.hpp"
+#include "value_ref.hpp"
 #include "metrics.hpp"
+#include "seq_mutex.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <cstdint>
-#include <list>
 #include <optional>
-#include <shared_mutex>
+#include <set>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
 namespace kvstore {
@@ -21,48 +37,388 @@ struct SnapshotItem {
   std::optional<std::chrono::steady_clock::time_point> expire_at;
 };
 
+// An entry returned by a range query.
+struct RangeItem {
+  std::string key;
+  ValueRef value;
+};
+
+// One step of a cursor scan.
+struct ScanPage {
+  std::vector<std::string> keys;
+  // Passed to the next call; 0 once the scan is complete.
+  uint64_t cursor = 0;
+};
+
+// Where snapshot_step() resumes: a position in hash space.
+struct SnapshotCursor {
+  uint64_t hash = 0;
+  bool done = false;
+};
+
 class ShardedStore {
  public:
-  ShardedStore(uint32_t shards, uint64_t memory_budget_bytes, Metrics& metrics);
+  // A background evictor starts once memory use passes `high_watermark` percent
+  // of the budget and evicts down to `low_watermark` percent; writes only evict
+  // inline once the budget itself is exceeded. Old versions kept for snapshots
+  // may use up to `version_retention_bytes` of the budget. With
+  // `ordered_index`, each shard also keeps its keys in order for range().
+  // With `numa_placement`, shard i's home is NUMA node i modulo the node
+  // count: its items live in slab pages bound to that node, and accesses are
+  // counted as local or remote to the node of the CPU making them.
+  ShardedStore(uint32_t shards, uint64_t memory_budget_bytes, Metrics& metrics,
+               EvictionPolicy policy = EvictionPolicy::kClock, bool huge_pages = false, uint32_t high_watermark = 90,
+               uint32_t low_watermark = 80, uint64_t version_retention_bytes = 64ULL * 1024 * 1024,
+               bool ordered_index = false, bool numa_placement = false);
+  ~ShardedStore();
+
+  ShardedStore(const ShardedStore&) = delete;
+  ShardedStore& operator=(const ShardedStore&) = delete;
 
-  std::optional<std::string> get(const std::string& key, std::optional<uint64_t> snapshot_version = std::nullopt);
-  void put(const std::string& key, std::string value, std::optional<uint32_t> ttl_seconds);
-  bool del(const std::string& key);
+  // Values of at least kShareValueBytes are returned by reference, without
+  // copying them or holding the shard lock while the caller uses them.
+  static constexpr size_t kShareValueBytes = 4096;
+
+  // With a snapshot version, returns the key's newest value written at or
+  // before it. Reads are exact for versions pinned by begin_snapshot(); once a
+  // version such a read needs has been dropped to stay within the retention
+  // limit or evicted, they throw std::runtime_error instead.
+  std::optional<ValueRef> get(std::string_view key, std::optional<uint64_t> snapshot_version = std::nullopt);
+  void put(std::string_view key, std::string_view value, std::optional<uint32_t> ttl_seconds);
+  bool del(std::string_view key);
+  // Multi-key forms of get() and put(). Keys are grouped by shard so each
+  // shard's locks are taken once per call, and results come back in request
+  // order. Not atomic: other operations may run between two shards' groups.
+  std::vector<std::optional<ValueRef>> get_many(const std::vector<std::string_view>& keys);
+  void put_many(const std::vector<std::pair<std::string_view, std::string_view>>& items);
+
+  // Returns about `count` keys starting with `prefix` and the cursor that
+  // continues after them; a scan starts at cursor 0. The cursor is a position
+  // in hash space, which fixes both a key's shard and its bucket, and each
+  // step covers the keys hashing into the next stretch of it. Every key that
+  // exists for the whole scan is returned at least once, across rehashes and
+  // resharding; keys written or removed meanwhile may or may not be. Each
+  // shard lock is held for one small batch per step.
+  ScanPage scan(uint64_t cursor, std::string_view prefix, size_t count);
+
+  // Live entries with `start` <= key < `end` in byte order, at most `limit`
+  // of them; an empty `end` means no upper bound. The shards' indexes are
+  // merged kRangeBatch entries at a time, and shard locks are only held for
+  // one batch, so a long query does not stall writers. Like SCAN, it returns
+  // every key present for its whole duration; keys written meanwhile may or
+  // may not appear. Throws std::runtime_error unless the store keeps an
+  // ordered index.
+  std::vector<RangeItem> range(std::string_view start, std::string_view end, size_t limit);
+  // Live entries whose key starts with `prefix`, in order.
+  std::vector<RangeItem> prefix(std::string_view prefix, size_t limit);
 
   uint64_t current_version() const;
+  // Pins the current version, so writes keep the values it can see until
+  // end_snapshot(), and returns it. Must not be called by an operation in
+  // progress on this store.
+  uint64_t begin_snapshot();
+  // Returns false if `version` is not pinned.
+  bool end_snapshot(uint64_t version);
+  // Copies the entries `version` sees. Entries written or deleted since are
+  // copied as they were at `version` while it is pinned by begin_snapshot()
+  // and the version retention limit has kept their old values; otherwise the
+  // current value stands in for an overwritten entry and a deleted one is
+  // left out.
   std::vector<SnapshotItem> snapshot(uint64_t version);
+  // One step of snapshot(): appends about kSnapshotBatch entries, those of
+  // every shard hashing into the next stretch of hash space, to `items` and
+  // advances `cursor`. Returns false once all of hash space has been copied.
+  bool snapshot_step(uint64_t version, SnapshotCursor& cursor, std::vector<SnapshotItem>& items);
   void restore(const std::vector<SnapshotItem>& items);
 
   void expire_keys();
+  // One step of expire_keys(): the first frees retired tables and versions,
+  // each later one removes at most one batch of due keys from one shard.
+  // Returns false once every shard has been visited; start with a cursor of 0.
+  bool expire_step(size_t& cursor);
+  // Runs the background evictor's work on `pool`'s background lane, in time
+  // slices that yield to client requests, instead of on its own thread. The
+  // pool must outlive the store.
+  void set_background_pool(ThreadPool* pool);
+  // Evicts inline until memory use is within the budget.
   void enforce_memory_budget();
+  // Counts every byte the store holds: slab chunks (not just the bytes
+  // requested from them) plus each shard's hash table, policy and timer nodes.
   uint64_t memory_usage() const;
-  void rebalance(uint32_t new_shard_count);
+  // Publishes per-slab-class usage, and shards per NUMA node, to the metrics.
+  void refresh_memory_stats();
+  // Home NUMA node of the shard `key` is written to, or -1 without NUMA
+  // placement.
+  int home_node(std::string_view key);
+  // Index of the shard `key` is written to. While a migration runs it can
+  // change from one call to the next.
+  size_t home_shard(std::string_view key);
+  // Starts migrating to `new_shard_count` shards in the background and
+  // returns immediately. Returns false if a migration is already running.
+  bool rebalance(uint32_t new_shard_count);
 
  private:
+  static constexpr std::chrono::steady_clock::time_point kNoExpiry = std::chrono::steady_clock::time_point::max();
+
+  // A reference count, the key bytes and the value bytes live in one slab
+  // chunk, and the map key is the only view of it: the key is stored once, and
+  // the entry holds just the value length. Recency and expiry links are indices into per-shard
+  // node pools, so an overwrite that fits its chunk allocates nothing. Fields
+  // are ordered to pack the entry into 32 bytes.
   struct Entry {
-    std::string value;
+    uint64_t version = 0;
+    std::chrono::steady_clock::time_point expire_at = kNoExpiry;
+    uint32_t value_size = 0;
+    // Node in the shard's TinyLFU policy; kNoNode under CLOCK.
+    uint32_t policy_node = TinyLfuPolicy::kNoNode;
+    // Node in the shard's timing wheel while the entry has a TTL.
+    uint32_t timer = TimingWheel::kNoTimer;
+    uint8_t size_class = 0;
+    // CLOCK reference bit. Readers set it through std::atomic_ref while holding
+    // only the shared shard lock, or none. The unique lock does not keep those
+    // readers out, so writers and the eviction hand go through atomic_ref too.
+    mutable uint8_t referenced = 1;
+  };
+
+  // A value that a write replaced or deleted while a snapshot could still read
+  // it. It keeps its chunk, and the store's reference to it, until no pinned
+  // version falls in [version, superseded).
+  struct OldVersion {
+    // Views the chunk like a map key.
+    std::string_view key;
     uint64_t version;
-    std::optional<std::chrono::steady_clock::time_point> expire_at;
-    size_t size_bytes;
-    std::list<std::string>::iterator lru_it;
+    uint64_t superseded;
+    std::chrono::steady_clock::time_point expire_at;
+    uint32_t value_size;
+    uint8_t size_class;
+  };
+
+  // Lets the shard maps be probed with a std::string_view without building a
+  // temporary std::string. Each operation hashes its key once: the low bits
+  // pick the shard and the high bits probe the shard map.
+  struct KeyHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view key) const { return static_cast<size_t>(hash_key(key)); }
+  };
+
+  struct KeyEqual {
+    using is_transparent = void;
+    bool operator()(std::string_view lhs, std::string_view rhs) const { return lhs == rhs; }
   };
 
+  using Map = FlatHashMap<std::string_view, Entry, KeyHash, KeyEqual>;
+  // Old versions of each key, oldest first; the map key views the first one's
+  // chunk.
+  using History = FlatHashMap<std::string_view, std::vector<OldVersion>, KeyHash, KeyEqual>;
+
+  // Under CLOCK, eviction is approximate LRU: a hand sweeps the map's slot
+  // array and evicts the first entry whose reference bit is clear, clearing
+  // set bits as it passes them. Under TinyLFU the shard's policy picks the
+  // victim. Readers only hold the shared lock, so they update the policy under
+  // `policy_mutex` and skip the update when another reader holds it; writers
+  // hold the unique lock and need no extra locking. Expirations are indexed
+  // in a timing wheel so expire_keys() only visits entries that are due, and
+  // with an ordered index every key is also linked into the shard's skip list
+  // under the same lock.
+  //
+  // Under CLOCK, GETs of small values take no lock at all: they probe the map
+  // optimistically and validate against the mutex's sequence number (see
+  // get_optimistic()). Tables replaced by a rehash are therefore only freed
+  // after an epoch grace period.
   struct Shard {
-    mutable std::shared_mutex mutex;
-    std::unordered_map<std::string, Entry> map;
-    std::list<std::string> lru;
+    Shard() { map.set_deferred_release(true); }
+
+    mutable SeqMutex mutex;
+    Map map;
+    size_t clock_hand = 0;
+    std::mutex policy_mutex;
+    TinyLfuPolicy lfu;
+    TimingWheel timers;
+    // Empty unless the store keeps an ordered index.
+    OrderedIndex index;
+    // Bytes of map, policy and timer storage currently charged to the budget.
+    size_t overhead_bytes = 0;
+    // Everything charged to this shard: its chunks plus overhead_bytes. Only
+    // changed under the unique lock; the evictor reads it without one.
+    std::atomic<uint64_t> memory_bytes{0};
+    // NUMA node whose slab pages hold the items this shard writes.
+    uint32_t node = 0;
   };
 
-  Shard& shard_for(const std::string& key);
-  const Shard& shard_for(const std::string& key) const;
-  void touch(Shard& shard, const std::string& key, Entry& entry);
-  void remove_entry(Shard& shard, const std::string& key);
+  // Most expired entries removed per shard lock acquisition.
+  static constexpr size_t kExpireBatch = 1024;
+  // Entries copied per call of snapshot_step().
+  static constexpr size_t kSnapshotBatch = 256;
+  // Most entries range() merges per round of shard locks.
+  static constexpr size_t kRangeBatch = 256;
+  // Most entries evicted per shard lock acquisition.
+  static constexpr size_t kEvictBatch = 64;
+  // Optimistic GET attempts before falling back to the shared lock.
+  static constexpr int kOptimisticAttempts = 3;
+  // How many keys ahead a multi-key operation prefetches map buckets.
+  static constexpr size_t kPrefetchDistance = 4;
+  // Most keys moved per shard pair lock acquisition while resharding.
+  static constexpr size_t kMigrateBatch = 256;
+
+  // Keys fall into kSlots slots by the low bits of their hash, and a layout
+  // maps each slot to a shard, so finding a key's shard is a mask and a table
+  // load. The tables are built with jump consistent hashing over slot numbers,
+  // so a reshard still moves only the slots whose shard changes. The map probes
+  // with bits 16 and up, which the slot never uses.
+  static constexpr size_t kSlotBits = 14;
+  static constexpr size_t kSlots = size_t{1} << kSlotBits;
+  static constexpr uint32_t kMaxShards = kSlots;
+  using SlotTable = std::vector<uint16_t>;
+
+  // Immutable shard table published to operations through layout_. Outside a
+  // migration both counts are equal; during one, keys are written at their
+  // home under `home_count` shards and may still be found at their home under
+  // `previous_count`. `shards` covers both.
+  struct Layout {
+    std::vector<Shard*> shards;
+    SlotTable home_slots;
+    SlotTable previous_slots;
+    uint32_t home_count;
+    uint32_t previous_count;
+  };
 
-  std::vector<Shard> shards_;
-  mutable std::shared_mutex rebalance_mutex_;
+  // Shards a key may live in under a layout. The two are the same for every
+  // key that does not move.
+  struct Placement {
+    size_t home;
+    size_t previous;
+  };
+
+  // One key of a multi-key operation, with its position in the request.
+  struct BatchKey {
+    size_t hash;
+    Placement where;
+    size_t index;
+  };
+
+  // Only valid while the calling thread holds a pin on epochs_.
+  const Layout& current_layout() const { return *layout_.load(std::memory_order_acquire); }
+  const Layout* make_layout(size_t shards, uint32_t home_count, uint32_t previous_count) const;
+  void publish(const Layout* layout);
+  static size_t slot_of(size_t hash) { return hash & (kSlots - 1); }
+  static SlotTable slot_table(uint32_t shards);
+  static Placement placement(const Layout& layout, size_t hash);
+  template <typename Lock>
+  void lock_placement(const Layout& layout, const Placement& placement, Lock& first, Lock& second);
+  // Placements with the same result are covered by the same shard locks.
+  static std::pair<size_t, size_t> lock_order(const Placement& placement) {
+    return std::minmax(placement.home, placement.previous);
+  }
+  template <typename KeyAt>
+  std::vector<BatchKey> group_by_shard(const Layout& layout, size_t count, KeyAt key_at);
+  template <typename Lock, typename Apply>
+  void for_each_grouped(const Layout& layout, const std::vector<BatchKey>& batch, Apply&& apply);
+  Map::iterator find_locked(const Layout& layout, const Placement& where, std::string_view key, size_t hash,
+                            Shard*& shard);
+  void write_locked(const Layout& layout, const Placement& where, std::string_view key, size_t hash,
+                    std::string_view value, std::chrono::steady_clock::time_point expire_at);
+
+  // The map key views its entry's chunk just past the reference count.
+  static char* item_of(std::string_view key) { return const_cast<char*>(key.data()) - kItemHeaderBytes; }
+  static size_t item_bytes(size_t key_size, size_t value_size) { return kItemHeaderBytes + key_size + value_size; }
+  static std::string_view value_of(const Map::value_type& slot) {
+    return {slot.first.data() + slot.first.size(), slot.second.value_size};
+  }
+  size_t charge_of(std::string_view key, const Entry& entry) const {
+    return arena_.footprint(item_bytes(key.size(), entry.value_size));
+  }
+  size_t charge_of(const OldVersion& old) const {
+    return arena_.footprint(item_bytes(old.key.size(), old.value_size)) + sizeof(OldVersion);
+  }
+  ValueRef read_value(std::string_view key, uint32_t value_size, uint8_t size_class);
+  void unref_item(std::string_view key, const Entry& entry);
+  std::string_view store_item(const Shard& shard, std::string_view key, std::string_view value, Entry& entry);
+  void add_shard();
+  void note_access(const Shard& shard, uint64_t count = 1);
+  void insert_entry(Shard& shard, size_t hash, std::string_view key, std::string_view value, Entry entry);
+  void charge(Shard& shard, uint64_t bytes);
+  void discharge(Shard& shard, uint64_t bytes);
+  void account_overhead(Shard& shard);
+  static void mark_referenced(const Entry& entry);
+  void record_read(Shard& shard, const Entry* entry, size_t hash);
+  void track_entry(Shard& shard, Entry& entry, size_t hash);
+  void schedule_expiry(Shard& shard, Entry& entry, size_t hash);
+  void release_entry(Shard& shard, std::string_view key, Entry& entry, uint64_t superseded = 0);
+  Map::iterator remove_entry(Shard& shard, Map::iterator it, uint64_t superseded = 0);
+  bool retains(const Entry& entry) const { return retain_up_to_.load() >= entry.version; }
+  void retire_version(std::string_view key, const Entry& entry, uint64_t superseded);
+  void drop_pinned_versions(uint64_t superseded);
+  void drop_version(const OldVersion& old);
+  std::optional<ValueRef> read_version(std::string_view key, size_t hash, uint64_t snapshot_version);
+  // The version of a history chain that `snapshot_version` sees, or null.
+  // Called with history_mutex_ held.
+  static const OldVersion* version_at(const std::vector<OldVersion>& chain, uint64_t snapshot_version);
+  void collect_versions();
+  void detach_entry(Shard& shard, Entry& entry);
+  void remove_if_expired(Shard& shard, std::string_view key, size_t hash);
+  bool evict_one(Shard& shard);
+  uint64_t evict_to(uint64_t target, size_t max_batches = std::numeric_limits<size_t>::max());
+  void relieve_memory_pressure();
+  void run_evictor();
+  bool get_optimistic(Shard& shard, std::string_view key, size_t hash, std::optional<ValueRef>& result);
+  // Entries in all of the layout's shards, each counted under its lock.
+  uint64_t entry_count(const Layout& layout) const;
+  void scan_shard(const Shard& shard, size_t low, size_t high, std::string_view prefix,
+                  std::chrono::steady_clock::time_point now, std::vector<std::string>& keys) const;
+  void reclaim_tables();
+  void migrate(uint32_t target);
+  void migrate_shard(size_t source, const SlotTable& destinations);
+  size_t move_keys(size_t source, size_t dest, const std::vector<std::pair<std::string, size_t>>& keys);
+
+  // Owns every shard; touched only by the constructor and the migrator.
+  // Operations reach shards through the published layout instead.
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<const Layout*> layout_{nullptr};
+  // Operations pin this instead of taking a store-wide lock, so the hot path
+  // writes no shared cache line.
+  EpochManager epochs_;
+  std::mutex migration_mutex_;
+  std::thread migrator_;
+  std::atomic<bool> migrating_{false};
+  std::atomic<bool> stopping_{false};
   uint64_t memory_budget_bytes_;
+  uint64_t high_water_bytes_;
+  uint64_t low_water_bytes_;
+  EvictionPolicy policy_;
+  bool ordered_index_;
+  bool numa_placement_;
+  // Shared by all shards so a size class's partly used pages are not
+  // duplicated per shard, and migrating a key never copies its bytes.
+  SlabArena arena_;
   std::atomic<uint64_t> memory_usage_bytes_{0};
   std::atomic<uint64_t> version_{0};
+
+  // Pinned snapshot versions; a version may be pinned more than once.
+  std::mutex snapshots_mutex_;
+  std::multiset<uint64_t> snapshots_;
+  // Newest pinned version, or 0 if none: a write keeps the value it replaces
+  // only if that value is not newer. begin_snapshot() raises it to the maximum
+  // while it waits for writes in flight.
+  std::atomic<uint64_t> retain_up_to_{0};
+  // Old versions of all shards. Only writes that replace a value a snapshot
+  // may need, and snapshot reads the newest value does not answer, take the
+  // lock, always after their shard locks.
+  std::mutex history_mutex_;
+  History history_;
+  uint64_t history_bytes_ = 0;
+  uint64_t history_versions_ = 0;
+  uint64_t history_limit_bytes_;
+  // Snapshot reads below this version fail: a version they may need was not
+  // kept because of the retention limit, or was evicted.
+  std::atomic<uint64_t> history_floor_{0};
+  std::atomic<size_t> evict_cursor_{0};
+  // Writers set evict_requested_ and wake the evictor through evictor_cv_;
+  // stopping_ is also set under evictor_mutex_ so the wakeup is not lost.
+  std::mutex evictor_mutex_;
+  std::condition_variable evictor_cv_;
+  std::atomic<bool> evict_requested_{false};
+  std::atomic<ThreadPool*> background_pool_{nullptr};
+  std::thread evictor_;
   Metrics& metrics_;
 };
 
@@ -1,12 +1,68 @@
 #include "thread_pool.hpp"
 
+#include "affinity.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+
 namespace kvstore {
 
-ThreadPool::ThreadPool(size_t threads, size_t max_queue_depth)
-    : max_queue_depth_(max_queue_depth) {
+namespace {
+
+// The pool whose worker runs on this thread, if any, and the worker's index.
+thread_local const void* current_pool = nullptr;
+thread_local size_t current_worker = 0;
+
+constexpr int64_t kNever = std::numeric_limits<int64_t>::max();
+
+int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+} // namespace
+
+ThreadPool::ThreadPool(size_t threads, size_t max_queue_depth, std::chrono::microseconds sojourn_target,
+                       std::chrono::milliseconds sojourn_interval, std::vector<std::vector<int>> worker_cpus)
+    : max_queue_depth_(std::max<size_t>(max_queue_depth, 1)),
+      slots_(std::make_unique<Task[]>(max_queue_depth_ * kPriorities)),
+      sojourn_target_ns_(std::chrono::duration_cast<std::chrono::nanoseconds>(sojourn_target).count()),
+      sojourn_interval_ns_(std::chrono::duration_cast<std::chrono::nanoseconds>(sojourn_interval).count()),
+      enqueued_at_(std::make_unique<int64_t[]>(max_queue_depth_)),
+      above_target_since_(kNever) {
+  for (size_t priority = 0; priority < kPriorities; ++priority) {
+    lanes_[priority] = std::make_unique<Lane>(max_queue_depth_);
+    for (size_t slot = 0; slot < max_queue_depth_; ++slot) {
+      lanes_[priority]->free_slots.try_push(static_cast<uint32_t>(priority * max_queue_depth_ + slot));
+    }
+  }
+  threads = std::max<size_t>(threads, 1);
   workers_.reserve(threads);
+  const CpuTopology& topology = CpuTopology::system();
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.push_back(std::make_unique<Worker>(max_queue_depth_));
+    Worker& worker = *workers_.back();
+    if (!worker_cpus.empty()) {
+      worker.cpus = worker_cpus[i % worker_cpus.size()];
+      worker.node = worker.cpus.empty() ? -1 : topology.node_of(worker.cpus.front());
+    }
+    if (worker.node >= 0) {
+      if (node_workers_.size() <= static_cast<size_t>(worker.node)) {
+        node_workers_.resize(static_cast<size_t>(worker.node) + 1);
+      }
+      node_workers_[static_cast<size_t>(worker.node)].push_back(static_cast<uint32_t>(i));
+    }
+  }
+  for (size_t i = 0; i < threads; ++i) {
+    for (size_t step = 1; step < threads; ++step) {
+      workers_[i]->victims.push_back(static_cast<uint32_t>((i + step) % threads));
+    }
+    std::stable_partition(workers_[i]->victims.begin(), workers_[i]->victims.end(),
+                          [&](uint32_t victim) { return workers_[victim]->node == workers_[i]->node; });
+  }
   for (size_t i = 0; i < threads; ++i) {
-    workers_.emplace_back([this]() { worker(); });
+    workers_[i]->thread = std::thread([this, i]() { worker(i); });
   }
 }
 
@@ -15,35 +71,234 @@ ThreadPool::~ThreadPool() {
 }
 
 void ThreadPool::shutdown() {
-  {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (shutdown_) {
-      return;
+  if (shutdown_.exchange(true)) {
+    return;
+  }
+  wake_epoch_.fetch_add(1);
+  wake_epoch_.notify_all();
+  for (auto& lane : lanes_) {
+    lane->free_epoch.fetch_add(1);
+    lane->free_epoch.notify_all();
+  }
+  for (auto& worker : workers_) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
     }
-    shutdown_ = true;
   }
-  not_empty_.notify_all();
-  not_full_.notify_all();
-  for (auto& worker_thread : workers_) {
-    if (worker_thread.joinable()) {
-      worker_thread.join();
+}
+
+bool ThreadPool::enqueue(Task task, TaskPriority priority, bool wait, int node) {
+  submitting_.fetch_add(1);
+  if (shutdown_.load()) {
+    submitting_.fetch_sub(1);
+    throw std::runtime_error("thread pool is shutting down");
+  }
+  Lane& lane = *lanes_[static_cast<size_t>(priority)];
+  uint32_t slot = 0;
+  try {
+    slot = acquire_slot(lane, wait);
+  } catch (...) {
+    submitting_.fetch_sub(1);
+    throw;
+  }
+  if (slot == WorkStealingDeque::kEmpty) {
+    submitting_.fetch_sub(1);
+    return false;
+  }
+  slots_[slot] = std::move(task);
+  if (sojourn_target_ns_ > 0 && priority == TaskPriority::kForeground) {
+    enqueued_at_[slot] = now_ns();
+  }
+  // A queue never holds more ids than its priority has slots, so no push can
+  // overflow.
+  if (priority != TaskPriority::kForeground) {
+    lane.queue.try_push(slot);
+  } else if (current_pool == this) {
+    workers_[current_worker]->deque.push(slot);
+  } else if (node >= 0 && static_cast<size_t>(node) < node_workers_.size() &&
+             !node_workers_[static_cast<size_t>(node)].empty()) {
+    const auto& local = node_workers_[static_cast<size_t>(node)];
+    thread_local size_t spread_local = 0;
+    workers_[local[spread_local++ % local.size()]]->inbox.try_push(slot);
+  } else {
+    thread_local size_t spread = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    workers_[spread++ % workers_.size()]->inbox.try_push(slot);
+  }
+  submitting_.fetch_sub(1);
+  wake_one();
+  return true;
+}
+
+// Returns WorkStealingDeque::kEmpty if `wait` is false and no slot is free.
+uint32_t ThreadPool::acquire_slot(Lane& lane, bool wait) {
+  uint32_t slot = 0;
+  for (int round = 0; round < kSpinRounds; ++round) {
+    if (lane.free_slots.try_pop(slot)) {
+      return slot;
+    }
+    if (!wait) {
+      return WorkStealingDeque::kEmpty;
+    }
+    std::this_thread::yield();
+  }
+  lane.blocked_submitters.fetch_add(1);
+  while (true) {
+    uint32_t epoch = lane.free_epoch.load();
+    if (lane.free_slots.try_pop(slot)) {
+      break;
     }
+    if (shutdown_.load()) {
+      lane.blocked_submitters.fetch_sub(1);
+      throw std::runtime_error("thread pool is shutting down");
+    }
+    lane.free_epoch.wait(epoch);
   }
+  lane.blocked_submitters.fetch_sub(1);
+  return slot;
 }
 
-void ThreadPool::worker() {
+void ThreadPool::release_slot(uint32_t slot) {
+  Lane& lane = *lanes_[slot / max_queue_depth_];
+  lane.free_slots.try_push(slot);
+  // Pairs with the increment in acquire_slot(): either a blocked submitter
+  // is counted here or its next try_pop() finds the slot.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (lane.blocked_submitters.load(std::memory_order_relaxed) > 0) {
+    lane.free_epoch.fetch_add(1);
+    lane.free_epoch.notify_one();
+  }
+}
+
+void ThreadPool::wake_one() {
+  // Pairs with the increment of sleepers_ in worker(): either a parking worker
+  // is counted here or its last look for work finds the task.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load(std::memory_order_relaxed) > 0) {
+    wake_epoch_.fetch_add(1);
+    wake_epoch_.notify_one();
+  }
+}
+
+bool ThreadPool::overloaded() const {
+  // An empty queue ends an overload even though no dequeue saw it end.
+  return overloaded_.load(std::memory_order_relaxed) && foreground_waiting();
+}
+
+// CoDel's test: the pool is overloaded once the shortest wait over a whole
+// interval was above the target, i.e. once every task dequeued in that time
+// waited too long. The shared words are only written when the state changes.
+void ThreadPool::observe_sojourn(uint32_t slot) {
+  int64_t now = now_ns();
+  if (now - enqueued_at_[slot] < sojourn_target_ns_) {
+    if (above_target_since_.load(std::memory_order_relaxed) != kNever) {
+      above_target_since_.store(kNever, std::memory_order_relaxed);
+    }
+    if (overloaded_.load(std::memory_order_relaxed)) {
+      overloaded_.store(false, std::memory_order_relaxed);
+    }
+    return;
+  }
+  int64_t since = above_target_since_.load(std::memory_order_relaxed);
+  if (since == kNever) {
+    above_target_since_.compare_exchange_strong(since, now, std::memory_order_relaxed);
+  } else if (now - since >= sojourn_interval_ns_ && !overloaded_.load(std::memory_order_relaxed)) {
+    overloaded_.store(true, std::memory_order_relaxed);
+  }
+}
+
+bool ThreadPool::foreground_waiting() const {
+  for (const auto& worker : workers_) {
+    if (!worker->deque.empty() || !worker->inbox.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t ThreadPool::find_foreground(size_t self) {
+  Worker& own = *workers_[self];
+  uint32_t slot = own.deque.pop();
+  if (slot != WorkStealingDeque::kEmpty || own.inbox.try_pop(slot)) {
+    return slot;
+  }
+  for (uint32_t index : own.victims) {
+    Worker& victim = *workers_[index];
+    slot = victim.deque.steal();
+    if (slot != WorkStealingDeque::kEmpty || victim.inbox.try_pop(slot)) {
+      return slot;
+    }
+  }
+  return WorkStealingDeque::kEmpty;
+}
+
+// The oldest batch task, or else the oldest background task.
+uint32_t ThreadPool::find_deferred() {
+  uint32_t slot = 0;
+  for (size_t priority = 1; priority < kPriorities; ++priority) {
+    if (lanes_[priority]->queue.try_pop(slot)) {
+      return slot;
+    }
+  }
+  return WorkStealingDeque::kEmpty;
+}
+
+// `foreground_run` counts the foreground tasks this worker has taken in a row;
+// once it reaches kFairnessInterval, waiting batch or background work goes
+// first.
+uint32_t ThreadPool::find_task(size_t self, int& foreground_run) {
+  uint32_t slot = WorkStealingDeque::kEmpty;
+  bool fair = foreground_run < kFairnessInterval;
+  if (fair && (slot = find_foreground(self)) != WorkStealingDeque::kEmpty) {
+    ++foreground_run;
+    return slot;
+  }
+  if ((slot = find_deferred()) != WorkStealingDeque::kEmpty) {
+    foreground_run = 0;
+    return slot;
+  }
+  if (!fair && (slot = find_foreground(self)) != WorkStealingDeque::kEmpty) {
+    ++foreground_run;
+  }
+  return slot;
+}
+
+void ThreadPool::worker(size_t self) {
+  current_pool = this;
+  current_worker = self;
+  pin_current_thread(workers_[self]->cpus);
+  int idle = 0;
+  int foreground_run = 0;
   while (true) {
-    std::function<void()> task;
-    {
-      std::unique_lock<std::mutex> lock(mutex_);
-      not_empty_.wait(lock, [this] { return shutdown_ || !queue_.empty(); });
-      if (shutdown_ && queue_.empty()) {
-        return;
+    uint32_t slot = find_task(self, foreground_run);
+    if (slot == WorkStealingDeque::kEmpty && ++idle >= kSpinRounds) {
+      idle = 0;
+      uint32_t epoch = wake_epoch_.load();
+      sleepers_.fetch_add(1);
+      slot = find_task(self, foreground_run);
+      // A worker only leaves once its own deque and inbox are empty and no
+      // submission can still reach them; stolen work is run by the thief.
+      if (slot == WorkStealingDeque::kEmpty && shutdown_.load() && submitting_.load() == 0) {
+        slot = find_task(self, foreground_run);
+        if (slot == WorkStealingDeque::kEmpty) {
+          sleepers_.fetch_sub(1);
+          return;
+        }
+      }
+      if (slot == WorkStealingDeque::kEmpty && !shutdown_.load()) {
+        wake_epoch_.wait(epoch);
       }
-      task = std::move(queue_.front());
-      queue_.pop();
+      sleepers_.fetch_sub(1);
+    }
+    if (slot == WorkStealingDeque::kEmpty) {
+      std::this_thread::yield();
+      continue;
+    }
+    idle = 0;
+    if (sojourn_target_ns_ > 0 && slot < max_queue_depth_) {
+      observe_sojourn(slot);
     }
-    not_full_.notify_one();
+    Task task = std::move(slots_[slot]);
+    release_slot(slot);
     task();
   }
 }
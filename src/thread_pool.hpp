@@ -1,53 +1,395 @@
 #pragma once
 
-#include <condition_variable>
+#include "work_queue.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
-#include <functional>
-#include <future>
-#include <mutex>
-#include <queue>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace kvstore {
 
+// Move-only type-erased callable. Callables of up to kInlineBytes that can be
+// moved without throwing are stored inline, so wrapping a typical lambda
+// allocates nothing; larger ones fall back to the heap.
+class Task {
+ public:
+  static constexpr size_t kInlineBytes = 64;
+
+  Task() = default;
+
+  template <typename Fn, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Fn>, Task>>>
+  Task(Fn&& fn) {
+    using Callable = std::decay_t<Fn>;
+    if constexpr (sizeof(Callable) <= kInlineBytes && alignof(Callable) <= alignof(std::max_align_t) &&
+                  std::is_nothrow_move_constructible_v<Callable>) {
+      new (storage_) Callable(std::forward<Fn>(fn));
+      ops_ = &kInlineOps<Callable>;
+    } else {
+      new (storage_) Callable*(new Callable(std::forward<Fn>(fn)));
+      ops_ = &kHeapOps<Callable>;
+    }
+  }
+
+  Task(Task&& other) noexcept { take(other); }
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      reset();
+      take(other);
+    }
+    return *this;
+  }
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task() { reset(); }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+  void operator()() { ops_->invoke(storage_); }
+
+  void reset() {
+    if (ops_ != nullptr) {
+      ops_->destroy(storage_);
+      ops_ = nullptr;
+    }
+  }
+
+ private:
+  struct Ops {
+    void (*invoke)(void* storage);
+    // Move-constructs into `to` and destroys the source.
+    void (*relocate)(void* from, void* to);
+    void (*destroy)(void* storage);
+  };
+
+  template <typename Callable>
+  static constexpr Ops kInlineOps{
+      [](void* storage) { (*std::launder(static_cast<Callable*>(storage)))(); },
+      [](void* from, void* to) {
+        Callable* source = std::launder(static_cast<Callable*>(from));
+        new (to) Callable(std::move(*source));
+        source->~Callable();
+      },
+      [](void* storage) { std::launder(static_cast<Callable*>(storage))->~Callable(); },
+  };
+
+  template <typename Callable>
+  static constexpr Ops kHeapOps{
+      [](void* storage) { (**std::launder(static_cast<Callable**>(storage)))(); },
+      [](void* from, void* to) { new (to) Callable*(*std::launder(static_cast<Callable**>(from))); },
+      [](void* storage) { delete *std::launder(static_cast<Callable**>(storage)); },
+  };
+
+  void take(Task& other) {
+    if (other.ops_ != nullptr) {
+      other.ops_->relocate(other.storage_, storage_);
+      ops_ = std::exchange(other.ops_, nullptr);
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char storage_[kInlineBytes];
+  const Ops* ops_ = nullptr;
+};
+
+// One-shot result slot a submitter waits on instead of a std::future. It
+// lives wherever the submitter puts it, usually its stack, so completing a
+// task allocates nothing; waiting spins briefly and then blocks in
+// std::atomic::wait (a futex on Linux). The waiter may destroy it as soon as
+// wait() returns, so wait() returns only once the finishing thread has stopped
+// touching it: finish() moves state_ from kPending to kFinishing, wakes the
+// waiter and only then to kNotified.
+template <typename Result>
+class Completion {
+ public:
+  Completion() = default;
+  Completion(const Completion&) = delete;
+  Completion& operator=(const Completion&) = delete;
+
+  // Waits for the task, then returns its result or rethrows its exception.
+  Result get() {
+    wait();
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    if constexpr (!std::is_void_v<Result>) {
+      return std::move(*value_);
+    }
+  }
+
+  void wait() {
+    for (int spin = 0; spin < kSpins && !done(); ++spin) {
+      std::this_thread::yield();
+    }
+    while (!done()) {
+      // Past kPending the finisher is a notify call away from kNotified.
+      if (state_.load(std::memory_order_acquire) == kPending) {
+        state_.wait(kPending, std::memory_order_acquire);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  bool done() const { return state_.load(std::memory_order_acquire) == kNotified; }
+
+ private:
+  friend class ThreadPool;
+
+  static constexpr int kSpins = 16;
+  static constexpr uint8_t kPending = 0;
+  static constexpr uint8_t kFinishing = 1;
+  static constexpr uint8_t kNotified = 2;
+
+  template <typename Fn>
+  void run(Fn& fn) noexcept {
+    try {
+      if constexpr (std::is_void_v<Result>) {
+        fn();
+      } else {
+        value_.emplace(fn());
+      }
+    } catch (...) {
+      error_ = std::current_exception();
+    }
+    finish();
+  }
+
+  void finish(std::exception_ptr error = nullptr) noexcept {
+    if (error) {
+      error_ = std::move(error);
+    }
+    state_.store(kFinishing, std::memory_order_release);
+    state_.notify_one();
+    state_.store(kNotified, std::memory_order_release);
+  }
+
+  using Stored = std::conditional_t<std::is_void_v<Result>, char, Result>;
+  std::optional<Stored> value_;
+  std::exception_ptr error_;
+  std::atomic<uint8_t> state_{kPending};
+};
+
+// What a Completion holds when its task was still queued past its deadline
+// and never ran.
+class TaskExpired : public std::runtime_error {
+ public:
+  TaskExpired() : std::runtime_error("task expired in queue") {}
+};
+
+// Foreground is for client requests. Batch and background work only runs when
+// no foreground task is waiting, except that a worker takes one of them after
+// every kFairnessInterval foreground tasks so it cannot be starved outright.
+enum class TaskPriority : uint8_t { kForeground, kBatch, kBackground };
+
+// Work-stealing pool. Each worker owns a Chase-Lev deque for tasks submitted
+// from inside the pool and a lock-free inbox for tasks submitted from outside
+// it; each outside thread spreads its submissions over the inboxes round
+// robin. A worker runs its own deque newest first, then its inbox, then steals
+// from the other workers, so no lock is shared by submitters and workers.
+//
+// Foreground tasks go through those queues; batch and background tasks each
+// have one shared lock-free queue that workers look at once no foreground
+// task is left.
+//
+// Queued tasks live in a preallocated array of max_queue_depth slots per
+// priority whose free ids sit in a lock-free queue. A submitter that finds no
+// free slot waits until a worker dequeues a task of the same priority, which
+// keeps the bounded-queue back-pressure. Workers with nothing to run spin
+// briefly and then park; submitters only touch the parking word when some
+// worker is parked.
+//
+// With a nonzero sojourn target the pool also runs CoDel-style admission
+// control for foreground tasks: workers time how long each one waited, and
+// once every task dequeued for a whole interval waited longer than the
+// target, try_submit() refuses new work until one waits less again or the
+// queue empties.
+//
+// Worker i can be pinned to worker_cpus[i % worker_cpus.size()]. Pinned
+// workers belong to the NUMA node of their CPUs: a submission naming a node
+// goes to the inbox of one of its workers, and idle workers steal from their
+// own node before the others.
 class ThreadPool {
  public:
-  ThreadPool(size_t threads, size_t max_queue_depth);
+  ThreadPool(size_t threads, size_t max_queue_depth, std::chrono::microseconds sojourn_target = {},
+             std::chrono::milliseconds sojourn_interval = std::chrono::milliseconds(100),
+             std::vector<std::vector<int>> worker_cpus = {});
   ~ThreadPool();
 
   ThreadPool(const ThreadPool&) = delete;
   ThreadPool& operator=(const ThreadPool&) = delete;
 
-  template <typename Fn>
-  auto submit(Fn&& fn) -> std::future<decltype(fn())> {
-    using Result = decltype(fn());
-    auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Fn>(fn));
-    std::future<Result> future = task->get_future();
-    {
-      std::unique_lock<std::mutex> lock(mutex_);
-      not_full_.wait(lock, [this] { return shutdown_ || queue_.size() < max_queue_depth_; });
-      if (shutdown_) {
-        throw std::runtime_error("thread pool is shutting down");
-      }
-      queue_.emplace([task]() { (*task)(); });
+  // Runs `fn` on a worker and stores its result, or the exception it threw, in
+  // `done`, which must outlive the task. Blocks while the queue is full and
+  // throws std::runtime_error once the pool is shutting down. A foreground
+  // task submitted from outside the pool with a `node` prefers that node's
+  // workers.
+  template <typename Fn, typename Result>
+  void submit(Fn&& fn, Completion<Result>& done, TaskPriority priority = TaskPriority::kForeground,
+              int node = -1) {
+    enqueue(Task([fn = std::forward<Fn>(fn), &done]() mutable { done.run(fn); }), priority, true, node);
+  }
+
+  // Queues `fn` in the foreground unless the pool is overloaded or full, and
+  // returns whether it did; never blocks. If the task is still queued at
+  // `deadline` it is dropped and `done` holds TaskExpired instead.
+  template <typename Fn, typename Result>
+  bool try_submit(Fn&& fn, Completion<Result>& done,
+                  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(),
+                  int node = -1) {
+    if (overloaded()) {
+      return false;
     }
-    not_empty_.notify_one();
-    return future;
+    return enqueue(Task([fn = std::forward<Fn>(fn), &done, deadline]() mutable {
+                     if (deadline != std::chrono::steady_clock::time_point::max() &&
+                         std::chrono::steady_clock::now() >= deadline) {
+                       done.finish(std::make_exception_ptr(TaskExpired()));
+                     } else {
+                       done.run(fn);
+                     }
+                   }),
+                   TaskPriority::kForeground, false, node);
   }
 
+  // Fire and forget; `fn` must not throw.
+  template <typename Fn>
+  void post(Fn&& fn, TaskPriority priority = TaskPriority::kForeground) {
+    enqueue(Task(std::forward<Fn>(fn)), priority);
+  }
+
+  // Runs a long job as a series of short steps: `step` does a bounded amount
+  // of work and returns true while more remains. After every step in which a
+  // foreground task is waiting, the job queues itself again at `priority` and
+  // gives its worker back; otherwise it yields the CPU every kSliceTime.
+  // `done` completes after the last step or the first exception.
+  template <typename Step>
+  void run_sliced(Step step, Completion<void>& done, TaskPriority priority = TaskPriority::kBackground) {
+    enqueue(Task(SlicedJob<Step>{this, std::move(step), &done, priority}), priority);
+  }
+
+  // True if some foreground task is queued and not yet running; may be stale
+  // by the time the caller acts on it.
+  bool foreground_waiting() const;
+  // True while admission control is refusing foreground work.
+  bool overloaded() const;
+
   void shutdown();
 
+  static constexpr auto kSliceTime = std::chrono::microseconds(100);
+  // Foreground tasks a worker runs in a row while batch or background work
+  // is waiting.
+  static constexpr int kFairnessInterval = 64;
+
  private:
-  void worker();
+  static constexpr size_t kPriorities = 3;
+
+  template <typename Step>
+  struct SlicedJob {
+    void operator()() {
+      // Requeueing moves this job out of the task that is running it, so
+      // nothing after that may touch its members.
+      ThreadPool* owner = pool;
+      Completion<void>* completion = done;
+      TaskPriority lane = priority;
+      auto deadline = std::chrono::steady_clock::now() + kSliceTime;
+      try {
+        while (step()) {
+          if (owner->foreground_waiting()) {
+            owner->enqueue(Task(std::move(*this)), lane);
+            return;
+          }
+          // Requeueing here would only hand the job to another idle worker;
+          // yielding instead lets threads about to submit requests run when
+          // there are fewer cores than runnable threads.
+          if (std::chrono::steady_clock::now() >= deadline) {
+            std::this_thread::yield();
+            deadline = std::chrono::steady_clock::now() + kSliceTime;
+          }
+        }
+      } catch (...) {
+        completion->finish(std::current_exception());
+        return;
+      }
+      completion->finish();
+    }
+
+    ThreadPool* pool;
+    Step step;
+    Completion<void>* done;
+    TaskPriority priority;
+  };
+
+  // Slots for tasks of one priority, and for batch and background tasks the
+  // queue they wait in.
+  struct Lane {
+    explicit Lane(size_t capacity) : free_slots(capacity), queue(capacity) {}
+
+    BoundedQueue<uint32_t> free_slots;
+    BoundedQueue<uint32_t> queue;
+    // Submitters blocked on back-pressure wait for free_epoch to change.
+    std::atomic<uint32_t> free_epoch{0};
+    std::atomic<uint32_t> blocked_submitters{0};
+  };
+
+  struct Worker {
+    explicit Worker(size_t capacity) : deque(capacity), inbox(capacity) {}
+
+    WorkStealingDeque deque;
+    BoundedQueue<uint32_t> inbox;
+    std::thread thread;
+    // Empty if the worker is not pinned, in which case its node is -1.
+    std::vector<int> cpus;
+    int node = -1;
+    // Workers to steal from, those on the same node first.
+    std::vector<uint32_t> victims;
+  };
+
+  // Rounds of looking for work before a worker parks.
+  static constexpr int kSpinRounds = 64;
+
+  // Returns false, without queueing, if `wait` is false and no slot is free.
+  bool enqueue(Task task, TaskPriority priority, bool wait = true, int node = -1);
+  uint32_t acquire_slot(Lane& lane, bool wait);
+  void observe_sojourn(uint32_t slot);
+  void release_slot(uint32_t slot);
+  uint32_t find_foreground(size_t self);
+  uint32_t find_deferred();
+  uint32_t find_task(size_t self, int& foreground_run);
+  void wake_one();
+  void worker(size_t self);
 
   size_t max_queue_depth_;
-  std::vector<std::thread> workers_;
-  std::queue<std::function<void()>> queue_;
-  std::mutex mutex_;
-  std::condition_variable not_empty_;
-  std::condition_variable not_full_;
-  bool shutdown_ = false;
+  // Slot ids [p * max_queue_depth_, (p + 1) * max_queue_depth_) belong to
+  // priority p.
+  std::unique_ptr<Task[]> slots_;
+  std::array<std::unique_ptr<Lane>, kPriorities> lanes_;
+  // Admission control; a zero target turns it off. enqueued_at_ holds when
+  // each foreground slot was queued, in steady_clock nanoseconds.
+  int64_t sojourn_target_ns_;
+  int64_t sojourn_interval_ns_;
+  std::unique_ptr<int64_t[]> enqueued_at_;
+  // Since when every dequeued task has waited longer than the target, or
+  // kNever.
+  std::atomic<int64_t> above_target_since_;
+  std::atomic<bool> overloaded_{false};
+  std::vector<std::unique_ptr<Worker>> workers_;
+  // Indices of the workers pinned to each node.
+  std::vector<std::vector<uint32_t>> node_workers_;
+  // Parking: idle workers wait for wake_epoch_ to change.
+  std::atomic<uint32_t> wake_epoch_{0};
+  std::atomic<uint32_t> sleepers_{0};
+  // Submissions between their shutdown check and their push; workers do not
+  // exit while any is in progress, so no accepted task is lost.
+  std::atomic<uint32_t> submitting_{0};
+  std::atomic<bool> shutdown_{false};
 };
 
 } // namespace kvstore
@@ -0,0 +1,162 @@
+#include "timing_wheel.hpp"
+
+#include <algorithm>
+
+namespace kvstore {
+
+namespace {
+
+constexpr uint64_t level_span(size_t level) {
+  return uint64_t{1} << (6 * level);
+}
+
+} // namespace
+
+TimingWheel::TimingWheel(Clock::time_point origin) : origin_(origin) {
+  heads_.fill(kNoTimer);
+}
+
+uint64_t TimingWheel::deadline_tick(Clock::time_point deadline) const {
+  if (deadline <= origin_) {
+    return 0;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - origin_).count();
+  auto resolution = std::chrono::duration_cast<std::chrono::nanoseconds>(kResolution).count();
+  // Round up so a timer never fires before its deadline.
+  return static_cast<uint64_t>((elapsed + resolution - 1) / resolution);
+}
+
+void TimingWheel::push(uint16_t list, uint32_t timer) {
+  Node& node = nodes_[timer];
+  node.list = list;
+  node.prev = kNoTimer;
+  node.next = heads_[list];
+  if (node.next != kNoTimer) {
+    nodes_[node.next].prev = timer;
+  }
+  heads_[list] = timer;
+}
+
+void TimingWheel::unlink(uint32_t timer) {
+  Node& node = nodes_[timer];
+  if (node.list == kUnlinked) {
+    return;
+  }
+  if (node.prev != kNoTimer) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    heads_[node.list] = node.next;
+  }
+  if (node.next != kNoTimer) {
+    nodes_[node.next].prev = node.prev;
+  }
+  node.prev = kNoTimer;
+  node.next = kNoTimer;
+  node.list = kUnlinked;
+}
+
+void TimingWheel::place(uint32_t timer) {
+  uint64_t tick = nodes_[timer].deadline_tick;
+  if (tick < current_tick_) {
+    push(kReadyList, timer);
+    return;
+  }
+  uint64_t delta = tick - current_tick_;
+  for (size_t level = 0; level < kLevels; ++level) {
+    if (delta < level_span(level + 1)) {
+      size_t slot = static_cast<size_t>(tick >> (kLevelBits * level)) & (kSlotsPerLevel - 1);
+      push(static_cast<uint16_t>(level * kSlotsPerLevel + slot), timer);
+      return;
+    }
+  }
+  // Beyond the wheel's range: park at the farthest top-level slot.
+  uint64_t parked = current_tick_ + level_span(kLevels) - 1;
+  size_t slot = static_cast<size_t>(parked >> (kLevelBits * (kLevels - 1))) & (kSlotsPerLevel - 1);
+  push(static_cast<uint16_t>((kLevels - 1) * kSlotsPerLevel + slot), timer);
+}
+
+uint32_t TimingWheel::schedule(uint64_t hash, Clock::time_point deadline) {
+  uint32_t timer;
+  if (!free_nodes_.empty()) {
+    timer = free_nodes_.back();
+    free_nodes_.pop_back();
+  } else {
+    timer = static_cast<uint32_t>(nodes_.size());
+    nodes_.emplace_back();
+  }
+  nodes_[timer] = Node{};
+  nodes_[timer].hash = hash;
+  nodes_[timer].deadline_tick = deadline_tick(deadline);
+  place(timer);
+  ++scheduled_;
+  return timer;
+}
+
+void TimingWheel::cancel(uint32_t timer) {
+  unlink(timer);
+  free_nodes_.push_back(timer);
+  --scheduled_;
+}
+
+void TimingWheel::cascade(size_t level) {
+  size_t slot = static_cast<size_t>(current_tick_ >> (kLevelBits * level)) & (kSlotsPerLevel - 1);
+  uint16_t list = static_cast<uint16_t>(level * kSlotsPerLevel + slot);
+  uint32_t timer = heads_[list];
+  heads_[list] = kNoTimer;
+  while (timer != kNoTimer) {
+    uint32_t next = nodes_[timer].next;
+    nodes_[timer].list = kUnlinked;
+    place(timer);
+    timer = next;
+  }
+}
+
+void TimingWheel::advance(Clock::time_point now) {
+  if (now < origin_) {
+    return;
+  }
+  auto resolution = std::chrono::duration_cast<std::chrono::nanoseconds>(kResolution).count();
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - origin_).count();
+  uint64_t target = static_cast<uint64_t>(elapsed / resolution);
+  if (scheduled_ == 0) {
+    // Nothing to cascade; the slot positions can jump straight ahead.
+    current_tick_ = std::max(current_tick_, target + 1);
+    return;
+  }
+  while (current_tick_ <= target) {
+    uint16_t list = static_cast<uint16_t>(current_tick_ & (kSlotsPerLevel - 1));
+    uint32_t timer = heads_[list];
+    heads_[list] = kNoTimer;
+    while (timer != kNoTimer) {
+      uint32_t next = nodes_[timer].next;
+      nodes_[timer].list = kUnlinked;
+      if (nodes_[timer].deadline_tick <= current_tick_) {
+        push(kReadyList, timer);
+      } else {
+        place(timer);
+      }
+      timer = next;
+    }
+    ++current_tick_;
+    // Higher levels first so their timers land in lower-level slots before
+    // those cascade in turn.
+    for (size_t level = kLevels - 1; level >= 1; --level) {
+      if (current_tick_ % level_span(level) == 0) {
+        cascade(level);
+      }
+    }
+  }
+}
+
+size_t TimingWheel::collect_due(Clock::time_point now, size_t max_timers, std::vector<uint32_t>& due) {
+  advance(now);
+  size_t collected = 0;
+  for (uint32_t timer = heads_[kReadyList]; timer != kNoTimer && collected < max_timers;
+       timer = nodes_[timer].next) {
+    due.push_back(timer);
+    ++collected;
+  }
+  return collected;
+}
+
+} // namespace kvstore
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace kvstore {
+
+// Hierarchical timing wheel indexing key expirations for one shard. Four
+// levels of 64 slots cover 64^4 ticks of kResolution; a timer sits in the
+// level whose span covers its distance from the current tick and cascades one
+// level down each time the wheel reaches its slot, so advancing costs time
+// proportional to the elapsed ticks and the number of due timers, never to the
+// number of scheduled ones. Deadlines past the top level are parked in its
+// last reachable slot and re-placed when that slot cascades.
+//
+// Like TinyLfuPolicy, timers are identified by a node id handed out on
+// schedule() and remember only the key hash; the caller keeps the id next to
+// its entry. Not thread-safe; the owning shard's lock guards it.
+class TimingWheel {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr uint32_t kNoTimer = std::numeric_limits<uint32_t>::max();
+  static constexpr std::chrono::milliseconds kResolution{10};
+
+  explicit TimingWheel(Clock::time_point origin = Clock::now());
+
+  uint32_t schedule(uint64_t hash, Clock::time_point deadline);
+  void cancel(uint32_t timer);
+
+  // Advances the wheel to `now` and appends up to `max_timers` due timers to
+  // `due`. Due timers stay scheduled until cancelled, so a caller that cannot
+  // act on one must cancel it to make progress. Returns the number appended.
+  size_t collect_due(Clock::time_point now, size_t max_timers, std::vector<uint32_t>& due);
+
+  uint64_t hash_of(uint32_t timer) const { return nodes_[timer].hash; }
+  size_t size() const { return scheduled_; }
+  size_t allocated_bytes() const { return nodes_.capacity() * sizeof(Node) + free_nodes_.capacity() * sizeof(uint32_t); }
+
+ private:
+  static constexpr unsigned kLevelBits = 6;
+  static constexpr size_t kSlotsPerLevel = size_t{1} << kLevelBits;
+  static constexpr size_t kLevels = 4;
+  // Timers that are already due wait in this extra list.
+  static constexpr uint16_t kReadyList = kLevels * kSlotsPerLevel;
+  static constexpr uint16_t kUnlinked = std::numeric_limits<uint16_t>::max();
+
+  struct Node {
+    uint64_t hash = 0;
+    uint64_t deadline_tick = 0;
+    uint32_t prev = kNoTimer;
+    uint32_t next = kNoTimer;
+    uint16_t list = kUnlinked;
+  };
+
+  uint64_t deadline_tick(Clock::time_point deadline) const;
+  void place(uint32_t timer);
+  void push(uint16_t list, uint32_t timer);
+  void unlink(uint32_t timer);
+  void cascade(size_t level);
+  void advance(Clock::time_point now);
+
+  Clock::time_point origin_;
+  // Next tick whose level-0 slot has not been processed yet.
+  uint64_t current_tick_ = 0;
+  size_t scheduled_ = 0;
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> free_nodes_;
+  std::array<uint32_t, kLevels * kSlotsPerLevel + 1> heads_;
+};
+
+} // namespace kvstore
@@ -0,0 +1,56 @@
+#include "value_ref.hpp"
+
+#include <atomic>
+#include <new>
+
+namespace kvstore {
+
+namespace {
+
+std::atomic_ref<uint32_t> refs_of(char* item) {
+  return std::atomic_ref<uint32_t>(*std::launder(reinterpret_cast<uint32_t*>(item)));
+}
+
+} // namespace
+
+void init_item_refs(char* item) {
+  new (item) uint32_t(1);
+}
+
+void retain_item(char* item) {
+  refs_of(item).fetch_add(1, std::memory_order_relaxed);
+}
+
+bool release_item(char* item) {
+  return refs_of(item).fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
+
+uint32_t item_refs(const char* item) {
+  return refs_of(const_cast<char*>(item)).load(std::memory_order_acquire);
+}
+
+ValueRef& ValueRef::operator=(ValueRef&& other) noexcept {
+  if (this != &other) {
+    reset();
+    copy_ = std::move(other.copy_);
+    arena_ = other.arena_;
+    item_ = other.item_;
+    item_bytes_ = other.item_bytes_;
+    size_class_ = other.size_class_;
+    shared_ = other.shared_;
+    other.item_ = nullptr;
+    other.shared_ = {};
+  }
+  return *this;
+}
+
+void ValueRef::reset() {
+  if (item_ != nullptr && release_item(item_)) {
+    arena_->deallocate(item_, item_bytes_, size_class_);
+  }
+  item_ = nullptr;
+  shared_ = {};
+  copy_.clear();
+}
+
+} // namespace kvstore
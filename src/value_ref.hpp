@@ -0,0 +1,56 @@
+#pragma once
+
+#include "slab_arena.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace kvstore {
+
+// Store items that can be shared with readers begin with a 32-bit reference
+// count. The store holds one reference while the item is linked; every
+// ValueRef handed out holds another, and whoever drops the last one frees the
+// chunk. A shared item is never written again, so a reader can keep using it
+// after releasing the shard lock, even if the key is overwritten or removed.
+inline constexpr size_t kItemHeaderBytes = sizeof(uint32_t);
+
+void init_item_refs(char* item);
+void retain_item(char* item);
+// Returns true when the caller dropped the last reference.
+bool release_item(char* item);
+uint32_t item_refs(const char* item);
+
+// A value read from the store. Large values are shared with the store by
+// reference count and never copied; small values are copied out, since that
+// is cheaper than touching a shared counter. Must not outlive the store.
+class ValueRef {
+ public:
+  ValueRef() = default;
+  explicit ValueRef(std::string copy) : copy_(std::move(copy)) {}
+  // Adopts one reference to `item`, which the caller has already taken.
+  ValueRef(SlabArena& arena, char* item, size_t item_bytes, uint8_t size_class, std::string_view value)
+      : arena_(&arena), item_(item), item_bytes_(item_bytes), size_class_(size_class), shared_(value) {}
+  ~ValueRef() { reset(); }
+
+  ValueRef(ValueRef&& other) noexcept { *this = std::move(other); }
+  ValueRef& operator=(ValueRef&& other) noexcept;
+  ValueRef(const ValueRef&) = delete;
+  ValueRef& operator=(const ValueRef&) = delete;
+
+  std::string_view view() const { return item_ != nullptr ? shared_ : std::string_view(copy_); }
+  size_t size() const { return view().size(); }
+  bool shared() const { return item_ != nullptr; }
+  void reset();
+
+ private:
+  std::string copy_;
+  SlabArena* arena_ = nullptr;
+  char* item_ = nullptr;
+  size_t item_bytes_ = 0;
+  uint8_t size_class_ = 0;
+  std::string_view shared_;
+};
+
+} // namespace kvstore
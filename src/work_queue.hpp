@@ -0,0 +1,213 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace kvstore {
+
+// Lock-free bounded multi-producer multi-consumer queue of trivially copyable
+// values (Vyukov's design). Each cell carries a sequence number that says
+// whether it is ready for the producer or the consumer of a given lap, so
+// producers and consumers only contend on their own index and never on each
+// other. The capacity is rounded up to a power of two.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity)
+      : mask_(std::bit_ceil(capacity < 2 ? size_t{2} : capacity) - 1), cells_(std::make_unique<Cell[]>(mask_ + 1)) {
+    for (size_t i = 0; i <= mask_; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // Returns false when the queue is full.
+  bool try_push(T value) {
+    size_t position = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[position & mask_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      auto lag = static_cast<std::ptrdiff_t>(sequence - position);
+      if (lag == 0) {
+        if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          cell.value = value;
+          cell.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (lag < 0) {
+        return false;
+      } else {
+        position = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // A snapshot that may be stale by the time the caller acts on it.
+  bool empty() const { return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_relaxed); }
+
+  // Returns false when the queue is empty.
+  bool try_pop(T& value) {
+    size_t position = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[position & mask_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      auto lag = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+      if (lag == 0) {
+        if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          value = cell.value;
+          cell.sequence.store(position + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (lag < 0) {
+        return false;
+      } else {
+        position = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) std::atomic<size_t> head_{0};
+};
+
+// Chase-Lev work-stealing deque of 32-bit ids, with the memory orders of Lê et
+// al., "Correct and Efficient Work-Stealing for Weak Memory Models". The owning
+// thread pushes and pops at the bottom without contention; other threads steal
+// from the top with one compare-and-swap. The ring does not grow: callers must
+// never hold more than `capacity` ids in it at once.
+class WorkStealingDeque {
+ public:
+  static constexpr uint32_t kEmpty = UINT32_MAX;
+
+  explicit WorkStealingDeque(size_t capacity)
+      : mask_(std::bit_ceil(capacity < 2 ? size_t{2} : capacity) - 1),
+        ring_(std::make_unique<std::atomic<uint32_t>[]>(mask_ + 1)) {}
+
+  WorkStealingDeque(const WorkStealingDeque&) = delete;
+  WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+  // Owner only.
+  void push(uint32_t id) {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    ring_[static_cast<size_t>(bottom) & mask_].store(id, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only; takes the most recently pushed id.
+  uint32_t pop() {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_relaxed);
+    if (top > bottom) {
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return kEmpty;
+    }
+    uint32_t id = ring_[static_cast<size_t>(bottom) & mask_].load(std::memory_order_relaxed);
+    if (top == bottom) {
+      // The last id: race the thieves for it.
+      if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        id = kEmpty;
+      }
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return id;
+  }
+
+  // Any thread; takes the oldest id. Returns kEmpty when the deque is empty or
+  // another thread won the race for its top.
+  uint32_t steal() {
+    int64_t top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom) {
+      return kEmpty;
+    }
+    uint32_t id = ring_[static_cast<size_t>(top) & mask_].load(std::memory_order_relaxed);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+      return kEmpty;
+    }
+    return id;
+  }
+
+  // Any thread; a snapshot that may be stale by the time the caller acts on it.
+  bool empty() const { return top_.load(std::memory_order_relaxed) >= bottom_.load(std::memory_order_relaxed); }
+
+ private:
+  size_t mask_;
+  std::unique_ptr<std::atomic<uint32_t>[]> ring_;
+  alignas(64) std::atomic<int64_t> top_{0};
+  alignas(64) std::atomic<int64_t> bottom_{0};
+};
+
+// Lock-free bounded single-producer single-consumer ring of movable values
+// (Lamport's queue). Each side keeps a private copy of the other's index and
+// only reloads it when the ring looks full or empty, so in the steady state
+// neither side reads the other's cache line. The capacity is rounded up to a
+// power of two.
+template <typename T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(size_t capacity)
+      : mask_(std::bit_ceil(capacity < 2 ? size_t{2} : capacity) - 1), slots_(std::make_unique<T[]>(mask_ + 1)) {}
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  // Producer only. Returns false, leaving `value` alone, when the queue is full.
+  bool try_push(T& value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) {
+        return false;
+      }
+    }
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false when the queue is empty.
+  bool try_pop(T& value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return false;
+      }
+    }
+    value = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Any thread; a snapshot that may be stale by the time the caller acts on it.
+  bool empty() const { return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_relaxed); }
+
+ private:
+  size_t mask_;
+  std::unique_ptr<T[]> slots_;
+  // Consumer side.
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0;
+  // Producer side.
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t cached_head_ = 0;
+};
+
+} // namespace kvstore